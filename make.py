@@ -1,5 +1,5 @@
 #!/usr/bin/python
-import argparse, os
+import argparse, json, os, shlex, struct, subprocess, time
 
 p = argparse.ArgumentParser(description='c-chess-cli build script')
 p.add_argument('-c', '--compiler', help='Compiler', choices=['cc', 'gcc', 'clang', 'musl-gcc',
@@ -7,11 +7,16 @@ p.add_argument('-c', '--compiler', help='Compiler', choices=['cc', 'gcc', 'clang
 p.add_argument('-o', '--output', help='Output file', default='')
 p.add_argument('-d', '--debug', action='store_true', help='Debug compile')
 p.add_argument('-s', '--static', action='store_true', help='Static compile')
-p.add_argument('-p', '--task', help='Task to run', choices=['main', 'test', 'engine'], default='main')
+p.add_argument('-x', '--pext', help='PEXT slider attacks (auto: if the CPU has a fast PEXT)',
+    choices=['auto', 'yes', 'no'], default='auto')
+p.add_argument('-p', '--task', help='Task to run', choices=['main', 'test', 'engine', 'perft',
+    'bench'], default='main')
 args = p.parse_args()
 
 # Determine flags for: compilation, warning, and linking
-cflags = '-I./src -std=gnu11 -mpopcnt {}'.format('-DNDEBUG -Os -ffast-math -flto -s' if not args.debug else '-g -O1')
+cflags = '-I./src -std=gnu11 -mpopcnt {}'.format('-DNDEBUG -Os -ffast-math -flto=auto -s' if not args.debug else '-g -O1')
+if args.pext == 'yes': cflags += ' -mbmi2'
+elif args.pext == 'no': cflags += ' -DNO_PEXT'
 wflags = '-Wfatal-errors -Wall -Wextra -Wstrict-prototypes -Wsign-conversion -Wshadow -Wpadded'
 lflags ='-lpthread -lm'
 if args.static: lflags += ' -static'
@@ -20,19 +25,48 @@ def run(cmd):
     print('% ' + cmd)
     return os.system(cmd)
 
+def check(ok, what):
+    print(('ok: ' if ok else 'FAILED: ') + what)
+    if not ok: exit(1)
+
+def read_samples(fileName):
+    # Records of a binary sample file (see README), or None if its header is invalid
+    with open(fileName, 'rb') as f:
+        data = f.read()
+    magic, version, size = struct.unpack('=8sII', data[:16])
+    if magic != b'CCCLISMP' or version != 1 or size != 32 or (len(data) - 16) % size:
+        return None
+    return [data[i:i + size] for i in range(16, len(data), size)]
+
+def generate_tables():
+    # Bitboard and zobrist tables, as static data in src/tables.c (slider attacks indexed by magics
+    # and by PEXT, compiled according to --pext)
+    if run('{} -I./src -std=gnu11 {} src/tablegen.c src/util.c -o ./tablegen {}'.format(args.compiler,
+            wflags, lflags)) != 0:
+        return 1
+    status = run('./tablegen > src/tables.c')
+    os.remove('./tablegen')
+    return status
+
 def compile(program, output):
-    sources = 'src/bitboard.c src/gen.c src/position.c src/str.c src/util.c src/vec.c'
+    if generate_tables() != 0:
+        return 1
+
+    sources = 'src/bitboard.c src/gen.c src/position.c src/str.c src/tables.c src/util.c src/vec.c'
     if program == 'main':
-        sources += ' src/engine.c src/game.c src/jobs.c src/main.c src/openings.c src/options.c' \
-            ' src/seqwriter.c src/sprt.c src/workers.c'
+        sources += ' src/affinity.c src/checkpoint.c src/dedup.c src/engine.c src/game.c src/jobs.c' \
+            ' src/latency.c src/logring.c src/main.c src/metrics.c src/openings.c src/options.c' \
+            ' src/reactor.c src/remote.c src/seqwriter.c src/sprt.c src/tb.c src/workers.c'
     elif program == 'engine':
         sources += ' test/engine.c'
+    elif program == 'perft':
+        sources += ' test/bench.c'
 
     return run('{} {} {} {} -o {} {}'.format(args.compiler, cflags, wflags, sources, output, lflags))
 
 if args.task == 'test':
     if compile('engine', './test/engine') == 0 and compile('main', './c-chess-cli') == 0:
-        run('rm stdout* out*.pgn training.csv c-chess-cli.*.log log*')
+        run('rm stdout* out* training.csv c-chess-cli.*.log log*')
 
         print('\nRun tests:')
         run('./c-chess-cli -each cmd=./test/engine depth=6 option.Hash=4 ' \
@@ -51,6 +85,48 @@ if args.task == 'test':
         print('\nOverall signature:')
         run('cat stdout out1.pgn out2.pgn log training.csv |sha1sum')
 
+        print('\nCheck output files:')
+        games = './c-chess-cli -each "cmd=./test/engine 7" depth=4 -engine name=e1 -engine name=e2 ' \
+            '-openings file=test/chess960.epd srand=1 -repeat -games 100 -concurrency 4'
+        run(games + ' -pgn out3.pgn 2 -sample freq=1 file=out3.csv ordered=y > /dev/null')
+        run(games + ' -sample freq=1 format=bin file=out3.bin ordered=y > /dev/null')
+
+        # Same samples in both formats: score, turn and result of each record match the csv line
+        samples = read_samples('out3.bin')
+        with open('out3.csv') as f:
+            lines = [l.split(',') for l in f.read().splitlines()]
+        check(samples is not None and len(samples) == len(lines) > 0 and all(
+            struct.unpack('=iBxxB', r[24:]) == (int(l[1]), ' b ' in l[0], int(l[2]))
+            for r, l in zip(samples, lines)), 'binary samples (header, and records)')
+
+        # Kill a run (slowed down by engine latency) once its checkpoint has 10 games, then resume it:
+        # PGN and samples must be the same as those of the uninterrupted run
+        cmd = games.replace('engine 7', 'engine 7 latency=2') + ' -pgn out4.pgn 2 -sample freq=1 ' \
+            'format=bin file=out4.bin ordered=y -checkpoint out4.cp 0.1'
+        print('% ' + cmd)
+        p = subprocess.Popen(shlex.split(cmd), stdout=subprocess.DEVNULL)
+        written = 0
+        while written < 10 and p.poll() is None:
+            time.sleep(0.05)
+            if os.path.exists('out4.cp'):
+                with open('out4.cp') as f:
+                    written = int(f.read().split('\nwritten ')[1].split()[0])
+        interrupted = p.poll() is None
+        p.kill()
+        p.wait()
+        run(cmd + ' -resume > /dev/null')
+        check(interrupted and open('out4.pgn', 'rb').read() == open('out3.pgn', 'rb').read()
+            and open('out4.bin', 'rb').read() == open('out3.bin', 'rb').read(), 'checkpoint and resume')
+
+        # With dedup, no position repeats, and all positions of the run without dedup are still there
+        # (position: occupancy, pieces with castling rights, turn and en passant square)
+        run(games + ' -sample freq=1 format=bin file=out5.bin ordered=y dedup=1000000 > /dev/null')
+        positions = [r[:24] + r[28:30] for r in read_samples('out3.bin')]
+        unique = [r[:24] + r[28:30] for r in read_samples('out5.bin')]
+        check(len(set(positions)) < len(positions) and len(set(unique)) == len(unique)
+            and set(unique) == set(positions), 'sample dedup')
+        run('rm test/chess960.epd.idx')
+
 elif args.task == 'main':
     if args.output == '': args.output = './c-chess-cli'
     compile(args.task, args.output)
@@ -58,3 +134,45 @@ elif args.task == 'main':
 elif args.task == 'engine':
     if args.output == '': args.output = './test/engine'
     compile(args.task, args.output)
+
+elif args.task == 'perft':
+    if args.output == '': args.output = './test/bench'
+    if compile(args.task, args.output) == 0:
+        print('\nRun perft and benchmarks:')
+        if run('{} test/chess960.epd 3'.format(args.output)) != 0:
+            exit(1)
+
+elif args.task == 'bench':
+    # End to end throughput of c-chess-cli (game loop, engine I/O, writers), against the test engine
+    # acting as a load generator. The last run adds misbehaviour (time outs and illegal moves).
+    if compile('engine', './test/engine') == 0 and compile('main', './c-chess-cli') == 0:
+        print('\nRun end to end benchmarks:')
+        engine = '"cmd=./test/engine 0 lines=3 size=64 pv=8" depth=6'
+        levels = sorted({1, 2, 4, 8, os.cpu_count() or 1})
+        runs = [(c, engine, str(c)) for c in levels]
+        runs.append((levels[-1], '"cmd=./test/engine 0 lines=3 size=64 pv=8 timeouts=0.001 ' \
+            'illegal=0.001" depth=6 movetime=0.02', 'misbehave'))
+        results = []
+
+        for concurrency, each, label in runs:
+            start = time.time()
+            if run('./c-chess-cli -each {} -engine -engine name=e2 -openings file=test/chess960.epd ' \
+                    '-repeat -games 400 -concurrency {} -pgn bench.pgn 2 ' \
+                    '-sample freq=0.5 file=bench.csv -timing bench.json > /dev/null'.format(each,
+                    concurrency)) != 0:
+                exit(1)
+            elapsed = time.time() - start
+
+            with open('bench.json') as f:
+                timing = json.load(f)
+            moves = timing['total']['overhead']['n']
+            results.append({'bench': label, 'concurrency': concurrency,
+                'games_per_sec': round(400 / elapsed, 1), 'moves': moves,
+                'cli_cpu_per_move_usec': round(timing['cpu'] / max(moves, 1), 1),
+                'overhead_p50_usec': timing['total']['overhead']['p50'],
+                'overhead_p99_usec': timing['total']['overhead']['p99'],
+                'overhead_max_usec': timing['total']['overhead']['max']})
+
+        run('rm bench.pgn bench.csv bench.json test/chess960.epd.idx')
+        print()
+        for r in results: print(json.dumps(r))
@@ -0,0 +1,224 @@
+/*
+ * c-chess-cli, a command line interface for UCI chess engines. Copyright 2020 lucasart.
+ *
+ * c-chess-cli is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * c-chess-cli is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program. If
+ * not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef __linux__
+    #define _GNU_SOURCE
+    #include <sched.h>
+    #include <sys/syscall.h>
+    #include <linux/mempolicy.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "affinity.h"
+#include "util.h"
+#include "vec.h"
+
+#ifdef __linux__
+
+// Logical CPU, and its location in the topology
+typedef struct {
+    int cpu, core, package, node;
+} Cpu;
+
+static int read_int(const char *fmt, int cpu, int defaultValue)
+{
+    char fileName[128] = "";
+    snprintf(fileName, sizeof(fileName), fmt, cpu);
+    FILE *in = fopen(fileName, "re");
+    int value = defaultValue;
+
+    if (in) {
+        if (fscanf(in, "%d", &value) != 1)
+            value = defaultValue;
+
+        fclose(in);
+    }
+
+    return value;
+}
+
+static void read_nodes(Cpu *cpus)
+// Set cpus[].node, by parsing NUMA node cpu lists (eg. "0-3,8-11")
+{
+    for (int node = 0; node < 1024; node++) {
+        char fileName[128] = "";
+        snprintf(fileName, sizeof(fileName), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *in = fopen(fileName, "re");
+
+        if (!in)
+            continue;
+
+        int first = 0, last = 0;
+        char c = 0;
+
+        while (fscanf(in, "%d%c", &first, &c) >= 1) {
+            last = first;
+
+            if (c == '-' && fscanf(in, "%d%c", &last, &c) < 1)
+                c = 0;
+
+            for (size_t i = 0; i < vec_size(cpus); i++)
+                if (first <= cpus[i].cpu && cpus[i].cpu <= last)
+                    cpus[i].node = node;
+
+            if (c != ',')
+                break;
+        }
+
+        fclose(in);
+    }
+}
+
+static int cpu_cmp(const void *a, const void *b)
+// Order by (node, package, core, cpu), so that SMT siblings are adjacent
+{
+    const Cpu *c1 = a, *c2 = b;
+    return c1->node != c2->node ? c1->node - c2->node
+        : c1->package != c2->package ? c1->package - c2->package
+        : c1->core != c2->core ? c1->core - c2->core
+        : c1->cpu - c2->cpu;
+}
+
+static bool layout(const Cpu *cpus, int threads, bool sameNode)
+// Assign 'threads' CPUs to each worker, in order. If sameNode, the CPUs of a worker must be on the
+// same NUMA node (skipping the rest of a node that can't fit a worker). Returns false if there are
+// not enough CPUs.
+{
+    size_t next = 0;
+
+    for (size_t i = 0; i < vec_size(Workers); i++) {
+        if (sameNode)
+            while (next + (size_t)threads <= vec_size(cpus)
+                    && cpus[next].node != cpus[next + (size_t)threads - 1].node)
+                next++;
+
+        if (next + (size_t)threads > vec_size(cpus))
+            return false;
+
+        Worker *w = &Workers[i];
+        vec_clear(w->cpus);
+        w->node = sameNode ? cpus[next].node : -1;
+
+        for (int t = 0; t < threads; t++)
+            vec_push(w->cpus, cpus[next++].cpu);
+    }
+
+    return true;
+}
+
+void affinity_layout(int threads, bool noSmt)
+// Assign a disjoint set of CPUs to each worker, for its engines to run on. Engines of the same
+// worker take turns to think, so each worker needs 'threads' CPUs, being the largest number of
+// threads used by an engine. With noSmt, only one CPU per physical core is used. Report the layout
+// to stdout.
+{
+    cpu_set_t allowed;
+    DIE_IF(0, sched_getaffinity(0, sizeof(allowed), &allowed) < 0);
+
+    // Read the topology of the CPUs that we are allowed to use
+    Cpu *cpus = vec_init(Cpu);
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET((size_t)cpu, &allowed)) {
+            const Cpu c = {
+                .cpu = cpu,
+                .core = read_int("/sys/devices/system/cpu/cpu%d/topology/core_id", cpu, cpu),
+                .package = read_int("/sys/devices/system/cpu/cpu%d/topology/physical_package_id",
+                    cpu, 0),
+                .node = 0
+            };
+            vec_push(cpus, c);
+        }
+
+    read_nodes(cpus);
+    qsort(cpus, vec_size(cpus), sizeof(Cpu), cpu_cmp);
+
+    if (noSmt) {
+        // Keep only the first CPU of each physical core
+        size_t n = 0;
+
+        for (size_t i = 0; i < vec_size(cpus); i++)
+            if (!n || cpus[i].core != cpus[n - 1].core || cpus[i].package != cpus[n - 1].package
+                    || cpus[i].node != cpus[n - 1].node)
+                cpus[n++] = cpus[i];
+
+        vec_ptr(cpus)->size = n;
+    }
+
+    // Try to fit each worker in a single NUMA node first
+    if (!layout(cpus, threads, true) && !layout(cpus, threads, false))
+        DIE("-affinity: %zu workers with %d threads each need %zu CPUs, but only %zu are available\n",
+            vec_size(Workers), threads, vec_size(Workers) * (size_t)threads, vec_size(cpus));
+
+    vec_destroy(cpus);
+
+    for (size_t i = 0; i < vec_size(Workers); i++) {
+        const Worker *w = &Workers[i];
+        scope(str_destroy) str_t out = str_init();
+        str_cpy_fmt(&out, "[%i] affinity: cpus ", w->id);
+
+        for (size_t j = 0; j < vec_size(w->cpus); j++)
+            str_cat_fmt(&out, j ? ",%i" : "%i", w->cpus[j]);
+
+        if (w->node >= 0)
+            str_cat_fmt(&out, " (node %i)", w->node);
+
+        puts(out.buf);
+    }
+}
+
+bool affinity_apply(const Worker *w)
+// Called in the child process, after vfork(), and before exec(): the CPU set and memory policy are
+// inherited by the engine. Only system calls are allowed here (see engine_spawn()), so errors are
+// reported by returning false (with errno set).
+{
+    if (!vec_size(w->cpus))
+        return true;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    for (size_t i = 0; i < vec_size(w->cpus); i++)
+        CPU_SET((size_t)w->cpus[i], &set);
+
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+        return false;
+
+    // Prefer memory allocations on the local NUMA node. This is best effort: failure (eg. kernel
+    // without NUMA support) is ignored.
+    if (0 <= w->node && w->node < (int)(8 * sizeof(unsigned long))) {
+        const unsigned long nodeMask = 1UL << w->node;
+        syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodeMask, 8 * sizeof(nodeMask));
+    }
+
+    return true;
+}
+
+#else
+
+void affinity_layout(int threads, bool noSmt)
+{
+    (void)threads, (void)noSmt;
+    DIE("-affinity is only supported on Linux\n");
+}
+
+bool affinity_apply(const Worker *w)
+{
+    (void)w;
+    return true;
+}
+
+#endif
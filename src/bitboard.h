@@ -27,42 +27,191 @@ enum {UP = 8, DOWN = -8, LEFT = -1, RIGHT = 1};
 enum {WHITE, BLACK, NB_COLOR};
 enum {KNIGHT, BISHOP, ROOK, QUEEN, KING, PAWN, NB_PIECE};
 
-int opposite(int color);
-int push_inc(int color);
+typedef uint64_t bitboard_t;  // bitfield to represent a set of squares
+typedef uint16_t move_t;  // move encoding: from:6, to:6, prom: 4 (NB_PIECE if none)
 
-int square_from(int rank, int file);
-int rank_of(int square);
-int file_of(int square);
+// Generated at build time by tablegen.c (see make.py)
 
-int relative_rank(int color, int rank);
+extern const bitboard_t Rank[NB_RANK], File[NB_FILE];
+extern const bitboard_t PawnAttacks[NB_COLOR][NB_SQUARE], KnightAttacks[NB_SQUARE],
+    KingAttacks[NB_SQUARE];
+extern const bitboard_t Segment[NB_SQUARE][NB_SQUARE];
+extern const bitboard_t Ray[NB_SQUARE][NB_SQUARE];
 
-typedef uint16_t move_t;  // move encoding: from:6, to:6, prom: 4 (NB_PIECE if none)
+extern const bitboard_t BishopMagic[NB_SQUARE], RookMagic[NB_SQUARE];
+extern const bitboard_t BishopMask[NB_SQUARE], RookMask[NB_SQUARE];
+extern const unsigned BishopShift[NB_SQUARE], RookShift[NB_SQUARE];
+extern const unsigned BishopOffset[NB_SQUARE], RookOffset[NB_SQUARE];
+extern const bitboard_t BishopDB[0x1480], RookDB[0x19000];  // magic indexed
+extern const bitboard_t BishopPextDB[0x1480], RookPextDB[0x19000];  // PEXT indexed
 
-move_t move_build(int from, int to, int prom);
-int move_from(move_t m);
-int move_to(move_t m);
-int move_prom(move_t m);
+// Slider attacks are indexed by magic multiplication, or by PEXT (BMI2) on x86-64. Both tables are
+// always generated in src/tables.c. Compiled with -mbmi2, PEXT is always used (and only its tables
+// are compiled). Otherwise, bitboard.c chooses at startup where BishopAttacks and RookAttacks point.
+// See make.py --pext.
+#if defined(__x86_64__) && !defined(NO_PEXT)
+    #include <immintrin.h>
+    #define HAS_PEXT
+#endif
 
-typedef uint64_t bitboard_t;  // bitfield to represent a set of squares
+#if defined(HAS_PEXT) && defined(__BMI2__)
+    #define UsePext true
+#else
+    extern bool UsePext;
+#endif
+
+extern const bitboard_t *BishopAttacks, *RookAttacks;
+
+static inline int opposite(int color)
+{
+    BOUNDS(color, NB_COLOR);
+    return color ^ BLACK;  // branchless for: color == WHITE ? BLACK : WHITE
+}
+
+static inline int push_inc(int color)
+{
+    BOUNDS(color, NB_COLOR);
+    return UP - color * (UP - DOWN);  // branchless for: color == WHITE ? UP : DOWN
+}
+
+static inline int square_from(int rank, int file)
+{
+    BOUNDS(rank, NB_RANK);
+    BOUNDS(file, NB_FILE);
+    return NB_FILE * rank + file;
+}
+
+static inline int rank_of(int square)
+{
+    BOUNDS(square, NB_SQUARE);
+    return square / NB_FILE;
+}
+
+static inline int file_of(int square)
+{
+    BOUNDS(square, NB_SQUARE);
+    return square % NB_FILE;
+}
+
+static inline int relative_rank(int color, int rank)
+{
+    BOUNDS(color, NB_COLOR);
+    BOUNDS(rank, NB_RANK);
+    return rank ^ (RANK_8 * color);  // branchless for: color == WHITE ? rank : RANK_8 - rank
+}
+
+static inline move_t move_build(int from, int to, int prom)
+{
+    BOUNDS(from, NB_SQUARE);
+    BOUNDS(to, NB_SQUARE);
+    assert((unsigned)prom <= QUEEN || prom == NB_PIECE);
+    return (move_t)(from | (to << 6) | (prom << 12));
+}
+
+static inline int move_from(move_t m)
+{
+    return m & 077;
+}
+
+static inline int move_to(move_t m)
+{
+    return (m >> 6) & 077;
+}
+
+static inline int move_prom(move_t m)
+{
+    const unsigned prom = m >> 12;
+    assert(prom <= QUEEN || prom == NB_PIECE);
+    return (int)prom;
+}
+
+#ifdef HAS_PEXT
+static inline __attribute__((target("bmi2"))) unsigned pext_index(bitboard_t occ, bitboard_t mask)
+{
+    return (unsigned)_pext_u64(occ, mask);
+}
+#endif
+
+static inline unsigned slider_index(bitboard_t occ, bitboard_t mask, bitboard_t magic,
+    unsigned shift)
+{
+#ifdef HAS_PEXT
+    if (UsePext)
+        return pext_index(occ, mask);
+#endif
+
+    return (unsigned)(((occ & mask) * magic) >> shift);
+}
+
+bool bb_pext(void);  // slider attacks use PEXT, rather than magics
+
+static inline bitboard_t bb_bishop_attacks(int square, bitboard_t occ)
+{
+    BOUNDS(square, NB_SQUARE);
+    return BishopAttacks[BishopOffset[square] + slider_index(occ, BishopMask[square],
+        BishopMagic[square], BishopShift[square])];
+}
+
+static inline bitboard_t bb_rook_attacks(int square, bitboard_t occ)
+{
+    BOUNDS(square, NB_SQUARE);
+    return RookAttacks[RookOffset[square] + slider_index(occ, RookMask[square], RookMagic[square],
+        RookShift[square])];
+}
+
+static inline bool bb_test(bitboard_t b, int square)
+{
+    BOUNDS(square, NB_SQUARE);
+    return b & (1ULL << square);
+}
+
+static inline void bb_clear(bitboard_t *b, int square)
+{
+    BOUNDS(square, NB_SQUARE);
+    assert(bb_test(*b, square));
+    *b ^= 1ULL << square;
+}
+
+static inline void bb_set(bitboard_t *b, int square)
+{
+    BOUNDS(square, NB_SQUARE);
+    assert(!bb_test(*b, square));
+    *b ^= 1ULL << square;
+}
+
+static inline bitboard_t bb_shift(bitboard_t b, int i)
+{
+    assert(-63 <= i && i <= 63);  // oversized shift is undefined
+    return i > 0 ? b << i : b >> -i;
+}
 
-extern bitboard_t Rank[NB_RANK], File[NB_FILE];
-extern bitboard_t PawnAttacks[NB_COLOR][NB_SQUARE], KnightAttacks[NB_SQUARE], KingAttacks[NB_SQUARE];
-extern bitboard_t Segment[NB_SQUARE][NB_SQUARE];
-extern bitboard_t Ray[NB_SQUARE][NB_SQUARE];
+static inline int bb_lsb(bitboard_t b)
+{
+    assert(b);  // lsb(0) is undefined
+    return __builtin_ctzll(b);
+}
 
-bitboard_t bb_bishop_attacks(int square, bitboard_t occ);
-bitboard_t bb_rook_attacks(int square, bitboard_t occ);
+static inline int bb_msb(bitboard_t b)
+{
+    assert(b);  // msb(0) is undefined
+    return 63 - __builtin_clzll(b);
+}
 
-bool bb_test(bitboard_t b, int square);
-void bb_clear(bitboard_t *b, int square);
-void bb_set(bitboard_t *b, int square);
-bitboard_t bb_shift(bitboard_t b, int i);
+static inline int bb_pop_lsb(bitboard_t *b)
+{
+    const int square = bb_lsb(*b);
+    *b &= *b - 1;
+    return square;
+}
 
-int bb_lsb(bitboard_t b);
-int bb_msb(bitboard_t b);
-int bb_pop_lsb(bitboard_t *b);
+static inline bool bb_several(bitboard_t b)
+{
+    return b & (b - 1);
+}
 
-bool bb_several(bitboard_t b);
-int bb_count(bitboard_t b);
+static inline int bb_count(bitboard_t b)
+{
+    return __builtin_popcountll(b);
+}
 
 void bb_print(bitboard_t b);
@@ -0,0 +1,113 @@
+/*
+ * c-chess-cli, a command line interface for UCI chess engines. Copyright 2020 lucasart.
+ *
+ * c-chess-cli is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * c-chess-cli is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program. If
+ * not, see <http://www.gnu.org/licenses/>.
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "checkpoint.h"
+#include "str.h"
+#include "util.h"
+#include "vec.h"
+
+// Text format, one "key value" per line. Outcomes are one character per job.
+static const char Header[] = "c-chess-cli checkpoint";
+static const char Outcomes[] = "LDW";  // indexed by RESULT_LOSS, RESULT_DRAW, RESULT_WIN
+
+void checkpoint_save(const char *fileName, const Checkpoint *cp)
+{
+    scope(str_destroy) str_t out = str_init(), tmpName = str_init();
+    str_cpy_fmt(&out, "%s\nsrand %U\nwritten %U\npgn %I\nsample %I\noutcomes ", Header,
+        (uintmax_t)cp->srand, (uintmax_t)cp->written, (intmax_t)cp->pgnSize,
+        (intmax_t)cp->sampleSize);
+
+    for (size_t i = 0; i < vec_size(cp->outcomes); i++)
+        str_push(&out, cp->outcomes[i] >= 0 ? Outcomes[cp->outcomes[i]] : '.');
+
+    str_push(&out, '\n');
+
+    str_cpy_fmt(&tmpName, "%s.tmp", fileName);
+    FILE *f = fopen(tmpName.buf, "we");
+    DIE_IF(0, !f);
+    DIE_IF(0, fwrite(out.buf, 1, out.len, f) != out.len);
+    DIE_IF(0, fflush(f) < 0);
+    DIE_IF(0, fsync(fileno(f)) < 0);
+    DIE_IF(0, fclose(f) < 0);
+    DIE_IF(0, rename(tmpName.buf, fileName) < 0);
+}
+
+bool checkpoint_load(const char *fileName, Checkpoint *cp)
+{
+    const int fd = open(fileName, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0 && errno == ENOENT)
+        return false;
+
+    DIE_IF(0, fd < 0);
+
+    LineReader in = line_reader_init(fd);
+    scope(str_destroy) str_t key = str_init();
+    str_t line;  // view into in.buf
+    bool outcomes = false;
+
+    *cp = (Checkpoint){.pgnSize = -1, .sampleSize = -1};
+    cp->outcomes = vec_init(int8_t);
+
+    if (!line_reader_getline(&in, &line) || strcmp(line.buf, Header))
+        DIE("'%s' is not a c-chess-cli checkpoint\n", fileName);
+
+    while (line_reader_getline(&in, &line)) {
+        const char *tail = str_tok(line.buf, &key, " ");
+
+        if (!tail || !*tail)
+            DIE("'%s': invalid line '%s'\n", fileName, line.buf);
+
+        tail++;
+
+        if (!strcmp(key.buf, "srand"))
+            cp->srand = (uint64_t)strtoull(tail, NULL, 10);
+        else if (!strcmp(key.buf, "written"))
+            cp->written = (size_t)strtoull(tail, NULL, 10);
+        else if (!strcmp(key.buf, "pgn"))
+            cp->pgnSize = strtoll(tail, NULL, 10);
+        else if (!strcmp(key.buf, "sample"))
+            cp->sampleSize = strtoll(tail, NULL, 10);
+        else if (!strcmp(key.buf, "outcomes")) {
+            for (const char *c = tail; *c; c++) {
+                const char *o = strchr(Outcomes, *c);
+
+                if (*c != '.' && !o)
+                    DIE("'%s': invalid outcome '%c'\n", fileName, *c);
+
+                vec_push(cp->outcomes, (int8_t)(o ? o - Outcomes : -1));
+            }
+
+            outcomes = true;
+        } else
+            DIE("'%s': invalid line '%s'\n", fileName, line.buf);
+    }
+
+    if (!outcomes)
+        DIE("'%s': truncated checkpoint\n", fileName);
+
+    line_reader_destroy(&in);
+    DIE_IF(0, close(fd) < 0);
+    return true;
+}
+
+void checkpoint_destroy(Checkpoint *cp)
+{
+    vec_destroy(cp->outcomes);
+}
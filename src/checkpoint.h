@@ -0,0 +1,35 @@
+/*
+ * c-chess-cli, a command line interface for UCI chess engines. Copyright 2020 lucasart.
+ *
+ * c-chess-cli is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * c-chess-cli is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program. If
+ * not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Tournament state saved by -checkpoint, and restored by -resume. Only jobs whose output is written
+// are saved, so that resuming replays exactly the others.
+typedef struct {
+    int8_t *outcomes;  // vector: outcome of each job (RESULT_xxx), or -1 if not completed
+    uint64_t srand;
+    size_t written;  // ordered output files (PGN, ordered samples) contain jobs [0, written)
+    int64_t pgnSize, sampleSize;  // size of these files, at that point (-1 if all jobs are written)
+} Checkpoint;
+
+// Write to a temporary file first, then rename it, so that a crash never leaves a partial file
+void checkpoint_save(const char *fileName, const Checkpoint *cp);
+
+// Returns false if fileName does not exist
+bool checkpoint_load(const char *fileName, Checkpoint *cp);
+
+void checkpoint_destroy(Checkpoint *cp);
@@ -0,0 +1,122 @@
+/*
+ * c-chess-cli, a command line interface for UCI chess engines. Copyright 2020 lucasart.
+ *
+ * c-chess-cli is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * c-chess-cli is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program. If
+ * not, see <http://www.gnu.org/licenses/>.
+*/
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "dedup.h"
+#include "str.h"
+#include "util.h"
+
+static const char Magic[8] = "CCCLIKEY";
+
+KeySet key_set_init(uint64_t maxCount)
+{
+    KeySet ks = {.mask = 1};
+
+    while (ks.mask + 1 < maxCount + maxCount / 3)
+        ks.mask = 2 * ks.mask + 1;
+
+    ks.maxCount = (ks.mask + 1) / 4 * 3;
+    DIE_IF(0, !(ks.keys = calloc(ks.mask + 1, sizeof(*ks.keys))));
+    return ks;
+}
+
+void key_set_destroy(KeySet *ks)
+{
+    free(ks->keys);
+    *ks = (KeySet){0};
+}
+
+bool key_set_insert(KeySet *ks, uint64_t key)
+{
+    key = key ? key : 1;  // 0 marks empty slots
+
+    // Full table (count can overshoot maxCount by the number of concurrent inserts, which is fine)
+    if (atomic_load_explicit(&ks->count, memory_order_relaxed) >= ks->maxCount) {
+        atomic_fetch_add_explicit(&ks->unchecked, 1, memory_order_relaxed);
+        return true;
+    }
+
+    for (uint64_t i = key & ks->mask; ; i = (i + 1) & ks->mask) {
+        uint64_t slot = atomic_load_explicit(&ks->keys[i], memory_order_relaxed);
+
+        // Empty slot: claim it, unless another thread just did (with the same key, or another one,
+        // in which case we keep probing)
+        if (!slot && atomic_compare_exchange_strong_explicit(&ks->keys[i], &slot, key,
+                memory_order_relaxed, memory_order_relaxed)) {
+            atomic_fetch_add_explicit(&ks->count, 1, memory_order_relaxed);
+            return true;
+        }
+
+        if (slot == key) {
+            atomic_fetch_add_explicit(&ks->dropped, 1, memory_order_relaxed);
+            return false;
+        }
+    }
+}
+
+bool key_set_load(KeySet *ks, const char *fileName)
+{
+    FILE *f = fopen(fileName, "rbe");
+
+    if (!f && errno == ENOENT)
+        return false;
+
+    DIE_IF(0, !f);
+
+    char magic[sizeof(Magic)];
+    uint64_t buf[4096];
+    size_t n = 0;
+
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, Magic, sizeof(magic)))
+        DIE("'%s' is not a c-chess-cli key set\n", fileName);
+
+    while ((n = fread(buf, sizeof(*buf), sizeof(buf) / sizeof(*buf), f)))
+        for (size_t i = 0; i < n; i++)
+            key_set_insert(ks, buf[i]);
+
+    DIE_IF(0, ferror(f));
+    DIE_IF(0, fclose(f) < 0);
+
+    // Loaded keys are not duplicates of this run's samples
+    ks->dropped = ks->unchecked = 0;
+    return true;
+}
+
+void key_set_save(const KeySet *ks, const char *fileName)
+// Written to FILE.tmp, then renamed, so that an interrupted save leaves the previous file intact
+{
+    scope(str_destroy) str_t tmpName = str_init();
+    str_cpy_fmt(&tmpName, "%s.tmp", fileName);
+
+    FILE *f = fopen(tmpName.buf, "wbe");
+    DIE_IF(0, !f);
+    DIE_IF(0, fwrite(Magic, 1, sizeof(Magic), f) != sizeof(Magic));
+
+    for (uint64_t i = 0; i <= ks->mask; i++) {
+        const uint64_t key = atomic_load_explicit(&ks->keys[i], memory_order_relaxed);
+
+        if (key)
+            DIE_IF(0, fwrite(&key, sizeof(key), 1, f) != 1);
+    }
+
+    DIE_IF(0, fflush(f) < 0);
+    DIE_IF(0, fsync(fileno(f)) < 0);
+    DIE_IF(0, fclose(f) < 0);
+    DIE_IF(0, rename(tmpName.buf, fileName) < 0);
+}
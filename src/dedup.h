@@ -0,0 +1,40 @@
+/*
+ * c-chess-cli, a command line interface for UCI chess engines. Copyright 2020 lucasart.
+ *
+ * c-chess-cli is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * c-chess-cli is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program. If
+ * not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Concurrent set of position keys, used to drop duplicate samples across workers. Lock free open
+// addressing (linear probing, key = 0 means empty slot), filled up to 3/4 of its capacity: beyond
+// that, keys are no longer checked nor inserted.
+typedef struct {
+    _Atomic uint64_t *keys;
+    uint64_t mask;  // capacity - 1 (power of 2)
+    uint64_t maxCount;
+    _Atomic uint64_t count, dropped, unchecked;  // inserted, duplicates, and table full
+} KeySet;
+
+// Holds at least maxCount keys (rounded up to a power of 2)
+KeySet key_set_init(uint64_t maxCount);
+void key_set_destroy(KeySet *ks);
+
+// Returns false if key was already in the set
+bool key_set_insert(KeySet *ks, uint64_t key);
+
+// Binary file: "CCCLIKEY", followed by the keys (uint64_t[], native byte order). Load returns
+// false if the file does not exist.
+bool key_set_load(KeySet *ks, const char *fileName);
+void key_set_save(const KeySet *ks, const char *fileName);
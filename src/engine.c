@@ -22,7 +22,9 @@
 #endif
 
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
@@ -30,7 +32,9 @@
 #include <string.h>
 #include <sys/wait.h>
 
+#include "affinity.h"
 #include "engine.h"
+#include "reactor.h"
 #include "util.h"
 #include "vec.h"
 
@@ -51,46 +55,74 @@ static void engine_spawn(const Worker *w, Engine *e, const char *cwd, const char
     DIE_IF(w->id, pipe(into) < 0);
 #endif
 
+    // For stderr we have 2 choices:
+    // - readStdErr=true: dump it into stdout, like doing '2>&1' in bash. This is useful, if we
+    // want to see error messages from engines in their respective log file (notably assert()
+    // writes to stderr). Of course, such error messages should not be UCI commands, otherwise we
+    // will be fooled into parsing them as such.
+    // - readStdErr=false: do nothing, which means stderr is inherited from the parent process.
+    // Typcically, this means all engines write their error messages to the terminal (unless
+    // redirected otherwise).
+
+#ifdef __linux__
+    // vfork() does not copy the page tables of the parent, which is slow when the parent is big (eg.
+    // large opening index, and many threads). The calling thread is suspended until the child calls
+    // execvp() or _exit(). Meanwhile, the child borrows our memory, so it can only make system
+    // calls, and reports failure through childErrno.
+    volatile int childErrno = 0;
+    DIE_IF(w->id, (e->pid = vfork()) < 0);
+
+    if (e->pid == 0) {
+        // Delegate zombie purge to the kernel, restore SIGPIPE (ignored by us, and execvp() keeps
+        // ignored signals ignored), plug stdin and stdout (and stderr, see above), set cwd as
+        // current directory, and execute run with argv[]
+        if (prctl(PR_SET_PDEATHSIG, SIGHUP) == 0 && signal(SIGPIPE, SIG_DFL) != SIG_ERR
+                && affinity_apply(w)
+                && dup2(into[0], STDIN_FILENO) >= 0 && dup2(outof[1], STDOUT_FILENO) >= 0
+                && (!readStdErr || dup2(outof[1], STDERR_FILENO) >= 0) && chdir(cwd) == 0)
+            execvp(run, argv);
+
+        childErrno = errno;
+        _exit(EXIT_FAILURE);
+    }
+
+    if (childErrno) {
+        waitpid(e->pid, NULL, 0);
+        errno = childErrno;
+        DIE_IF(w->id, true);
+    }
+#else
     DIE_IF(w->id, (e->pid = fork()) < 0);
 
     if (e->pid == 0) {
-#ifdef __linux__
-        prctl(PR_SET_PDEATHSIG, SIGHUP);  // delegate zombie purge to the kernel
-#endif
+        DIE_IF(w->id, signal(SIGPIPE, SIG_DFL) == SIG_ERR);
+        DIE_IF(w->id, !affinity_apply(w));
+
         // Plug stdin and stdout
         DIE_IF(w->id, dup2(into[0], STDIN_FILENO) < 0);
         DIE_IF(w->id, dup2(outof[1], STDOUT_FILENO) < 0);
 
-        // For stderr we have 2 choices:
-        // - readStdErr=true: dump it into stdout, like doing '2>&1' in bash. This is useful, if we
-        // want to see error messages from engines in their respective log file (notably assert()
-        // writes to stderr). Of course, such error messages should not be UCI commands, otherwise we
-        // will be fooled into parsing them as such.
-        // - readStdErr=false: do nothing, which means stderr is inherited from the parent process.
-        // Typcically, this means all engines write their error messages to the terminal (unless
-        // redirected otherwise).
         if (readStdErr)
             DIE_IF(w->id, dup2(outof[1], STDERR_FILENO) < 0);
 
-#ifndef __linux__
         // Ugly (and slow) workaround for non-Linux POSIX systems that lack the ability to
         // atomically set O_CLOEXEC when creating pipes.
         for (int fd = 3; fd < sysconf(FOPEN_MAX); close(fd++));
-#endif
 
         // Set cwd as current directory, and execute run with argv[]
         DIE_IF(w->id, chdir(cwd) < 0);
         DIE_IF(w->id, execvp(run, argv) < 0);
-    } else {
-        assert(e->pid > 0);
+    }
+#endif
 
-        // in the parent process
-        DIE_IF(w->id, close(into[0]) < 0);
-        DIE_IF(w->id, close(outof[1]) < 0);
+    assert(e->pid > 0);
 
-        DIE_IF(w->id, !(e->in = fdopen(outof[0], "r")));
-        DIE_IF(w->id, !(e->out = fdopen(into[1], "w")));
-    }
+    // in the parent process
+    DIE_IF(w->id, close(into[0]) < 0);
+    DIE_IF(w->id, close(outof[1]) < 0);
+
+    e->in = line_reader_init(outof[0]);
+    DIE_IF(w->id, !(e->out = fdopen(into[1], "w")));
 }
 
 static void engine_parse_cmd(const char *cmd, str_t *cwd, str_t *run, str_t **args)
@@ -121,7 +153,9 @@ static void engine_parse_cmd(const char *cmd, str_t *cwd, str_t *run, str_t **ar
         vec_push(*args, str_init_from(token));
 }
 
-Engine engine_init(Worker *w, const char *cmd, const char *name, const str_t *options)
+Engine engine_start(Worker *w, const char *cmd, const char *name)
+// Spawn the engine process, and send "uci". The reply is parsed by engine_handshake(), separately,
+// so that several engines can initialize in parallel.
 {
     if (!*cmd)
         DIE("[%d] missing command to start engine.\n", w->id);
@@ -142,38 +176,42 @@ Engine engine_init(Worker *w, const char *cmd, const char *name, const str_t *op
         argv[i] = args[i].buf;
 
     // Spawn child process and plug pipes
-    engine_spawn(w, &e, cwd.buf, run.buf, argv, w->log != NULL);
+    engine_spawn(w, &e, cwd.buf, run.buf, argv, w->log || w->ring);
 
     vec_destroy_rec(args, str_destroy);
     free(argv);
 
     // Start the uci..uciok dialogue
-    deadline_set(w, e.name.buf, system_msec() + 4000);
     engine_writeln(w, &e, "uci");
-    scope(str_destroy) str_t line = str_init();
+    return e;
+}
+
+void engine_handshake(Worker *w, Engine *e, const char *name, const str_t *options)
+// Finish the uci..uciok dialogue started by engine_start(), and set options
+{
+    deadline_set(w, e->name.buf, system_msec() + 4000);
+    str_t line = {0};
 
     do {
-        engine_readln(w, &e, &line);
+        engine_readln(w, e, &line);
         const char *tail = NULL;
 
         // If no name was provided, parse it from "id name %s"
         if (!*name && (tail = str_prefix(line.buf, "id name ")))
-            str_cpy_c(&e.name, tail + strspn(tail, " "));
+            str_cpy_c(&e->name, tail + strspn(tail, " "));
 
         if ((tail = str_prefix(line.buf, "option name UCI_Chess960 ")))
-            e.supportChess960 = true;
+            e->supportChess960 = true;
     } while (strcmp(line.buf, "uciok"));
 
     deadline_clear(w);
 
     for (size_t i = 0; i < vec_size(options); i++) {
-        scope(str_destroy) str_t oname = str_init(), ovalue = str_init();
+        scope(str_destroy) str_t oname = str_init(), ovalue = str_init(), cmd = str_init();
         str_tok(str_tok(options[i].buf, &oname, "="), &ovalue, "=");
-        str_cpy_fmt(&line, "setoption name %S value %S", oname, ovalue);
-        engine_writeln(w, &e, line.buf);
+        str_cpy_fmt(&cmd, "setoption name %S value %S", oname, ovalue);
+        engine_writeln(w, e, cmd.buf);
     }
-
-    return e;
 }
 
 void engine_destroy(Worker *w, Engine *e)
@@ -185,36 +223,77 @@ void engine_destroy(Worker *w, Engine *e)
     deadline_clear(w);
 
     str_destroy(&e->name);
-    DIE_IF(w->id, fclose(e->in) < 0);
+    DIE_IF(w->id, close(e->in.fd) < 0);
+    line_reader_destroy(&e->in);
     DIE_IF(w->id, fclose(e->out) < 0);
 }
 
-void engine_readln(const Worker *w, const Engine *e, str_t *line)
+static bool engine_wait(const Worker *w, const Engine *e, int64_t timeLimit)
+// Wait for data on the pipe until timeLimit (INT64_MAX means forever). Returns false on time out.
+// With -reactor, the other games of this thread are played in the meantime.
 {
-    if (!str_getline(line, e->in))
-        DIE("[%d] could not read from %s\n", w->id, e->name.buf);
+    if (w->fiber)
+        return reactor_wait(w->fiber, e->in.fd, timeLimit);
+
+    struct pollfd pfd = {.fd = e->in.fd, .events = POLLIN};
+    int ready = 0;
 
-    if (w->log)
-        DIE_IF(w->id, fprintf(w->log, "%s -> %s\n", e->name.buf, line->buf) < 0);
+    do {
+        const int64_t timeout = timeLimit == INT64_MAX ? -1 : max(timeLimit - system_msec(), 0);
+        ready = poll(&pfd, 1, (int)min(timeout, (int64_t)INT_MAX));
+    } while (ready < 0 && errno == EINTR);
+
+    DIE_IF(w->id, ready < 0);
+    return ready > 0;
 }
 
-void engine_writeln(const Worker *w, const Engine *e, char *buf)
+bool engine_readln_until(const Worker *w, Engine *e, str_t *line, int64_t timeLimit)
+// Read a line from the engine, waiting at most until timeLimit. Returns false on time out.
+{
+    while (!line_reader_next(&e->in, line)) {
+        if (!engine_wait(w, e, timeLimit))
+            return false;  // time out
+
+        // End of file: return the last line, if it does not end with '\n'
+        if (!line_reader_fill(&e->in)) {
+            if (!line_reader_next(&e->in, line))
+                DIE("[%d] could not read from %s\n", w->id, e->name.buf);
+
+            break;
+        }
+    }
+
+    worker_log(w, LOG_READ, e->name.buf, line->buf);
+
+    return true;
+}
+
+void engine_readln(const Worker *w, Engine *e, str_t *line)
+{
+    engine_readln_until(w, e, line, INT64_MAX);
+}
+
+void engine_writeln_buffered(const Worker *w, const Engine *e, char *buf)
+// Same as engine_writeln(), but leaves the line in the stdio buffer, to be sent along with the next
+// engine_writeln() in a single write
 {
     DIE_IF(w->id, fputs(buf, e->out) < 0);
     DIE_IF(w->id, fputc('\n', e->out) < 0);
-    DIE_IF(w->id, fflush(e->out) < 0);
 
-    if (w->log) {
-        DIE_IF(w->id, fprintf(w->log, "%s <- %s\n", e->name.buf, buf) < 0);
-        DIE_IF(w->id, fflush(w->log) < 0);
-    }
+    worker_log(w, LOG_WRITE, e->name.buf, buf);
+}
+
+void engine_writeln(const Worker *w, const Engine *e, char *buf)
+{
+    engine_writeln_buffered(w, e, buf);
+    DIE_IF(w->id, fflush(e->out) < 0);
 }
 
-void engine_sync(Worker *w, const Engine *e)
+void engine_sync(Worker *w, Engine *e)
 {
     deadline_set(w, e->name.buf, system_msec() + 2000);
     engine_writeln(w, e, "isready");
-    scope(str_destroy) str_t line = str_init();
+    str_t line = {0};
 
     do {
         engine_readln(w, e, &line);
@@ -223,48 +302,112 @@ void engine_sync(Worker *w, const Engine *e)
     deadline_clear(w);
 }
 
-bool engine_bestmove(Worker *w, const Engine *e, int64_t *timeLeft, str_t *best, str_t *pv,
+static const char *next_token(const char *s, size_t *len)
+// Returns the next space delimited token in s, as a span (pointer to its start, and its length),
+// without copying. Returns NULL if there are no more tokens.
+{
+    s += strspn(s, " ");
+    *len = strcspn(s, " ");
+    return *len ? s : NULL;
+}
+
+#define token_is(token, len, keyword) \
+    ((len) == sizeof(keyword) - 1 && !memcmp(token, keyword, sizeof(keyword) - 1))
+
+static void parse_info(const char *line, const char *tail, Info *info, str_t *pv)
+// Single pass over an info line (tail follows "info "). Lines that carry nothing we want (string,
+// currmove, refutation, currline) are skipped on their first token. Only the last PV is kept.
+{
+    size_t len = 0;
+    const char *token = next_token(tail, &len);
+
+    if (!token || token_is(token, len, "string") || token_is(token, len, "currmove")
+            || token_is(token, len, "refutation") || token_is(token, len, "currline"))
+        return;
+
+    for (; token; token = next_token(token + len, &len)) {
+        // Integer fields: strtoll() stops at the space delimiter, no need to copy the token
+        if (token_is(token, len, "depth") || token_is(token, len, "seldepth")
+                || token_is(token, len, "hashfull") || token_is(token, len, "nodes")
+                || token_is(token, len, "nps") || token_is(token, len, "tbhits")) {
+            const char *name = token;
+            const size_t nameLen = len;
+
+            if (!(token = next_token(token + len, &len)))
+                break;
+
+            const long long value = strtoll(token, NULL, 10);
+
+            if (token_is(name, nameLen, "depth"))
+                info->depth = (int)value;
+            else if (token_is(name, nameLen, "seldepth"))
+                info->seldepth = (int)value;
+            else if (token_is(name, nameLen, "hashfull"))
+                info->hashfull = (int)value;
+            else if (token_is(name, nameLen, "nodes"))
+                info->nodes = value;
+            else if (token_is(name, nameLen, "nps"))
+                info->nps = value;
+            else
+                info->tbhits = value;
+        } else if (token_is(token, len, "score")) {
+            if (!(token = next_token(token + len, &len)))
+                break;
+
+            const bool cp = token_is(token, len, "cp"), mate = token_is(token, len, "mate");
+
+            if (!cp && !mate)
+                DIE("illegal syntax after 'score' in '%s'\n", line);
+
+            if (!(token = next_token(token + len, &len)))
+                break;
+
+            const int n = atoi(token);
+            info->score = cp ? n : n < 0 ? INT_MIN - n : INT_MAX - n;
+        } else if (token_is(token, len, "pv")) {
+            str_cpy_c(pv, token + len + strspn(token + len, " "));
+            break;  // rest of the line is the pv
+        } else if (token_is(token, len, "string"))
+            break;  // rest of the line is free text
+    }
+}
+
+bool engine_bestmove(Worker *w, Engine *e, int64_t *timeLeft, str_t *best, str_t *pv,
     Info *info)
 {
     int result = false;
-    scope(str_destroy) str_t line = str_init(), token = str_init();
+    str_t line = {0};
     str_clear(pv);
 
     const int64_t start = system_msec(), timeLimit = start + *timeLeft;
     deadline_set(w, e->name.buf, timeLimit + 1000);
 
+    const int64_t startUsec = system_usec();
+    int64_t parseUsec = 0;
+
     while (*timeLeft >= 0 && !result) {
-        engine_readln(w, e, &line);
+        // Wait for the engine until time is up, so that a silent engine can be stopped here
+        const bool ok = engine_readln_until(w, e, &line, timeLimit);
 
         const int64_t now = system_msec();
-        info->time = now - start;
         *timeLeft = timeLimit - now;
 
+        if (!ok)
+            break;
+
+        info->time = now - start;
+
+        const int64_t parseStart = system_usec();
         const char *tail = NULL;
 
-        if ((tail = str_prefix(line.buf, "info "))) {
-            while ((tail = str_tok(tail, &token, " "))) {
-                if (!strcmp(token.buf, "depth")) {
-                    if ((tail = str_tok(tail, &token, " ")))
-                        info->depth = atoi(token.buf);
-                } else if (!strcmp(token.buf, "score")) {
-                    if ((tail = str_tok(tail, &token, " "))) {
-                        if (!strcmp(token.buf, "cp") && (tail = str_tok(tail, &token, " ")))
-                            info->score = atoi(token.buf);
-                        else if (!strcmp(token.buf, "mate") && (tail = str_tok(tail, &token, " "))) {
-                            const int movesToMate = atoi(token.buf);
-                            info->score = movesToMate < 0 ? INT_MIN - movesToMate : INT_MAX - movesToMate;
-                        } else
-                            DIE("illegal syntax after 'score' in '%s'\n", line.buf);
-                    }
-                } else if (!strcmp(token.buf, "pv"))
-                    str_cpy_c(pv, tail + strspn(tail, " "));
-            }
-        } else if ((tail = str_prefix(line.buf, "bestmove "))) {
-            str_tok(tail, &token, " ");
-            str_cpy(best, token);
+        if ((tail = str_prefix(line.buf, "info ")))
+            parse_info(line.buf, tail, info, pv);
+        else if ((tail = str_prefix(line.buf, "bestmove "))) {
+            str_tok(tail, best, " ");
             result = true;
         }
+
+        parseUsec += system_usec() - parseStart;
     }
 
     // Time out. Send "stop" and give the opportunity to the engine to respond with bestmove (still
@@ -277,6 +420,9 @@ bool engine_bestmove(Worker *w, const Engine *e, int64_t *timeLeft, str_t *best,
         } while (!str_prefix(line.buf, "bestmove "));
     }
 
+    info->latency[STAGE_THINK] = system_usec() - startUsec - parseUsec;
+    info->latency[STAGE_PARSE] = parseUsec;
+
     deadline_clear(w);
     return result;
 }
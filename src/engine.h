@@ -17,13 +17,15 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <sys/types.h>
+#include "latency.h"
 #include "str.h"
 #include "workers.h"
 
 // Engine process
 typedef struct {
-    FILE *in, *out;
+    FILE *out;
     str_t name;
+    LineReader in;  // read end of the pipe (raw fd, polled for readiness)
     pid_t pid;
     bool supportChess960;
     char pad[3];
@@ -31,16 +33,23 @@ typedef struct {
 
 // Elements remembered from parsing info lines (for writing PGN comments)
 typedef struct {
-    int score, depth;
+    int score, depth, seldepth;
+    int hashfull;  // permill
     int64_t time;
+    int64_t nodes, nps, tbhits;
+    int64_t latency[NB_STAGE];  // time spent in each stage of the move (in usec)
 } Info;
 
-Engine engine_init(Worker *w, const char *cmd, const char *name, const str_t *options);
+Engine engine_start(Worker *w, const char *cmd, const char *name);
+void engine_handshake(Worker *w, Engine *e, const char *name, const str_t *options);
 void engine_destroy(Worker *w, Engine *e);
 
-void engine_readln(const Worker *w, const Engine *e, str_t *line);
+// 'line' is set to a view into the engine's read buffer, valid until the next read
+bool engine_readln_until(const Worker *w, Engine *e, str_t *line, int64_t timeLimit);
+void engine_readln(const Worker *w, Engine *e, str_t *line);
 void engine_writeln(const Worker *w, const Engine *e, char *buf);
+void engine_writeln_buffered(const Worker *w, const Engine *e, char *buf);
 
-void engine_sync(Worker *w, const Engine *e);
-bool engine_bestmove(Worker *w, const Engine *e, int64_t *timeLeft, str_t *best, str_t *pv,
+void engine_sync(Worker *w, Engine *e);
+bool engine_bestmove(Worker *w, Engine *e, int64_t *timeLeft, str_t *best, str_t *pv,
     Info *info);
@@ -13,31 +13,69 @@
  * not, see <http://www.gnu.org/licenses/>.
 */
 #include <limits.h>
+#include <string.h>
 #include "game.h"
 #include "gen.h"
+#include "tb.h"
 #include "util.h"
 #include "vec.h"
 
-static void uci_position_command(const Game *g, str_t *cmd)
-// Builds a string of the form "position fen ... [moves ...]". Implements rule50 pruning: start from
-// the last position that reset the rule50 counter, to reduce the move list to the minimum, without
-// losing information.
+static void game_replay(const Game *g, int ply, Position *pos)
+// Materializes the position at the given ply, by replaying moves from the initial position
 {
-    // Index of the starting FEN, where rule50 was last reset
-    const int ply0 = max(g->ply - g->pos[g->ply].rule50, 0);
+    *pos = g->start;
 
-    scope(str_destroy) str_t fen = str_init();
-    pos_get(&g->pos[ply0], &fen, g->sfen);
-    str_cpy_fmt(cmd, "position fen %S", fen);
+    for (int i = 1; i <= ply; i++) {
+        const Position before = *pos;
+        pos_move(pos, &before, g->history[i].move);
+    }
+}
+
+static void uci_position_command(Game *g, bool history)
+// Builds g->positionCmd, a string of the form "position fen ... [moves ...]". Implements rule50
+// pruning: start from the last position that reset the rule50 counter, to reduce the move list to
+// the minimum, without losing information. With history, start from the initial position instead
+// (written as "position startpos" if possible). The command is cached across plies: it is extended
+// in place with the moves played since the last call, and only rebuilt when its root changes.
+{
+    // Index of the starting FEN: initial position, or where rule50 was last reset
+    const int ply0 = history ? 0 : max(g->ply - g->pos.rule50, 0);
+
+    if (!g->positionCmd.len || ply0 != g->positionPly0) {
+        if (ply0 == g->ply)
+            g->positionPos = g->pos;
+        else
+            game_replay(g, ply0, &g->positionPos);
+
+        pos_get(&g->positionPos, &g->fen, g->sfen);
 
-    if (ply0 < g->ply) {
-        scope(str_destroy) str_t lan = str_init();
-        str_cat_c(cmd, " moves");
+        if (history
+                && !strcmp(g->fen.buf, "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"))
+            str_cpy_c(&g->positionCmd, "position startpos");
+        else
+            str_cpy_fmt(&g->positionCmd, "position fen %S", g->fen);
 
-        for (int ply = ply0 + 1; ply <= g->ply; ply++) {
-            pos_move_to_lan(&g->pos[ply - 1], g->pos[ply].lastMove, &lan);
-            str_cat(str_push(cmd, ' '), lan);
+        g->positionPly0 = g->positionPly = ply0;
+    }
+
+    if (g->positionPly < g->ply) {
+        if (g->positionPly == ply0)
+            str_cat_c(&g->positionCmd, " moves");
+
+        for (int ply = g->positionPly + 1; ply <= g->ply; ply++) {
+            const move_t m = g->history[ply].move;
+            pos_move_to_lan(&g->positionPos, m, &g->lan);
+            str_cat(str_push(&g->positionCmd, ' '), g->lan);
+
+            if (ply == g->ply)
+                g->positionPos = g->pos;
+            else {
+                const Position before = g->positionPos;
+                pos_move(&g->positionPos, &before, m);
+            }
         }
+
+        g->positionPly = g->ply;
     }
 }
 
@@ -56,7 +94,7 @@ static void uci_go_command(Game *g, const EngineOptions *eo[2], int ei, const in
         str_cat_fmt(cmd, " movetime %I", eo[ei]->movetime);
 
     if (eo[ei]->time || eo[ei]->increment) {
-        const int color = g->pos[g->ply].turn;
+        const int color = g->pos.turn;
 
         str_cat_fmt(cmd, " wtime %I winc %I btime %I binc %I",
             timeLeft[ei ^ color], eo[ei ^ color]->increment,
@@ -68,78 +106,92 @@ static void uci_go_command(Game *g, const EngineOptions *eo[2], int ei, const in
             eo[ei]->movestogo - ((g->ply / 2) % eo[ei]->movestogo));
 }
 
-static int game_apply_chess_rules(const Game *g, move_t **moves)
-// Applies chess rules to generate legal moves, and determine the state of the game
+static size_t repetition_slot(const Game *g, uint64_t key)
+// Slot of key in the repetition table, or the empty slot where it should be inserted
+{
+    size_t slot = key % NB_REPETITION_SLOT;
+
+    while (g->repetitionKeys[slot] && g->repetitionKeys[slot] != key)
+        slot = (slot + 1) % NB_REPETITION_SLOT;
+
+    return slot;
+}
+
+static void game_record(Game *g, move_t m)
+// Appends the current position to the history, and counts it in the repetition table. Positions
+// that precede the last rule50 reset can never be repeated, so the table is emptied on reset.
 {
-    const Position *pos = &g->pos[g->ply];
+    vec_push(g->history, ((History){.key = g->pos.key, .move = m, .rule50 = g->pos.rule50}));
 
-    *moves = gen_all_moves(pos, *moves);
+    if (!g->pos.rule50) {
+        memset(g->repetitionKeys, 0, sizeof(g->repetitionKeys));
+        memset(g->repetitionCounts, 0, sizeof(g->repetitionCounts));
+    }
 
-    if (!vec_size(*moves))
+    const size_t slot = repetition_slot(g, g->pos.key);
+    g->repetitionKeys[slot] = g->pos.key;
+    g->repetitionCounts[slot]++;
+}
+
+static void game_move(Game *g, move_t m)
+{
+    const Position before = g->pos;
+    pos_move(&g->pos, &before, m);
+    game_record(g, m);
+}
+
+static int game_apply_chess_rules(const Game *g)
+// Applies chess rules to determine the state of the game
+{
+    const Position *pos = &g->pos;
+
+    if (!gen_has_legal_move(pos))
         return pos->checkers ? STATE_CHECKMATE : STATE_STALEMATE;
     else if (pos->rule50 >= 100) {
         assert(pos->rule50 == 100);
         return STATE_FIFTY_MOVES;
     } else if (pos_insufficient_material(pos))
         return STATE_INSUFFICIENT_MATERIAL;
-    else {
-        // Scan for 3 repetitions
-        int repetitions = 1;
-
-        for (int i = 4; i <= pos->rule50 && i <= g->ply; i += 2)
-            if (g->pos[g->ply - i].key == pos->key && ++repetitions >= 3)
-                return STATE_THREEFOLD;
-    }
+    else if (g->repetitionCounts[repetition_slot(g, pos->key)] >= 3)
+        return STATE_THREEFOLD;
 
     return STATE_NONE;
 }
 
-static bool illegal_move(move_t move, const move_t *moves)
+static int game_apply_tablebase(const Game *g)
+// Tablebase adjudication (see -tb)
 {
-    for (size_t i = 0; i < vec_size(moves); i++)
-        if (moves[i] == move)
-            return false;
+    const int wdl = tb_probe_wdl(&g->pos);
 
-    return true;
+    return wdl == TB_WIN ? STATE_TB_WIN
+        : wdl == TB_LOSS ? STATE_TB_LOSS
+        : wdl == TB_DRAW ? STATE_TB_DRAW
+        : STATE_NONE;
 }
 
-static Position resolve_pv(const Worker *w, const Game *g, const char *pv)
+static int game_loser(const Game *g)
+// Color that lost the game (NB_COLOR for a draw). Decisive states are from the pov of the side to
+// move, which has lost, except for STATE_TB_WIN.
 {
-    scope(str_destroy) str_t token = str_init();
-    const char *tail = pv;
-
-    // Start with current position. We can't guarantee that the resolved position won't be in check,
-    // but a valid one must be returned.
-    Position resolved = g->pos[g->ply];
-
-    Position p[2];
-    p[0] = resolved;
-    int idx = 0;
-    move_t *moves = vec_init_reserve(64, move_t);
-
-    while ((tail = str_tok(tail, &token, " "))) {
-        const move_t m = pos_lan_to_move(&p[idx], token.buf);
-        moves = gen_all_moves(&p[idx], moves);
-
-        if (illegal_move(m, moves)) {
-            printf("[%d] WARNING: Illegal move in PV '%s%s' from %s\n", w->id, token.buf, tail,
-                g->names[g->pos[g->ply].turn].buf);
+    if (g->state > STATE_SEPARATOR)
+        return NB_COLOR;
 
-            if (w->log)
-                DIE_IF(w->id, fprintf(w->log, "WARNING: illegal move in PV '%s%s'\n", token.buf,
-                    tail) < 0);
+    return g->state == STATE_TB_WIN ? opposite(g->pos.turn) : g->pos.turn;
+}
 
-            break;
-        }
+static Position resolve_pv(const Worker *w, Game *g)
+// Resolves g->pv (see game_play())
+{
+    Position resolved;
+    const char *tail = pos_resolve_pv(&g->pos, g->pv.buf, &g->token, &resolved);
 
-        pos_move(&p[(idx + 1) % 2], &p[idx], m);
-        idx = (idx + 1) % 2;
+    if (tail) {
+        printf("[%d] WARNING: Illegal move in PV '%s%s' from %s\n", w->id, g->token.buf, tail,
+            g->names[g->pos.turn].buf);
 
-        if (!p[idx].checkers)
-            resolved = p[idx];
+        worker_note(w, "WARNING: illegal move in PV '%s%s'", g->token.buf, tail);
     }
 
-    vec_destroy(moves);
     return resolved;
 }
 
@@ -152,8 +204,14 @@ Game game_init(int round, int game)
 
     g.names[WHITE] = str_init();
     g.names[BLACK] = str_init();
+    g.positionCmd = str_init();
+
+    str_t *scratch[] = {&g.cmd, &g.best, &g.pv, &g.fen, &g.lan, &g.token, &g.result, &g.reason};
 
-    g.pos = vec_init(Position);
+    for (size_t i = 0; i < sizeof(scratch) / sizeof(*scratch); i++)
+        *scratch[i] = str_init();
+
+    g.history = vec_init(History);
     g.info = vec_init(Info);
     g.samples = vec_init(Sample);
 
@@ -162,10 +220,10 @@ Game game_init(int round, int game)
 
 bool game_load_fen(Game *g, const char *fen, int *color)
 {
-    vec_push(g->pos, (Position){0});
-
-    if (pos_set(&g->pos[0], fen, false, &g->sfen)) {
-        *color = g->pos[0].turn;
+    if (pos_set(&g->start, fen, false, &g->sfen)) {
+        g->pos = g->start;
+        game_record(g, 0);
+        *color = g->start.turn;
         return true;
     } else
         return false;
@@ -175,12 +233,53 @@ void game_destroy(Game *g)
 {
     vec_destroy(g->samples);
     vec_destroy(g->info);
-    vec_destroy(g->pos);
+    vec_destroy(g->history);
 
-    str_destroy_n(&g->names[WHITE], &g->names[BLACK]);
+    str_destroy_n(&g->names[WHITE], &g->names[BLACK], &g->positionCmd, &g->cmd, &g->best, &g->pv,
+        &g->fen, &g->lan, &g->token, &g->result, &g->reason);
+}
+
+void game_reset(Game *g, int round, int game)
+{
+    // Keep the buffers (with their allocated size), and zero everything else
+    *g = (Game){
+        .names = {g->names[WHITE], g->names[BLACK]},
+        .history = g->history, .info = g->info, .samples = g->samples,
+        .positionCmd = g->positionCmd, .cmd = g->cmd, .best = g->best, .pv = g->pv,
+        .fen = g->fen, .lan = g->lan, .token = g->token, .result = g->result, .reason = g->reason,
+        .round = round, .game = game
+    };
+
+    str_clear(&g->positionCmd);
+    vec_clear(g->history);
+    vec_clear(g->info);
+    vec_clear(g->samples);
 }
 
-int game_play(Worker *w, Game *g, const Options *o, const Engine engines[2],
+static int64_t stopwatch_lap(int64_t *lap)
+// Returns the time elapsed since *lap (in usec), and starts a new lap
+{
+    const int64_t now = system_usec(), elapsed = now - *lap;
+    *lap = now;
+    return elapsed;
+}
+
+static void record_latency(Worker *w, Info *info)
+// Computes the overhead of the move, and adds all stages to the worker's histograms
+{
+    info->latency[STAGE_OVERHEAD] = 0;
+
+    for (int s = 0; s < STAGE_OVERHEAD; s++) {
+        if (s != STAGE_THINK)
+            info->latency[STAGE_OVERHEAD] += info->latency[s];
+
+        histogram_add(&w->latency[s], info->latency[s]);
+    }
+
+    histogram_add(&w->latency[STAGE_OVERHEAD], info->latency[STAGE_OVERHEAD]);
+}
+
+int game_play(Worker *w, Game *g, const Options *o, Engine *engines[2],
     const EngineOptions *eo[2], bool reverse)
 // Play a game:
 // - engines[reverse] plays the first move (which does not mean white, that depends on the FEN)
@@ -188,39 +287,52 @@ int game_play(Worker *w, Game *g, const Options *o, const Engine engines[2],
 // - returns RESULT_LOSS/DRAW/WIN from engines[0] pov
 {
     for (int color = WHITE; color <= BLACK; color++)
-        str_cpy(&g->names[color], engines[color ^ g->pos[0].turn ^ reverse].name);
+        str_cpy(&g->names[color], engines[color ^ g->start.turn ^ reverse]->name);
 
     for (int i = 0; i < 2; i++) {
-        if (g->pos[0].chess960) {
-            if (engines[i].supportChess960)
-                engine_writeln(w, &engines[i], "setoption name UCI_Chess960 value true");
+        if (g->start.chess960) {
+            if (engines[i]->supportChess960)
+                engine_writeln(w, engines[i], "setoption name UCI_Chess960 value true");
             else
-                DIE("[%d] '%s' does not support Chess960\n", w->id, engines[i].name.buf);
+                DIE("[%d] '%s' does not support Chess960\n", w->id, engines[i]->name.buf);
         }
 
-        engine_writeln(w, &engines[i], "ucinewgame");
-        engine_sync(w, &engines[i]);
+        engine_writeln(w, engines[i], "ucinewgame");
+        engine_sync(w, engines[i]);
     }
 
-    scope(str_destroy) str_t cmd = str_init(), best = str_init();
     move_t played = 0;
     int drawPlyCount = 0;
     int resignCount[NB_COLOR] = {0};
     int ei = reverse;  // engines[ei] has the move
     int64_t timeLeft[2] = {eo[0]->time, eo[1]->time};
-    scope(str_destroy) str_t pv = str_init();
-    move_t *legalMoves = vec_init_reserve(64, move_t);
 
     for (g->ply = 0; ; ei = 1 - ei, g->ply++) {
+        Info info = {0};
+        int64_t lap = system_usec();
+
         if (played)
-            pos_move(&g->pos[g->ply], &g->pos[g->ply - 1], played);
+            game_move(g, played);
 
-        if ((g->state = game_apply_chess_rules(g, &legalMoves)))
+        if ((g->state = game_apply_chess_rules(g))
+                || (o->tbAdjudicate && (g->state = game_apply_tablebase(g))))
             break;
 
-        uci_position_command(g, &cmd);
-        engine_writeln(w, &engines[ei], cmd.buf);
-        engine_sync(w, &engines[ei]);
+        info.latency[STAGE_RULES] = stopwatch_lap(&lap);
+
+        // Pipelined engines get position and go in one write, without isready round trip. The clock
+        // starts when go is sent, either way (see engine_bestmove()).
+        uci_position_command(g, o->history);
+
+        if (eo[ei]->pipeline)
+            engine_writeln_buffered(w, engines[ei], g->positionCmd.buf);
+        else {
+            engine_writeln(w, engines[ei], g->positionCmd.buf);
+            info.latency[STAGE_COMMAND] = stopwatch_lap(&lap);
+
+            engine_sync(w, engines[ei]);
+            info.latency[STAGE_SYNC] = stopwatch_lap(&lap);
+        }
 
         // Prepare timeLeft[ei]
         if (eo[ei]->movetime)
@@ -237,26 +349,32 @@ int game_play(Worker *w, Game *g, const Options *o, const Engine engines[2],
             // Only depth and/or nodes limit
             timeLeft[ei] = INT64_MAX / 2;  // HACK: system_msec() + timeLeft must not overflow
 
-        uci_go_command(g, eo, ei, timeLeft, &cmd);
-        engine_writeln(w, &engines[ei], cmd.buf);
+        uci_go_command(g, eo, ei, timeLeft, &g->cmd);
+        engine_writeln(w, engines[ei], g->cmd.buf);
+        info.latency[STAGE_COMMAND] += stopwatch_lap(&lap);
 
-        Info info = {0};
-        const bool ok = engine_bestmove(w, &engines[ei], &timeLeft[ei], &best, &pv, &info);
-        vec_push(g->info, info);
+        // engine_bestmove() splits its own time into STAGE_THINK and STAGE_PARSE
+        const bool ok = engine_bestmove(w, engines[ei], &timeLeft[ei], &g->best, &g->pv,
+            &info);
+        stopwatch_lap(&lap);
 
         // Parses the last PV sent. An invalid PV is not fatal, but logs some warnings. Keep track
         // of the resolved position, which is the last in the PV that is not in check (or the
         // current one if that's impossible).
-        Position resolved = resolve_pv(w, g, pv.buf);
+        Position resolved = resolve_pv(w, g);
+        info.latency[STAGE_PV] = stopwatch_lap(&lap);
+
+        record_latency(w, &info);
+        vec_push(g->info, info);
 
         if (!ok) {  // engine_bestmove() time out before parsing a bestmove
             g->state = STATE_TIME_LOSS;
             break;
         }
 
-        played = pos_lan_to_move(&g->pos[g->ply], best.buf);
+        played = pos_lan_to_move(&g->pos, g->best.buf);
 
-        if (illegal_move(played, legalMoves)) {
+        if (!pos_move_is_legal(&g->pos, played)) {
             g->state = STATE_ILLEGAL_MOVE;
             break;
         }
@@ -285,9 +403,9 @@ int game_play(Worker *w, Game *g, const Options *o, const Engine engines[2],
             resignCount[ei] = 0;
 
         // Write sample: position (compactly encoded) + score
-        if (prngf(&w->seed) <= o->sampleFrequency) {
+        if (prngf(&g->seed) <= o->sampleFrequency) {
             Sample sample = {
-                .pos = o->sampleResolvePv ? resolved : g->pos[g->ply],
+                .pos = o->sampleResolvePv ? resolved : g->pos,
                 .score = info.score,
                 .result = NB_RESULT // unknown yet (use invalid state for now)
             };
@@ -297,24 +415,26 @@ int game_play(Worker *w, Game *g, const Options *o, const Engine engines[2],
             if (!o->sampleResolvePv || !sample.pos.checkers)
                 vec_push(g->samples, sample);
         }
-
-        vec_push(g->pos, (Position){0});
     }
 
     assert(g->state != STATE_NONE);
-    vec_destroy(legalMoves);
 
-    // Signed result from white's pov: -1 (loss), 0 (draw), +1 (win)
-    const int wpov = g->state < STATE_SEPARATOR
-        ? (g->pos[g->ply].turn == WHITE ? RESULT_LOSS : RESULT_WIN)  // lost from turn's pov
-        : RESULT_DRAW;
+    if (g->state == STATE_TIME_LOSS)
+        worker_dump(w, "time loss");
+
+    // Result from white's pov
+    const int loser = game_loser(g);
+    const int wpov = loser == NB_COLOR ? RESULT_DRAW : loser == WHITE ? RESULT_LOSS : RESULT_WIN;
 
     for (size_t i = 0; i < vec_size(g->samples); i++)
         g->samples[i].result = g->samples[i].pos.turn == WHITE ? wpov : 2 - wpov;
 
-    return g->state < STATE_SEPARATOR
-        ? (ei == 0 ? RESULT_LOSS : RESULT_WIN)  // engine on the move has lost
-        : RESULT_DRAW;
+    // engines[ei] is on the move
+    const int engineLoser = loser == g->pos.turn ? ei : 1 - ei;
+
+    return loser == NB_COLOR ? RESULT_DRAW
+        : engineLoser == 0 ? RESULT_LOSS
+        : RESULT_WIN;
 }
 
 void game_decode_state(const Game *g, str_t *result, str_t *reason)
@@ -326,7 +446,7 @@ void game_decode_state(const Game *g, str_t *result, str_t *reason)
         str_cpy_c(result, "*");
         str_cpy_c(reason, "unterminated");
     } else if (g->state == STATE_CHECKMATE) {
-        str_cpy_c(result, g->pos[g->ply].turn == WHITE ? "0-1" : "1-0");
+        str_cpy_c(result, g->pos.turn == WHITE ? "0-1" : "1-0");
         str_cpy_c(reason, "checkmate");
     } else if (g->state == STATE_STALEMATE)
         str_cpy_c(reason, "stalemate");
@@ -337,41 +457,44 @@ void game_decode_state(const Game *g, str_t *result, str_t *reason)
     else if (g->state ==STATE_INSUFFICIENT_MATERIAL)
         str_cpy_c(reason, "insufficient material");
     else if (g->state == STATE_ILLEGAL_MOVE) {
-        str_cpy_c(result, g->pos[g->ply].turn == WHITE ? "0-1" : "1-0");
+        str_cpy_c(result, g->pos.turn == WHITE ? "0-1" : "1-0");
         str_cpy_c(reason, "rules infraction");
     } else if (g->state == STATE_DRAW_ADJUDICATION)
         str_cpy_c(reason, "adjudication");
     else if (g->state == STATE_RESIGN) {
-        str_cpy_c(result, g->pos[g->ply].turn == WHITE ? "0-1" : "1-0");
+        str_cpy_c(result, g->pos.turn == WHITE ? "0-1" : "1-0");
         str_cpy_c(reason, "adjudication");
     } else if (g->state == STATE_TIME_LOSS) {
-        str_cpy_c(result, g->pos[g->ply].turn == WHITE ? "0-1" : "1-0");
+        str_cpy_c(result, g->pos.turn == WHITE ? "0-1" : "1-0");
         str_cpy_c(reason, "time forfeit");
-    } else
+    } else if (g->state == STATE_TB_LOSS || g->state == STATE_TB_WIN) {
+        str_cpy_c(result, game_loser(g) == WHITE ? "0-1" : "1-0");
+        str_cpy_c(reason, "tablebase");
+    } else if (g->state == STATE_TB_DRAW)
+        str_cpy_c(reason, "tablebase");
+    else
         assert(false);
 }
 
-void game_export_pgn(const Game *g, int verbosity, str_t *out)
+void game_export_pgn(Game *g, int verbosity, str_t *out)
 {
     str_cpy_fmt(out, "[Round \"%i.%i\"]\n", g->round + 1, g->game + 1);
     str_cat_fmt(out, "[White \"%S\"]\n", g->names[WHITE]);
     str_cat_fmt(out, "[Black \"%S\"]\n", g->names[BLACK]);
 
     // Result in PGN format "1-0", "0-1", "1/2-1/2" (from white pov)
-    scope(str_destroy) str_t result = str_init(), reason = str_init();
-    game_decode_state(g, &result, &reason);
-    str_cat_fmt(out, "[Result \"%S\"]\n", result);
-    str_cat_fmt(out, "[Termination \"%S\"]\n", reason);
+    game_decode_state(g, &g->result, &g->reason);
+    str_cat_fmt(out, "[Result \"%S\"]\n", g->result);
+    str_cat_fmt(out, "[Termination \"%S\"]\n", g->reason);
 
-    scope(str_destroy) str_t fen = str_init();
-    pos_get(&g->pos[0], &fen, g->sfen);
-    str_cat_fmt(out, "[FEN \"%S\"]\n", fen);
+    pos_get(&g->start, &g->fen, g->sfen);
+    str_cat_fmt(out, "[FEN \"%S\"]\n", g->fen);
 
-    if (g->pos[0].chess960)
+    if (g->start.chess960)
         str_cat_c(out, "[Variant \"Chess960\"]\n");
 
     str_cat_fmt(out, "[PlyCount \"%i\"]\n", g->ply);
-    scope(str_destroy) str_t san = str_init();
+    str_t *san = &g->lan;
 
     if (verbosity > 0) {
         // Print the moves
@@ -379,20 +502,27 @@ void game_export_pgn(const Game *g, int verbosity, str_t *out)
 
         const int pliesPerLine = verbosity == 2 ? 6
             : verbosity == 3 ? 5
+            : verbosity == 4 ? 4
             : 16;
 
+        // Replay the game: p[ply % 2] is the position at ply
+        Position p[2];
+        p[0] = g->start;
+
         for (int ply = 1; ply <= g->ply; ply++) {
+            const Position *before = &p[(ply - 1) % 2], *after = &p[ply % 2];
+
             // Write move number
-            if (g->pos[ply - 1].turn == WHITE || ply == 1)
-                str_cat_fmt(out, g->pos[ply - 1].turn == WHITE ? "%i. " : "%i... ",
-                    g->pos[ply - 1].fullMove);
+            if (before->turn == WHITE || ply == 1)
+                str_cat_fmt(out, before->turn == WHITE ? "%i. " : "%i... ", before->fullMove);
 
             // Append SAN move
-            pos_move_to_san(&g->pos[ply - 1], g->pos[ply].lastMove, &san);
-            str_cat(out, san);
+            pos_move_to_san(before, g->history[ply].move, san);
+            str_cat(out, *san);
+            pos_move(&p[ply % 2], before, g->history[ply].move);
 
             // Append check marker
-            if (g->pos[ply].checkers) {
+            if (after->checkers) {
                 if (ply == g->ply && g->state == STATE_CHECKMATE)
                     str_push(out, '#');  // checkmate
                 else
@@ -418,6 +548,18 @@ void game_export_pgn(const Game *g, int verbosity, str_t *out)
                     str_cat_fmt(out, " {-M%i/%i %Ims}", score - INT_MIN, depth, time);
                 else
                     str_cat_fmt(out, " {%i/%i %Ims}", score, depth, time);
+            } else if (verbosity == 4) {
+                // Use nps reported by the engine, or derive it from nodes and time
+                const Info *info = &g->info[ply - 1];
+                const int64_t time = info->time, nps = info->nps ? info->nps
+                    : time > 0 ? info->nodes * 1000 / time : 0;
+
+                if (score > INT_MAX / 2)
+                    str_cat_fmt(out, " {M%i/%i %Ims %Inps}", INT_MAX - score, depth, time, nps);
+                else if (score < INT_MIN / 2)
+                    str_cat_fmt(out, " {-M%i/%i %Ims %Inps}", score - INT_MIN, depth, time, nps);
+                else
+                    str_cat_fmt(out, " {%i/%i %Ims %Inps}", score, depth, time, nps);
             }
 
             // Append delimiter
@@ -425,16 +567,47 @@ void game_export_pgn(const Game *g, int verbosity, str_t *out)
         }
     }
 
-    str_cat_c(str_cat(out, result), "\n\n");
+    str_cat_c(str_cat(out, g->result), "\n\n");
 }
 
-void game_export_samples(const Game *g, str_t *out)
+void game_export_samples(Game *g, KeySet *dedup, str_t *out)
 {
     str_clear(out);
-    scope(str_destroy) str_t fen = str_init();
 
     for (size_t i = 0; i < vec_size(g->samples); i++) {
-        pos_get(&g->samples[i].pos, &fen, g->sfen);
-        str_cat_fmt(out, "%S,%i,%i\n", fen, g->samples[i].score, g->samples[i].result);
+        if (dedup && !key_set_insert(dedup, g->samples[i].pos.key))
+            continue;
+
+        pos_get(&g->samples[i].pos, &g->fen, g->sfen);
+        str_cat_fmt(out, "%S,%i,%i\n", g->fen, g->samples[i].score, g->samples[i].result);
+    }
+}
+
+void game_export_samples_bin(const Game *g, KeySet *dedup, SampleRecord **out)
+{
+    vec_clear(*out);
+
+    for (size_t i = 0; i < vec_size(g->samples); i++) {
+        const Sample *s = &g->samples[i];
+
+        if (dedup && !key_set_insert(dedup, s->pos.key))
+            continue;
+
+        SampleRecord r = {
+            .score = s->score,
+            .turn = s->pos.turn,
+            .epSquare = s->pos.epSquare,
+            .rule50 = s->pos.rule50,
+            .result = (uint8_t)s->result
+        };
+        pos_pack(&s->pos, &r.pos);
+        vec_push(*out, r);
     }
 }
+
+SampleHeader sample_header(void)
+{
+    SampleHeader h = {.version = SAMPLE_VERSION, .recordSize = sizeof(SampleRecord)};
+    memcpy(h.magic, "CCCLISMP", sizeof(h.magic));
+    return h;
+}
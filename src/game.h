@@ -14,6 +14,7 @@
 */
 #pragma once
 #include "position.h"
+#include "dedup.h"
 #include "engine.h"
 #include "options.h"
 #include "str.h"
@@ -26,6 +27,8 @@ enum {
     STATE_TIME_LOSS,  // lost on time
     STATE_ILLEGAL_MOVE,  // lost by playing an illegal move
     STATE_RESIGN,  // resigned on behalf of the engine
+    STATE_TB_LOSS,  // lost by tablebase adjudication
+    STATE_TB_WIN,  // won by tablebase adjudication (the only one where the side to move wins)
 
     STATE_SEPARATOR,  // invalid result, just a market to separate losses from draws
 
@@ -34,7 +37,8 @@ enum {
     STATE_THREEFOLD,  // draw by 3 position repetition
     STATE_FIFTY_MOVES,  // draw by 50 moves rule
     STATE_INSUFFICIENT_MATERIAL,  // draw due to insufficient material to deliver checkmate
-    STATE_DRAW_ADJUDICATION  // draw by adjudication
+    STATE_DRAW_ADJUDICATION,  // draw by adjudication
+    STATE_TB_DRAW  // draw by tablebase adjudication
 };
 
 typedef struct {
@@ -43,12 +47,49 @@ typedef struct {
     int result;  // game result from pos.turn's pov
 } Sample;
 
+// Binary sample file: a SampleHeader, followed by fixed size SampleRecord[] (native byte order)
+enum {SAMPLE_VERSION = 1};
+
+typedef struct {
+    char magic[8];  // "CCCLISMP"
+    uint32_t version;  // SAMPLE_VERSION
+    uint32_t recordSize;  // sizeof(SampleRecord)
+} SampleHeader;
+
+typedef struct {
+    PackedPos pos;
+    int32_t score;  // score returned by the engine (in cp)
+    uint8_t turn;  // WHITE or BLACK
+    uint8_t epSquare;  // en-passant square (NB_SQUARE if none)
+    uint8_t rule50;
+    uint8_t result;  // game result from pos.turn's pov
+} SampleRecord;
+
+// Compact record of a ply: positions are materialized on demand, by replaying moves
+typedef struct {
+    uint64_t key;  // hash key of the position
+    move_t move;  // move leading to the position (0 for the initial position)
+    uint8_t rule50;
+    char pad[5];
+} History;
+
+// Repetition table: keys of the positions since the last rule50 reset (at most 101), with their
+// number of occurences. Open addressing, where key = 0 means empty slot.
+enum {NB_REPETITION_SLOT = 256};
+
 typedef struct {
     str_t names[NB_COLOR];  // names of players, by color
-    Position *pos;  // list of positions (including moves) since game start
+    Position start, pos, positionPos;  // initial, current, and last position in positionCmd
+    History *history;  // list of plies since game start (history[0] is the initial position)
     Info *info;  // remembered from parsing info lines (for PGN comments)
     Sample *samples;  // list of samples when generating training data
+    uint64_t seed;  // seed for prng(), to select samples
+    str_t positionCmd;  // last 'position ...' command sent, extended in place as moves are played
+    str_t cmd, best, pv, fen, lan, token, result, reason;  // scratch buffers (see game_reset())
+    uint64_t repetitionKeys[NB_REPETITION_SLOT];
+    uint8_t repetitionCounts[NB_REPETITION_SLOT];
     int round, game, ply, state;
+    int positionPly0, positionPly;  // plies of the first and last position in positionCmd
     bool sfen;  // use S-FEN for this game (ie. HAha instead of KQkq)
     char pad[7];
 } Game;
@@ -56,11 +97,20 @@ typedef struct {
 Game game_init(int round, int game);
 void game_destroy(Game *g);
 
+// Prepares g for another game, keeping all its buffers. A worker reuses the same Game for all its
+// games, so that a game in steady state does not allocate memory.
+void game_reset(Game *g, int round, int game);
+
 bool game_load_fen(Game *g, const char *fen, int *color);
 
-int game_play(Worker *w, Game *g, const Options *o, const Engine engines[2],
+int game_play(Worker *w, Game *g, const Options *o, Engine *engines[2],
     const EngineOptions *eo[2], bool reverse);
 
 void game_decode_state(const Game *g, str_t *result, str_t *reason);
-void game_export_pgn(const Game *g, int verbosity, str_t *out);
-void game_export_samples(const Game *g, str_t *out);
+void game_export_pgn(Game *g, int verbosity, str_t *out);
+
+// Samples whose position is already in dedup are skipped (unless dedup is NULL)
+void game_export_samples(Game *g, KeySet *dedup, str_t *out);
+void game_export_samples_bin(const Game *g, KeySet *dedup, SampleRecord **out);
+
+SampleHeader sample_header(void);
@@ -13,9 +13,12 @@
  * not, see <http://www.gnu.org/licenses/>.
 */
 #include <stdio.h>
+#include <string.h>
 #include "gen.h"
 #include "vec.h"
 
+// Generators write moves at the cursor, and return the new end
+
 static move_t *serialize_piece_moves(int from, bitboard_t pins, int king, bitboard_t targets,
     move_t *moves)
 {
@@ -23,7 +26,7 @@ static move_t *serialize_piece_moves(int from, bitboard_t pins, int king, bitboa
         targets &= Ray[king][from];
 
     while (targets)
-        vec_push(moves, move_build(from, bb_pop_lsb(&targets), NB_PIECE));
+        *moves++ = move_build(from, bb_pop_lsb(&targets), NB_PIECE);
 
     return moves;
 }
@@ -35,7 +38,7 @@ static move_t *serialize_pawn_moves(bitboard_t pawns, bitboard_t pins, int king,
         const int from = bb_pop_lsb(&pawns);
 
         if (!bb_test(pins, from) || bb_test(Ray[king][from], from + shift))
-            vec_push(moves, move_build(from, from + shift, NB_PIECE));
+            *moves++ = move_build(from, from + shift, NB_PIECE);
     }
 
     return moves;
@@ -83,7 +86,7 @@ static move_t *gen_pawn_moves(const Position *pos, move_t *moves, bitboard_t fil
 
             if (!(bb_rook_attacks(king, occ) & pos_pieces_cpp(pos, them, ROOK, QUEEN))
                     && !(bb_bishop_attacks(king, occ) & pos_pieces_cpp(pos, them, BISHOP, QUEEN)))
-                vec_push(moves, move_build(from, pos->epSquare, NB_PIECE));
+                *moves++ = move_build(from, pos->epSquare, NB_PIECE);
         }
     }
 
@@ -105,7 +108,7 @@ static move_t *gen_pawn_moves(const Position *pos, move_t *moves, bitboard_t fil
 
             if (!bb_test(pos->pins, from) || bb_test(Ray[king][from], to))
                 for (int prom = QUEEN; prom >= KNIGHT; --prom)
-                    vec_push(moves, move_build(from, to, prom));
+                    *moves++ = move_build(from, to, prom);
         }
     }
 
@@ -166,12 +169,26 @@ static move_t *gen_castling_moves(const Position *pos, move_t *moves)
 
         if (bb_count((Segment[king][kto] | Segment[rook][rto]) & pos_pieces(pos)) == 2
                 && !(pos->attacked & Segment[king][kto]) && !bb_test(pos->pins, rook))
-            vec_push(moves, move_build(king, rook, NB_PIECE));
+            *moves++ = move_build(king, rook, NB_PIECE);
     }
 
     return moves;
 }
 
+static bitboard_t check_targets(const Position *pos)
+// Single check: target squares for non-king pieces to block or capture the checker
+{
+    assert(pos->checkers && !bb_several(pos->checkers));
+    const int king = pos_king_square(pos, pos->turn);
+    const int checkerSquare = bb_lsb(pos->checkers);
+    const int checkerPiece = pos_piece_on(pos, checkerSquare);
+
+    // sliding check: cover the checking segment, or capture the slider
+    return BISHOP <= checkerPiece && checkerPiece <= QUEEN
+        ? Segment[king][checkerSquare]
+        : pos->checkers;
+}
+
 static move_t *gen_check_escapes(const Position *pos, move_t *moves)
 {
     assert(pos->checkers);
@@ -184,19 +201,13 @@ static move_t *gen_check_escapes(const Position *pos, move_t *moves)
 
     if (!bb_several(pos->checkers)) {
         // Blocking moves (single checker)
-        const int checkerSquare = bb_lsb(pos->checkers);
-        const int checkerPiece = pos_piece_on(pos, checkerSquare);
-
-        // sliding check: cover the checking segment, or capture the slider
-        bitboard_t targets = BISHOP <= checkerPiece && checkerPiece <= QUEEN
-              ? Segment[king][checkerSquare]
-              : pos->checkers;
+        bitboard_t targets = check_targets(pos);
 
         moves = gen_piece_moves(pos, moves, targets & ~ours, false);
 
         // pawn check: if epsq is available, then the check must result from a pawn double
         // push, and we also need to consider capturing it en-passant to solve the check.
-        if (checkerPiece == PAWN && pos->epSquare < NB_SQUARE)
+        if (pos_piece_on(pos, bb_lsb(pos->checkers)) == PAWN && pos->epSquare < NB_SQUARE)
             bb_set(&targets, pos->epSquare);
 
         moves = gen_pawn_moves(pos, moves, targets);
@@ -205,17 +216,81 @@ static move_t *gen_check_escapes(const Position *pos, move_t *moves)
     return moves;
 }
 
-move_t *gen_all_moves(const Position *pos, move_t *moves)
+void gen_moves(const Position *pos, MoveList *list)
 {
-    vec_clear(moves);
+    move_t *m = list->moves;
 
     if (pos->checkers)
-        return gen_check_escapes(pos, moves);
+        m = gen_check_escapes(pos, m);
     else {
-        move_t *m = moves;
         m = gen_pawn_moves(pos, m, ~pos->byColor[pos->turn]);
         m = gen_piece_moves(pos, m, ~pos->byColor[pos->turn], true);
         m = gen_castling_moves(pos, m);
-        return m;
     }
+
+    list->size = (size_t)(m - list->moves);
+    assert(list->size <= MAX_MOVES);
+}
+
+move_t *gen_all_moves(const Position *pos, move_t *moves)
+{
+    MoveList list;
+    gen_moves(pos, &list);
+
+    vec_clear(moves);
+    moves = vec_do_grow(moves, sizeof(move_t), list.size);
+    memcpy(moves, list.moves, list.size * sizeof(move_t));
+    vec_ptr(moves)->size = list.size;
+
+    return moves;
+}
+
+bool gen_has_legal_move(const Position *pos)
+{
+    const int us = pos->turn;
+    const int king = pos_king_square(pos, us);
+    const bitboard_t ours = pos->byColor[us];
+
+    // King moves
+    if (KingAttacks[king] & ~ours & ~pos->attacked)
+        return true;
+
+    if (bb_several(pos->checkers))
+        return false;
+
+    // Knight and slider moves: stop at the first piece that has one
+    const bitboard_t filter = pos->checkers ? check_targets(pos) & ~ours : ~ours;
+    bitboard_t pieces = ours & ~pos->byPiece[PAWN] & ~pos->byPiece[KING];
+
+    while (pieces) {
+        const int from = bb_pop_lsb(&pieces);
+        const int piece = pos_piece_on(pos, from);
+        bitboard_t targets = piece == KNIGHT ? KnightAttacks[from]
+            : (piece != BISHOP ? bb_rook_attacks(from, pos_pieces(pos)) : 0)
+                | (piece != ROOK ? bb_bishop_attacks(from, pos_pieces(pos)) : 0);
+
+        if (bb_test(pos->pins, from))
+            targets &= Ray[king][from];
+
+        if (targets & filter)
+            return true;
+    }
+
+    // Pawn moves and castling (the rare remaining cases)
+    MoveList list;
+    move_t *end = list.moves;
+
+    if (pos->checkers) {
+        bitboard_t targets = check_targets(pos);
+
+        if (pos_piece_on(pos, bb_lsb(pos->checkers)) == PAWN && pos->epSquare < NB_SQUARE)
+            bb_set(&targets, pos->epSquare);
+
+        end = gen_pawn_moves(pos, end, targets);
+    } else {
+        end = gen_pawn_moves(pos, end, ~ours);
+        end = gen_castling_moves(pos, end);
+    }
+
+    return end != list.moves;
 }
@@ -15,4 +15,16 @@
 #pragma once
 #include "position.h"
 
-move_t *gen_all_moves(const Position *pos, move_t *moves);
+// Fixed capacity move list, meant to live on the stack (no position has more than 218 legal moves)
+enum {MAX_MOVES = 256};
+
+typedef struct {
+    move_t moves[MAX_MOVES];
+    size_t size;
+} MoveList;
+
+void gen_moves(const Position *pos, MoveList *list);
+move_t *gen_all_moves(const Position *pos, move_t *moves);  // same, in a vec
+
+// Early exit: stops at the first legal move found (checkmate and stalemate detection)
+bool gen_has_legal_move(const Position *pos);
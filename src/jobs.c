@@ -13,9 +13,16 @@
  * not, see <http://www.gnu.org/licenses/>.
 */
 #include "jobs.h"
+#include "util.h"
 #include "vec.h"
 #include "workers.h"
 #include <stdio.h>
+#include <string.h>
+
+// Jobs are not popped further ahead of the first unsettled job (the next one for ordered writers)
+// than WINDOW_MIN, plus WINDOW_PER_JOB per job in progress. This bounds the number of games that
+// ordered writers hold in memory, and that a resumed checkpoint replays.
+enum {WINDOW_MIN = 1024, WINDOW_PER_JOB = 16};
 
 static void job_queue_init_pair(int games, int e1, int e2, int pair, int *added, int round,
     Job **jobs)
@@ -31,7 +38,7 @@ static void job_queue_init_pair(int games, int e1, int e2, int pair, int *added,
     }
 }
 
-JobQueue job_queue_init(int engines, int rounds, int games, bool gauntlet)
+JobQueue job_queue_init(int engines, int rounds, int games, bool gauntlet, bool repeat)
 {
     assert(engines >= 2 && rounds >= 1 && games >= 1);
 
@@ -41,6 +48,8 @@ JobQueue job_queue_init(int engines, int rounds, int games, bool gauntlet)
     jq.jobs = vec_init(Job);
     jq.results = vec_init(Result);
     jq.names = vec_init(str_t);
+    jq.repeat = repeat;
+    jq.start = system_msec();
 
     // Prepare engine names: blank for now, will be discovered at run time (concurrently)
     for (int i = 0; i < engines; i++)
@@ -49,7 +58,7 @@ JobQueue job_queue_init(int engines, int rounds, int games, bool gauntlet)
     if (gauntlet) {
         // Gauntlet: N-1 pairs (0, e2) with 0 < e2
         for (int e2 = 1; e2 < engines; e2++) {
-            const Result r = {.ei = {0, e2}, .count = {0}, {0}};
+            const Result r = {.ei = {0, e2}};
             vec_push(jq.results, r);
         }
 
@@ -63,7 +72,7 @@ JobQueue job_queue_init(int engines, int rounds, int games, bool gauntlet)
         // Round robin: N(N-1)/2 pairs (e1, e2) with e1 < e2
         for (int e1 = 0; e1 < engines - 1; e1++)
             for (int e2 = e1 + 1; e2 < engines; e2++) {
-                const Result r = {.ei = {e1, e2}, .count = {0}, {0}};
+                const Result r = {.ei = {e1, e2}};
                 vec_push(jq.results, r);
             }
 
@@ -77,59 +86,254 @@ JobQueue job_queue_init(int engines, int rounds, int games, bool gauntlet)
         }
     }
 
+    // Dispatch jobs into per pair queues (all live: each pair has at least one job)
+    jq.pairs = vec_init(PairJobs);
+    jq.live = vec_init(int);
+
+    for (size_t i = 0; i < vec_size(jq.results); i++) {
+        vec_push(jq.pairs, ((PairJobs){.idx = vec_init(size_t), .reissued = vec_init(size_t),
+            .reason = str_init(), .slot = (int)i}));
+        vec_push(jq.live, (int)i);
+    }
+
+    for (size_t i = 0; i < vec_size(jq.jobs); i++)
+        vec_push(jq.pairs[jq.jobs[i].pair].idx, i);
+
+    // Game pairs (same opening): jobs 2k and 2k+1, if they are played by the same engines with
+    // reversed colors (always the case, unless -games is odd)
+    jq.pending = vec_init_reserve(vec_size(jq.jobs) / 2, int);
+
+    for (size_t i = 0; i < vec_size(jq.jobs) / 2; i++)
+        vec_push(jq.pending, -1);
+
+    jq.outcomes = vec_init_reserve(vec_size(jq.jobs), int8_t);
+
+    for (size_t i = 0; i < vec_size(jq.jobs); i++)
+        vec_push(jq.outcomes, -1);
+
+    jq.settled = vec_init_reserve(vec_size(jq.jobs), bool);
+
+    for (size_t i = 0; i < vec_size(jq.jobs); i++)
+        vec_push(jq.settled, false);
+
     return jq;
 }
 
 void job_queue_destroy(JobQueue *jq)
 {
+    for (size_t i = 0; i < vec_size(jq->pairs); i++) {
+        vec_destroy(jq->pairs[i].idx);
+        vec_destroy(jq->pairs[i].reissued);
+        str_destroy(&jq->pairs[i].reason);
+    }
+
+    vec_destroy(jq->pairs);
+    vec_destroy(jq->live);
     vec_destroy(jq->results);
+    vec_destroy(jq->pending);
+    vec_destroy(jq->outcomes);
+    vec_destroy(jq->settled);
     vec_destroy(jq->jobs);
     vec_destroy_rec(jq->names, str_destroy);
     pthread_mutex_destroy(&jq->mtx);
 }
 
-bool job_queue_pop(JobQueue *jq, Job *j, size_t *idx, size_t *count)
+static bool is_loaded(int ei, const int *loaded, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        if (loaded[i] == ei)
+            return true;
+
+    return false;
+}
+
+static void job_queue_settle(JobQueue *jq, size_t idx)
+// Job idx is completed or skipped: move the frontier past settled jobs
+{
+    jq->settled[idx] = true;
+
+    while (jq->frontier < vec_size(jq->jobs) && jq->settled[jq->frontier])
+        jq->frontier++;
+}
+
+static void job_queue_revive(JobQueue *jq, int pair)
+// Pair has jobs to pop again (re-issued): add it to live[]
+{
+    if (jq->pairs[pair].slot < 0) {
+        jq->pairs[pair].slot = (int)vec_size(jq->live);
+        vec_push(jq->live, pair);
+    }
+}
+
+static void job_queue_bury(JobQueue *jq, int pair)
+// Pair has no jobs left to pop (exhausted or retired): swap-remove it from live[]
+{
+    const int slot = jq->pairs[pair].slot;
+
+    if (slot >= 0) {
+        const int last = vec_pop(jq->live);
+
+        if (last != pair) {
+            jq->live[slot] = last;
+            jq->pairs[last].slot = slot;
+        }
+
+        jq->pairs[pair].slot = -1;
+    }
+}
+
+static int job_queue_pick_pair(const JobQueue *jq, const int *loaded, size_t n)
+// Choose the pair to pop a job from, in order of preference: a pair of engines already loaded,
+// then a pair that shares one of them, then any pair. Among pairs of equal preference, choose the
+// one with the most jobs left. Only pairs whose next job is within the window are considered
+// (re-issued jobs always are). Ties go to the lowest pair index, so the choice does not depend on
+// the order of live[]. Returns -1 if no such pair is left.
+{
+    const size_t limit = jq->frontier + WINDOW_MIN + WINDOW_PER_JOB * (jq->popped - jq->completed);
+    int best = -1, bestShared = 0;
+    size_t bestLeft = 0;
+
+    for (size_t s = 0; s < vec_size(jq->live); s++) {
+        const int i = jq->live[s];
+        const PairJobs *pj = &jq->pairs[i];
+        const size_t left = vec_size(pj->idx) - pj->next + vec_size(pj->reissued);
+        assert(left);
+
+        if (!vec_size(pj->reissued) && pj->idx[pj->next] >= limit)
+            continue;
+
+        const int *ei = jq->results[i].ei;
+        const int shared = is_loaded(ei[0], loaded, n) + is_loaded(ei[1], loaded, n);
+
+        if (best < 0 || shared > bestShared || (shared == bestShared && (left > bestLeft
+                || (left == bestLeft && i < best)))) {
+            best = i;
+            bestShared = shared;
+            bestLeft = left;
+        }
+    }
+
+    return best;
+}
+
+bool job_queue_pop(JobQueue *jq, const int *loaded, size_t n, Job *j, size_t *idx, size_t *count)
+// Pop a job, preferably for engines loaded[0..n-1] (currently loaded by the worker), to avoid
+// restarting engines. Jobs are therefore not popped in order, but *idx is the index of the job in
+// jq->jobs[]. Returns false if no job can be popped now: either all jobs are popped (see
+// job_queue_done()), or those left are too far ahead, until jobs in progress complete.
 {
     pthread_mutex_lock(&jq->mtx);
-    const bool ok = jq->idx < vec_size(jq->jobs);
+    const int pair = job_queue_pick_pair(jq, loaded, n);
+    const bool ok = pair >= 0;
 
     if (ok) {
-        *j = jq->jobs[jq->idx];
-        *idx = jq->idx++;
+        PairJobs *pj = &jq->pairs[pair];
+        *idx = vec_size(pj->reissued) ? vec_pop(pj->reissued) : pj->idx[pj->next++];
+        *j = jq->jobs[*idx];
         *count = vec_size(jq->jobs);
+        jq->popped++;
+
+        if (pj->next == vec_size(pj->idx) && !vec_size(pj->reissued))
+            job_queue_bury(jq, pair);
     }
 
     pthread_mutex_unlock(&jq->mtx);
     return ok;
 }
 
-// Add game outcome, and return updated totals
-void job_queue_add_result(JobQueue *jq, int pair, int outcome, int count[3])
+static bool is_game_pair(const JobQueue *jq, size_t idx)
+{
+    const size_t other = idx ^ 1;
+
+    return other < vec_size(jq->jobs) && jq->jobs[idx].pair == jq->jobs[other].pair
+        && jq->jobs[idx].reverse != jq->jobs[other].reverse;
+}
+
+// Add outcome of game jobs[idx], and return updated totals
+void job_queue_add_result(JobQueue *jq, size_t idx, int outcome, Result *r)
 {
     pthread_mutex_lock(&jq->mtx);
-    jq->results[pair].count[outcome]++;
+    Result *pr = &jq->results[jq->jobs[idx].pair];
+    pr->count[outcome]++;
+    jq->outcomes[idx] = (int8_t)outcome;
     jq->completed++;
+    job_queue_settle(jq, idx);
 
-    for (size_t i = 0; i < 3; i++)
-        count[i] = jq->results[pair].count[i];
+    if (jq->repeat && is_game_pair(jq, idx)) {
+        int *pending = &jq->pending[idx / 2];
 
+        if (*pending < 0)
+            *pending = outcome;
+        else
+            pr->ptnml[*pending + outcome]++;
+    }
+
+    *r = *pr;
     pthread_mutex_unlock(&jq->mtx);
 }
 
 bool job_queue_done(JobQueue *jq)
 {
     pthread_mutex_lock(&jq->mtx);
-    assert(jq->idx <= vec_size(jq->jobs));
-    const bool done = jq->idx == vec_size(jq->jobs);
+    assert(jq->popped + jq->skipped <= vec_size(jq->jobs));
+    const bool done = jq->popped + jq->skipped == vec_size(jq->jobs);
     pthread_mutex_unlock(&jq->mtx);
     return done;
 }
 
-void job_queue_stop(JobQueue *jq)
+bool job_queue_retire(JobQueue *jq, int pair, const char *reason, size_t **skipped)
+// Retire a pair: its remaining jobs will not be popped (those already popped still complete).
+// Returns false if the pair was already retired. Otherwise, indexes of the jobs skipped are
+// appended to *skipped.
+{
+    pthread_mutex_lock(&jq->mtx);
+    PairJobs *pj = &jq->pairs[pair];
+    const bool ok = !pj->reason.len;
+
+    if (ok) {
+        str_cpy_c(&pj->reason, reason);
+        pj->retiredAt = system_msec() - jq->start;
+        const int *count = jq->results[pair].count;
+        pj->played = count[RESULT_WIN] + count[RESULT_LOSS] + count[RESULT_DRAW];
+
+        for (; pj->next < vec_size(pj->idx); pj->next++, jq->skipped++) {
+            vec_push(*skipped, pj->idx[pj->next]);
+            job_queue_settle(jq, pj->idx[pj->next]);
+        }
+
+        for (; vec_size(pj->reissued); jq->skipped++) {
+            const size_t idx = vec_pop(pj->reissued);
+            vec_push(*skipped, idx);
+            job_queue_settle(jq, idx);
+        }
+
+        job_queue_bury(jq, pair);
+    }
+
+    pthread_mutex_unlock(&jq->mtx);
+    return ok;
+}
+
+bool job_queue_reissue(JobQueue *jq, size_t idx)
+// Put back a popped job, that will never be completed (lost remote worker). Returns false if its
+// pair was retired meanwhile: the job is then skipped instead.
 {
     pthread_mutex_lock(&jq->mtx);
-    jq->idx = vec_size(jq->jobs);
+    PairJobs *pj = &jq->pairs[jq->jobs[idx].pair];
+    const bool ok = !pj->reason.len;
+    assert(jq->popped > 0);
+    jq->popped--;
+
+    if (ok) {
+        vec_push(pj->reissued, idx);
+        job_queue_revive(jq, jq->jobs[idx].pair);
+    } else {
+        jq->skipped++;
+        job_queue_settle(jq, idx);
+    }
+
     pthread_mutex_unlock(&jq->mtx);
+    return ok;
 }
 
 void job_queue_set_name(JobQueue *jq, int ei, const char *name)
@@ -142,6 +346,73 @@ void job_queue_set_name(JobQueue *jq, int ei, const char *name)
     pthread_mutex_unlock(&jq->mtx);
 }
 
+Result *job_queue_results(JobQueue *jq, size_t *completed)
+// Copy of results[] (vector), and number of jobs completed
+{
+    pthread_mutex_lock(&jq->mtx);
+    Result *results = vec_init_reserve(vec_size(jq->results), Result);
+    memcpy(results, jq->results, vec_size(jq->results) * sizeof(Result));
+    vec_ptr(results)->size = vec_size(jq->results);
+    *completed = jq->completed;
+    pthread_mutex_unlock(&jq->mtx);
+    return results;
+}
+
+str_t *job_queue_names(JobQueue *jq)
+// Copy of names[] (vector of str_t): they are set concurrently, by job_queue_set_name()
+{
+    pthread_mutex_lock(&jq->mtx);
+    str_t *names = vec_init_reserve(vec_size(jq->names), str_t);
+
+    for (size_t i = 0; i < vec_size(jq->names); i++)
+        vec_push(names, str_init_from(jq->names[i]));
+
+    pthread_mutex_unlock(&jq->mtx);
+    return names;
+}
+
+int8_t *job_queue_outcomes(JobQueue *jq)
+// Copy of outcomes[] (vector)
+{
+    pthread_mutex_lock(&jq->mtx);
+    int8_t *outcomes = vec_init_reserve(vec_size(jq->outcomes), int8_t);
+    memcpy(outcomes, jq->outcomes, vec_size(jq->outcomes));
+    vec_ptr(outcomes)->size = vec_size(jq->outcomes);
+    pthread_mutex_unlock(&jq->mtx);
+    return outcomes;
+}
+
+void job_queue_resume(JobQueue *jq, const int8_t *outcomes)
+// Complete jobs that have an outcome (from a checkpoint), before any job is popped. In each pair,
+// completed jobs are moved to the front (popped), others keep their order.
+{
+    assert(!jq->popped);
+
+    for (size_t i = 0; i < vec_size(jq->jobs); i++)
+        if (outcomes[i] >= 0) {
+            Result r;
+            job_queue_add_result(jq, i, outcomes[i], &r);
+        }
+
+    for (size_t i = 0; i < vec_size(jq->pairs); i++) {
+        PairJobs *pj = &jq->pairs[i];
+        size_t *left = vec_init(size_t);
+
+        for (size_t j = 0; j < vec_size(pj->idx); j++)
+            if (outcomes[pj->idx[j]] >= 0)
+                pj->idx[pj->next++] = pj->idx[j];
+            else
+                vec_push(left, pj->idx[j]);
+
+        memcpy(&pj->idx[pj->next], left, vec_size(left) * sizeof(*left));
+        jq->popped += pj->next;
+        vec_destroy(left);
+
+        if (pj->next == vec_size(pj->idx))
+            job_queue_bury(jq, (int)i);
+    }
+}
+
 void job_queue_print_results(JobQueue *jq, size_t frequency)
 {
     pthread_mutex_lock(&jq->mtx);
@@ -156,9 +427,15 @@ void job_queue_print_results(JobQueue *jq, size_t frequency)
             if (n) {
                 char score[8] = "";
                 sprintf(score, "%.3f", (r.count[RESULT_WIN] + 0.5 * r.count[RESULT_DRAW]) / n);
-                str_cat_fmt(&out, "%S vs %S: %i - %i - %i  [%s] %i\n", jq->names[r.ei[0]],
+                str_cat_fmt(&out, "%S vs %S: %i - %i - %i  [%s] %i", jq->names[r.ei[0]],
                     jq->names[r.ei[1]], r.count[RESULT_WIN], r.count[RESULT_LOSS],
                     r.count[RESULT_DRAW], score, n);
+
+                if (jq->repeat)
+                    str_cat_fmt(&out, "  Ptnml: %i %i %i %i %i", r.ptnml[0], r.ptnml[1],
+                        r.ptnml[2], r.ptnml[3], r.ptnml[4]);
+
+                str_push(&out, '\n');
             }
         }
 
@@ -167,3 +444,28 @@ void job_queue_print_results(JobQueue *jq, size_t frequency)
 
     pthread_mutex_unlock(&jq->mtx);
 }
+
+void job_queue_print_summary(JobQueue *jq)
+// When and why each pair stopped
+{
+    pthread_mutex_lock(&jq->mtx);
+    scope(str_destroy) str_t out = str_init_from_c("Pairs summary:\n");
+
+    for (size_t i = 0; i < vec_size(jq->pairs); i++) {
+        const PairJobs *pj = &jq->pairs[i];
+        const int *ei = jq->results[i].ei;
+        str_cat_fmt(&out, "%S vs %S: ", jq->names[ei[0]], jq->names[ei[1]]);
+
+        if (pj->reason.len)
+            str_cat_fmt(&out, "retired after %i games (%Is): %S\n", pj->played,
+                (intmax_t)(pj->retiredAt / 1000), pj->reason);
+        else {
+            const size_t popped = pj->next - vec_size(pj->reissued);
+            const bool all = popped == vec_size(pj->idx);
+            str_cat_fmt(&out, "%s %U games\n", all ? "played" : "stopped after", (uintmax_t)popped);
+        }
+    }
+
+    fputs(out.buf, stdout);
+    pthread_mutex_unlock(&jq->mtx);
+}
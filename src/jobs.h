@@ -13,15 +13,17 @@
  * not, see <http://www.gnu.org/licenses/>.
 */
 #pragma once
+#include <inttypes.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include "str.h"
 
-// Result for each pair (e1, e2); e1 < e2. Stores count of game outcomes from e1's point of view.
+// Result for each pair (e1, e2); e1 < e2. Stores count of game outcomes from e1's point of view,
+// and with -repeat, count of game pair outcomes (sum of both games: LL, LD, DD or WL, WD, WW).
 typedef struct {
     int ei[2];
     int count[3];
-    char pad[4];
+    int ptnml[5];
 } Result;
 
 // Job: instruction to play a single game
@@ -32,23 +34,51 @@ typedef struct {
     char pad[3];
 } Job;
 
+// Jobs of a given pair, in order. A retired pair has no jobs left to pop (next = size of idx[]).
+typedef struct {
+    size_t *idx;  // vector of indexes in JobQueue.jobs[]
+    size_t next;  // next element of idx[] to pop
+    size_t *reissued;  // jobs put back by job_queue_reissue(), popped first
+    str_t reason;  // why the pair was retired (empty if not)
+    int64_t retiredAt;  // msec since the start of the job queue
+    int played;  // number of games completed when retired
+    int slot;  // index in JobQueue.live[], or -1 if the pair has no jobs left to pop
+} PairJobs;
+
 // Job Queue: consumed by workers to play tournament (thread safe)
 typedef struct {
     pthread_mutex_t mtx;
-    Job *jobs;
-    size_t idx;  // next job index
+    Job *jobs;  // all jobs: the index in jobs[] is the game index (for PGN order and openings)
+    PairJobs *pairs;  // per pair queues, indexed like results[]
+    int *live;  // pairs with jobs left to pop (unordered)
+    size_t popped;  // number of jobs popped
     size_t completed;  // number of jobs completed
+    size_t skipped;  // number of jobs of retired pairs, that will never be popped
+    int64_t start;  // system_msec() at init
     str_t *names;
     Result *results;
+    int *pending;  // with -repeat: outcome of the first finished game of each game pair (or -1)
+    int8_t *outcomes;  // outcome of each job (from ei[0]'s point of view), or -1 if not completed
+    bool *settled;  // job completed or skipped
+    size_t frontier;  // first job not settled (all jobs before it are written, or about to be)
+    bool repeat;
+    char pad[7];
 } JobQueue;
 
-JobQueue job_queue_init(int engines, int rounds, int games, bool gauntlet);
+JobQueue job_queue_init(int engines, int rounds, int games, bool gauntlet, bool repeat);
 void job_queue_destroy(JobQueue *jq);
 
-bool job_queue_pop(JobQueue *jq, Job *j, size_t *idx, size_t *count);
-void job_queue_add_result(JobQueue *jq, int pair, int outcome, int count[3]);
+bool job_queue_pop(JobQueue *jq, const int *loaded, size_t n, Job *j, size_t *idx, size_t *count);
+void job_queue_add_result(JobQueue *jq, size_t idx, int outcome, Result *r);
 bool job_queue_done(JobQueue *jq);
-void job_queue_stop(JobQueue *jq);
+bool job_queue_retire(JobQueue *jq, int pair, const char *reason, size_t **skipped);
+bool job_queue_reissue(JobQueue *jq, size_t idx);
+
+Result *job_queue_results(JobQueue *jq, size_t *completed);
+str_t *job_queue_names(JobQueue *jq);
+int8_t *job_queue_outcomes(JobQueue *jq);
+void job_queue_resume(JobQueue *jq, const int8_t *outcomes);
 
 void job_queue_set_name(JobQueue *jq, int ei, const char *name);
 void job_queue_print_results(JobQueue *jq, size_t frequency);
+void job_queue_print_summary(JobQueue *jq);
@@ -0,0 +1,100 @@
+/*
+ * c-chess-cli, a command line interface for UCI chess engines. Copyright 2020 lucasart.
+ *
+ * c-chess-cli is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * c-chess-cli is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program. If
+ * not, see <http://www.gnu.org/licenses/>.
+*/
+#include <assert.h>
+#include "latency.h"
+#include "util.h"
+
+static const char *StageName[NB_STAGE] = {"rules", "command", "sync", "think", "parse", "pv",
+    "overhead"};
+
+static size_t bucket_of(uint64_t value)
+// Values below 16 have their own bucket. Above that, the bucket is determined by the exponent (msb)
+// and the 3 bits that follow the msb.
+{
+    if (value < 16)
+        return value;
+
+    const int msb = 63 - __builtin_clzll(value);
+    return (size_t)(8 * (msb - 3)) + (value >> (msb - 3));
+}
+
+static int64_t bucket_mid(size_t bucket)
+// Middle value of the range of values that fall into bucket
+{
+    if (bucket < 16)
+        return (int64_t)bucket;
+
+    const int shift = (int)(bucket / 8) - 1;
+    const int64_t lower = (int64_t)(bucket % 8 + 8) << shift;
+    return lower + ((1LL << shift) - 1) / 2;
+}
+
+void histogram_add(Histogram *h, int64_t value)
+{
+    value = max(value, (int64_t)0);
+    const size_t bucket = bucket_of((uint64_t)value);
+    assert(bucket < NB_BUCKET);
+
+    h->count[bucket]++;
+    h->n++;
+    h->max = max(h->max, value);
+}
+
+void histogram_merge(Histogram *h, const Histogram *other)
+{
+    for (size_t i = 0; i < NB_BUCKET; i++)
+        h->count[i] += other->count[i];
+
+    h->n += other->n;
+    h->max = max(h->max, other->max);
+}
+
+int64_t histogram_percentile(const Histogram *h, double p)
+{
+    assert(0 <= p && p <= 1);
+    const uint64_t rank = (uint64_t)(p * (double)h->n);
+    uint64_t cumulated = 0;
+
+    for (size_t i = 0; i < NB_BUCKET; i++)
+        if ((cumulated += h->count[i]) > rank)
+            return min(bucket_mid(i), h->max);
+
+    return h->max;
+}
+
+void latency_print(const Histogram h[NB_STAGE], str_t *out)
+{
+    str_cpy_c(out, "Latency (usec):       n      p50      p99      max\n");
+
+    for (int s = 0; s < NB_STAGE; s++) {
+        char line[80] = "";
+        snprintf(line, sizeof(line), "%-9s %14" PRIu64 " %8" PRId64 " %8" PRId64 " %8" PRId64 "\n",
+            StageName[s], h[s].n, histogram_percentile(&h[s], 0.5), histogram_percentile(&h[s], 0.99),
+            h[s].max);
+        str_cat_c(out, line);
+    }
+}
+
+void latency_json(const Histogram h[NB_STAGE], str_t *out)
+{
+    str_cpy_c(out, "{");
+
+    for (int s = 0; s < NB_STAGE; s++)
+        str_cat_fmt(out, "%s\"%s\": {\"n\": %U, \"p50\": %I, \"p99\": %I, \"max\": %I}",
+            s ? ", " : "", StageName[s], (uintmax_t)h[s].n, histogram_percentile(&h[s], 0.5),
+            histogram_percentile(&h[s], 0.99), h[s].max);
+
+    str_push(out, '}');
+}
@@ -0,0 +1,45 @@
+/*
+ * c-chess-cli, a command line interface for UCI chess engines. Copyright 2020 lucasart.
+ *
+ * c-chess-cli is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * c-chess-cli is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program. If
+ * not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <inttypes.h>
+#include "str.h"
+
+// Stages of game_play(), timed for each move (in usec)
+enum {
+    STAGE_RULES,  // play the last move, and apply chess rules
+    STAGE_COMMAND,  // prepare and write 'position' and 'go' commands
+    STAGE_SYNC,  // isready..readyok round trip
+    STAGE_THINK,  // from 'go' to 'bestmove', excluding parsing (engine think time + pipe latency)
+    STAGE_PARSE,  // parsing engine output, while waiting for 'bestmove'
+    STAGE_PV,  // resolve PV
+    STAGE_OVERHEAD,  // total time spent by c-chess-cli for the move (everything except STAGE_THINK)
+    NB_STAGE
+};
+
+// Histogram with logarithmic buckets, using 8 linear sub-buckets per power of 2 (ie. 12.5% precision)
+enum {NB_BUCKET = 8 * 62};
+
+typedef struct {
+    uint64_t n;  // number of values
+    int64_t max;  // largest value
+    uint32_t count[NB_BUCKET];
+} Histogram;
+
+void histogram_add(Histogram *h, int64_t value);
+void histogram_merge(Histogram *h, const Histogram *other);
+int64_t histogram_percentile(const Histogram *h, double p);
+
+void latency_print(const Histogram h[NB_STAGE], str_t *out);
+void latency_json(const Histogram h[NB_STAGE], str_t *out);
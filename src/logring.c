@@ -0,0 +1,269 @@
+/*
+ * c-chess-cli, a command line interface for UCI chess engines. Copyright 2020 lucasart.
+ *
+ * c-chess-cli is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * c-chess-cli is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program. If
+ * not, see <http://www.gnu.org/licenses/>.
+*/
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+#include "logring.h"
+#include "util.h"
+#include "vec.h"
+
+static const char Magic[8] = "CCCLILOG";
+
+// Time between two passes of the drain thread (in msec)
+static const int64_t DrainInterval = 10;
+
+// Background thread, writing the records of all async rings to their file
+static struct {
+    pthread_mutex_t mtx;  // protects rings
+    pthread_t thread;
+    LogRing **rings;
+    _Atomic bool stop;
+    bool running;
+    char pad[6];
+} Drain = {.mtx = PTHREAD_MUTEX_INITIALIZER};
+
+static size_t padded(size_t len)
+{
+    return (len + 7) & ~(size_t)7;
+}
+
+static void ring_write(LogRing *r, size_t pos, const void *src, size_t n)
+{
+    const size_t i = pos & (r->size - 1), first = min(n, r->size - i);
+    memcpy(&r->buf[i], src, first);
+    memcpy(r->buf, (const char *)src + first, n - first);
+}
+
+static void ring_read(const LogRing *r, size_t pos, void *dest, size_t n)
+{
+    const size_t i = pos & (r->size - 1), first = min(n, r->size - i);
+    memcpy(dest, &r->buf[i], first);
+    memcpy((char *)dest + first, r->buf, n - first);
+}
+
+static void ring_drain(LogRing *r)
+// Write everything between tail and head to the file (consumer side)
+{
+    const size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    const size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+    if (head == tail)
+        return;
+
+    const size_t i = tail & (r->size - 1), first = min(head - tail, r->size - i);
+    DIE_IF(0, fwrite(&r->buf[i], 1, first, r->out) != first);
+    DIE_IF(0, fwrite(r->buf, 1, head - tail - first, r->out) != head - tail - first);
+    DIE_IF(0, fflush(r->out) < 0);
+
+    atomic_store_explicit(&r->tail, head, memory_order_release);
+}
+
+static void *drain_thread(void *arg)
+{
+    (void)arg;
+
+    while (!Drain.stop) {
+        pthread_mutex_lock(&Drain.mtx);
+
+        for (size_t i = 0; i < vec_size(Drain.rings); i++)
+            ring_drain(Drain.rings[i]);
+
+        pthread_mutex_unlock(&Drain.mtx);
+        system_sleep(DrainInterval);
+    }
+
+    return NULL;
+}
+
+LogRing *log_ring_init(size_t size, const char *fileName)
+// Async ring if fileName is given (starting the drain thread if needed), else flight recorder
+{
+    LogRing *r = calloc(1, sizeof(LogRing));
+
+    // Round up to a power of 2, large enough for a few records of maximum length
+    for (r->size = 4096; r->size < size; r->size *= 2);
+
+    r->buf = malloc(r->size);
+
+    if (fileName) {
+        DIE_IF(0, !(r->out = fopen(fileName, "we")));
+        DIE_IF(0, fwrite(Magic, sizeof(Magic), 1, r->out) != 1);
+
+        pthread_mutex_lock(&Drain.mtx);
+
+        if (!Drain.rings)
+            Drain.rings = vec_init(LogRing *);
+
+        vec_push(Drain.rings, r);
+
+        if (!Drain.running) {
+            Drain.stop = false;
+            pthread_create(&Drain.thread, NULL, drain_thread, NULL);
+            Drain.running = true;
+        }
+
+        pthread_mutex_unlock(&Drain.mtx);
+    }
+
+    return r;
+}
+
+void log_ring_destroy(LogRing *r)
+{
+    if (r->out) {
+        // Unregister, and write the remaining records
+        pthread_mutex_lock(&Drain.mtx);
+
+        for (size_t i = 0; i < vec_size(Drain.rings); i++)
+            if (Drain.rings[i] == r) {
+                Drain.rings[i] = Drain.rings[vec_size(Drain.rings) - 1];
+                vec_pop(Drain.rings);
+                break;
+            }
+
+        ring_drain(r);
+        DIE_IF(0, fclose(r->out) < 0);
+
+        // Last one: stop the drain thread
+        const bool last = Drain.running && !vec_size(Drain.rings);
+
+        if (last) {
+            Drain.stop = true;
+            Drain.running = false;
+        }
+
+        pthread_mutex_unlock(&Drain.mtx);
+
+        if (last) {
+            pthread_join(Drain.thread, NULL);
+            vec_destroy(Drain.rings);
+            Drain.rings = NULL;
+        }
+    }
+
+    free(r->buf);
+    free(r);
+}
+
+void log_ring_push(LogRing *r, int kind, const char *name, const char *text)
+{
+    // Truncate records that would take more than a quarter of the ring
+    const size_t nameLen = name ? strlen(name) + 1 : 0;
+    const size_t textLen = min(strlen(text), r->size / 4 - nameLen);
+
+    const LogRecord rec = {.usec = system_usec(), .len = (uint32_t)(nameLen + textLen),
+        .kind = (uint32_t)kind};
+    const size_t total = sizeof(rec) + padded(rec.len);
+
+    const size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+    if (r->out)
+        // Async: wait for the drain thread to make room (only if it's lagging far behind)
+        while (head + total - tail > r->size) {
+            system_sleep(1);
+            tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+        }
+    else {
+        // Flight recorder: discard the oldest records
+        while (head + total - tail > r->size) {
+            LogRecord old;
+            ring_read(r, tail, &old, sizeof(old));
+            tail += sizeof(old) + padded(old.len);
+        }
+
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+    }
+
+    ring_write(r, head, &rec, sizeof(rec));
+    ring_write(r, head + sizeof(rec), name, nameLen);
+    ring_write(r, head + sizeof(rec) + nameLen, text, textLen);
+    ring_write(r, head + sizeof(rec) + rec.len, (const char[8]){0}, padded(rec.len) - rec.len);
+
+    atomic_store_explicit(&r->head, head + total, memory_order_release);
+}
+
+bool log_print(FILE *out, int kind, const char *name, const char *text)
+{
+    if (kind == LOG_READ)
+        return fprintf(out, "%s -> %s\n", name, text) >= 0;
+    else if (kind == LOG_WRITE)
+        return fprintf(out, "%s <- %s\n", name, text) >= 0;
+    else
+        return fprintf(out, "%s\n", text) >= 0;
+}
+
+static bool print_payload(FILE *out, const LogRecord *rec, char *payload)
+// payload has rec->len bytes, plus one for the '\0' terminator
+{
+    payload[rec->len] = '\0';
+
+    if (rec->kind == LOG_NOTE)
+        return log_print(out, LOG_NOTE, NULL, payload);
+    else
+        return log_print(out, (int)rec->kind, payload, payload + strlen(payload) + 1);
+}
+
+bool log_ring_dump(LogRing *r, FILE *out)
+{
+    assert(!r->out);
+    const size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    char *payload = malloc(r->size / 4 + 1);
+    bool ok = payload;
+
+    for (size_t pos = atomic_load_explicit(&r->tail, memory_order_acquire); ok && pos < head; ) {
+        LogRecord rec;
+        ring_read(r, pos, &rec, sizeof(rec));
+
+        // Another thread may be writing (when dumping on exit): stop at the first broken record
+        if (rec.len > r->size / 4)
+            break;
+
+        ring_read(r, pos + sizeof(rec), payload, rec.len);
+        ok = print_payload(out, &rec, payload);
+        pos += sizeof(rec) + padded(rec.len);
+    }
+
+    atomic_store_explicit(&r->tail, head, memory_order_release);
+    free(payload);
+    return ok;
+}
+
+void log_decode(const char *fileName, FILE *out)
+{
+    FILE *in = fopen(fileName, "re");
+    DIE_IF(0, !in);
+
+    char magic[sizeof(Magic)];
+
+    if (fread(magic, sizeof(magic), 1, in) != 1 || memcmp(magic, Magic, sizeof(Magic)))
+        DIE("'%s' is not a c-chess-cli binary log\n", fileName);
+
+    char *payload = vec_init(char);
+    LogRecord rec;
+
+    while (fread(&rec, sizeof(rec), 1, in) == 1) {
+        const size_t len = padded(rec.len);
+        payload = vec_do_grow(payload, 1, len + 1);
+
+        if (fread(payload, 1, len, in) != len)
+            DIE("'%s': truncated record\n", fileName);
+
+        DIE_IF(0, !print_payload(out, &rec, payload));
+    }
+
+    vec_destroy(payload);
+    DIE_IF(0, fclose(in) < 0);
+}
@@ -0,0 +1,68 @@
+/*
+ * c-chess-cli, a command line interface for UCI chess engines. Copyright 2020 lucasart.
+ *
+ * c-chess-cli is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * c-chess-cli is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program. If
+ * not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+// -log modes
+enum {
+    LOG_MODE_OFF,
+    LOG_MODE_TEXT,  // fprintf() to c-chess-cli.id.log
+    LOG_MODE_ASYNC,  // binary records to c-chess-cli.id.bin, written by a background thread
+    LOG_MODE_FLIGHT  // last records kept in memory, dumped to c-chess-cli.id.log on error
+};
+
+// Kinds of records
+enum {
+    LOG_NOTE,  // text
+    LOG_READ,  // engine -> cli
+    LOG_WRITE  // cli -> engine
+};
+
+// Binary record, followed by len bytes of payload ("name\0line" for READ/WRITE, "text" for NOTE),
+// padded to a multiple of 8 bytes
+typedef struct {
+    int64_t usec;  // system_usec()
+    uint32_t len;
+    uint32_t kind;
+} LogRecord;
+
+// Single producer (the worker), single consumer (the drain thread) ring of records. Positions only
+// increase, and are reduced modulo size (a power of 2). In flight recorder mode (out = NULL), there
+// is no consumer: the producer advances tail itself, discarding the oldest records.
+typedef struct {
+    char *buf;
+    FILE *out;  // binary file, or NULL for a flight recorder
+    size_t size;
+    _Atomic size_t head;  // end of the last record (written by the producer)
+    _Atomic size_t tail;  // start of the oldest record not yet written (or discarded)
+} LogRing;
+
+LogRing *log_ring_init(size_t size, const char *fileName);
+void log_ring_destroy(LogRing *r);
+
+void log_ring_push(LogRing *r, int kind, const char *name, const char *text);
+
+// Write the records currently in a flight recorder, in text format, and discard them. Returns false
+// on write error (without DIE(), see worker_dump()).
+bool log_ring_dump(LogRing *r, FILE *out);
+
+// Text format of a record (same as -log). Returns false on write error.
+bool log_print(FILE *out, int kind, const char *name, const char *text);
+
+// Print a binary log file in text format
+void log_decode(const char *fileName, FILE *out);
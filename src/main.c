@@ -13,12 +13,25 @@
  * not, see <http://www.gnu.org/licenses/>.
 */
 #include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "affinity.h"
+#include "checkpoint.h"
+#include "dedup.h"
 #include "engine.h"
 #include "game.h"
 #include "jobs.h"
+#include "logring.h"
+#include "metrics.h"
 #include "openings.h"
 #include "options.h"
+#include "reactor.h"
+#include "remote.h"
 #include "seqwriter.h"
 #include "sprt.h"
 #include "util.h"
@@ -28,27 +41,294 @@
 static Options options;
 static EngineOptions *eo;
 static Openings openings;
-static SeqWriter pgnSeqWriter;
-FILE *sampleFile;
+static SeqWriter pgnSeqWriter, sampleSeqWriter;
+static FILE **sampleFiles;  // shards (unless options.sampleOrdered)
+static KeySet sampleKeys;  // positions of the samples written so far (-sample dedup=N)
+static uint64_t sampleKeysLoaded;  // from the dedup file, at startup
 static JobQueue jq;
+static bool finished;  // main() completed, as opposed to exit() from DIE()
+static Remote *remote;  // connection to the coordinator (-connect), if we are a remote worker
+static int64_t checkpointAt;  // system_msec() of the last checkpoint
+static int threadCount;  // one per worker, or -reactor
+
+// Per worker sample buffers are written to their shard in chunks of (at least) that size
+enum {SAMPLE_CHUNK = 1 << 20};
+
+// Time between two attempts to pop a job, when none can be popped yet (in msec)
+static const int64_t PopInterval = 10;
 
 static void main_destroy(void)
 {
+    // Exit on error (DIE): dump flight recorders (best effort, workers may still be running)
+    if (!finished)
+        for (size_t i = 0; i < vec_size(Workers); i++)
+            worker_dump(&Workers[i], "exit on error");
+
+    metrics_stop();
     vec_destroy_rec(Workers, worker_destroy);
 
-    if (options.sample.len)
-        fclose(sampleFile);
+    if (options.sample.len && !remote) {
+        if (options.sampleOrdered)
+            seq_writer_destroy(&sampleSeqWriter);
+        else {
+            for (size_t i = 0; i < vec_size(sampleFiles); i++)
+                DIE_IF(0, fclose(sampleFiles[i]) < 0);
 
-    if (options.pgn.len)
+            vec_destroy(sampleFiles);
+        }
+    }
+
+    if (options.pgn.len && !remote)
         seq_writer_destroy(&pgnSeqWriter);
 
+    if (options.sampleDedup && !remote)
+        key_set_destroy(&sampleKeys);
+
+    if (remote)
+        remote_destroy(remote);
+
     openings_destroy(&openings, 0);
     job_queue_destroy(&jq);
     options_destroy(&options);
     vec_destroy_rec(eo, engine_options_destroy);
 }
 
-static void main_init(int argc, const char **argv)
+static void sample_shard_name(const char *fileName, int shard, str_t *out)
+// Insert the shard number before the extension (eg. sample.bin -> sample.3.bin), if there is more
+// than one shard
+{
+    const char *dot = strrchr(fileName, '.'), *slash = strrchr(fileName, '/');
+
+    if (options.sampleShards == 1)
+        str_cpy_c(out, fileName);
+    else if (dot && (!slash || dot > slash)) {
+        str_ncpy(out, str_ref(fileName), (size_t)(dot - fileName));
+        str_cat_fmt(out, ".%i%s", shard, dot);
+    } else
+        str_cpy_fmt(out, "%s.%i", fileName, shard);
+}
+
+static void bytes_cat(char **buf, const void *data, size_t len)
+{
+    *buf = vec_do_grow(*buf, 1, len);
+    memcpy(*buf + vec_size(*buf), data, len);
+    vec_ptr(*buf)->size += len;
+}
+
+static void sample_flush(const Worker *w, char **buf)
+// Write the worker's sample buffer to its shard. Buffers are written in one call, under the FILE lock,
+// so records of different workers sharing a shard do not interleave.
+{
+    FILE *f = sampleFiles[(size_t)(w->id - 1) % vec_size(sampleFiles)];
+    DIE_IF(w->id, fwrite(*buf, 1, vec_size(*buf), f) != vec_size(*buf));
+    DIE_IF(w->id, fflush(f) < 0);
+    vec_clear(*buf);
+}
+
+static void truncate_output(const char *fileName, int64_t size)
+// Discard what was written after the checkpoint (size is unknown after the final checkpoint, when
+// all games are written)
+{
+    struct stat st = {0};
+    const bool exists = !stat(fileName, &st);
+
+    if (size < 0)
+        return;
+
+    if (st.st_size < size)
+        DIE("'%s' is shorter than at the last checkpoint\n", fileName);
+
+    if (exists)
+        DIE_IF(0, truncate(fileName, size) < 0);
+}
+
+static void skip_job(size_t idx)
+// Skipped jobs are written as empty chunks, so ordered writers do not wait for them
+{
+    if (options.pgn.len)
+        seq_writer_push(&pgnSeqWriter, idx, "", 0);
+
+    if (options.sample.len && options.sampleOrdered)
+        seq_writer_push(&sampleSeqWriter, idx, "", 0);
+}
+
+static void retire_pair(int pair, const char *reason)
+{
+    size_t *skipped = vec_init(size_t);
+
+    if (job_queue_retire(&jq, pair, reason, &skipped))
+        for (size_t i = 0; i < vec_size(skipped); i++)
+            skip_job(skipped[i]);
+
+    vec_destroy(skipped);
+}
+
+static void pair_check(int pair, const Result *r, const char *names[2])
+// SPRT update: on game pairs with -repeat. Retire the pair once the test is decided, or its Elo is
+// known precisely enough. SPRT status is printed, unless names is NULL (when resuming).
+{
+    char status[64] = "";
+    double elo = 0, error = 0;
+
+    if (options.sprt) {
+        const bool done = sprt_done(r, options.repeat, &options.sprtParam, status);
+
+        if (names && vec_size(eo) > 2)
+            printf("SPRT %s vs %s: %s\n", names[0], names[1], status);
+        else if (names)
+            printf("SPRT: %s\n", status);
+
+        if (done)
+            retire_pair(pair, status);
+    }
+
+    if (options.precision && elo_estimate(r, options.repeat, &elo, &error)
+            && error <= options.precision) {
+        snprintf(status, sizeof(status), "Elo = %.1f +/- %.1f", elo, error);
+        retire_pair(pair, status);
+    }
+}
+
+static void checkpoint_write(bool final)
+// Save the outcomes of jobs whose output is written: those before the first job missing from the
+// ordered output files (all completed jobs, if there are none, or at the end). At most once per
+// checkpoint interval, unless final.
+{
+    static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+
+    if (final)
+        pthread_mutex_lock(&mtx);
+    else if (pthread_mutex_trylock(&mtx))
+        return;
+
+    if (final || system_msec() - checkpointAt >= options.checkpointInterval) {
+        Checkpoint cp = {.srand = options.srand, .written = vec_size(jq.jobs), .pgnSize = -1,
+            .sampleSize = -1};
+        const bool ordered = options.sample.len && options.sampleOrdered;
+
+        if (!final) {
+            if (options.pgn.len)
+                cp.written = min(cp.written, seq_writer_written(&pgnSeqWriter));
+
+            if (ordered)
+                cp.written = min(cp.written, seq_writer_written(&sampleSeqWriter));
+
+            if (options.pgn.len)
+                cp.pgnSize = seq_writer_sync(&pgnSeqWriter, cp.written);
+
+            if (ordered)
+                cp.sampleSize = seq_writer_sync(&sampleSeqWriter, cp.written);
+        }
+
+        cp.outcomes = job_queue_outcomes(&jq);
+
+        for (size_t i = cp.written; i < vec_size(cp.outcomes); i++)
+            cp.outcomes[i] = -1;
+
+        checkpoint_save(options.checkpoint.buf, &cp);
+        checkpoint_destroy(&cp);
+        checkpointAt = system_msec();
+    }
+
+    pthread_mutex_unlock(&mtx);
+}
+
+static void report_result(const Job *job, size_t idx, int wld)
+// Record the outcome of game jobs[idx], print the score of its pair, and update SPRT or -precision
+{
+    // Copied under the lock: another worker may be setting an engine name, from its "id name"
+    str_t *engineNames = job_queue_names(&jq);
+    const char *names[2] = {engineNames[job->ei[0]].buf, engineNames[job->ei[1]].buf};
+
+    // Pair update
+    Result r;
+    job_queue_add_result(&jq, idx, wld, &r);
+    const int *wldCount = r.count;
+    const int n = wldCount[RESULT_WIN] + wldCount[RESULT_LOSS] + wldCount[RESULT_DRAW];
+    char ptnml[64] = "";
+
+    if (options.repeat)
+        sprintf(ptnml, "  Ptnml: %d %d %d %d %d", r.ptnml[0], r.ptnml[1], r.ptnml[2],
+            r.ptnml[3], r.ptnml[4]);
+
+    printf("Score of %s vs %s: %d - %d - %d  [%.3f] %d%s\n", names[0], names[1],
+        wldCount[RESULT_WIN], wldCount[RESULT_LOSS], wldCount[RESULT_DRAW],
+        (wldCount[RESULT_WIN] + 0.5 * wldCount[RESULT_DRAW]) / n, n, ptnml);
+
+    pair_check(job->pair, &r, names);
+    vec_destroy_rec(engineNames, str_destroy);
+
+    // Tournament update
+    if (vec_size(eo) > 2)
+        job_queue_print_results(&jq, (size_t)options.games);
+
+    if (options.checkpoint.len)
+        checkpoint_write(false);
+}
+
+static char *remote_dedup(size_t idx, const char *samples, size_t len, const uint64_t *keys,
+    size_t n)
+// Samples of a game played by a remote worker, without duplicates (vector), given keys[i] the key
+// of the i-th sample (record, or line). Samples that do not match their keys are dropped.
+{
+    char *kept = vec_init_reserve(len, char);
+    const char *end = samples + len;
+    size_t i = 0;
+
+    for (; i < n && samples < end; i++) {
+        const size_t left = (size_t)(end - samples);
+        const char *eol = options.sampleBinary ? NULL : memchr(samples, '\n', left);
+        const size_t size = options.sampleBinary ? sizeof(SampleRecord)
+            : eol ? (size_t)(eol - samples) + 1 : left;
+
+        if (size > left)
+            break;
+
+        if (key_set_insert(&sampleKeys, keys[i]))
+            bytes_cat(&kept, samples, size);
+
+        samples += size;
+    }
+
+    if (i < n || samples < end) {
+        printf("[0] WARNING: samples of game %zu do not match their keys, dropped\n", idx + 1);
+        vec_clear(kept);
+    }
+
+    return kept;
+}
+
+static void remote_done(size_t idx, int outcome, const char *pgn, size_t pgnLen,
+    const char *samples, size_t samplesLen, const uint64_t *keys, size_t keyCount)
+// Game played by a remote worker: write it, and report it, as if it was played locally. Duplicate
+// samples are dropped here. Unordered samples go to shard idx % shards, in one write.
+{
+    if (options.pgn.len)
+        seq_writer_push(&pgnSeqWriter, idx, pgn, pgnLen);
+
+    char *kept = NULL;
+
+    if (options.sample.len && options.sampleDedup && (samplesLen || keyCount)) {
+        kept = remote_dedup(idx, samples, samplesLen, keys, keyCount);
+        samples = kept;
+        samplesLen = vec_size(kept);
+    }
+
+    if (options.sample.len) {
+        if (options.sampleOrdered)
+            seq_writer_push(&sampleSeqWriter, idx, samples, samplesLen);
+        else if (samplesLen) {
+            FILE *f = sampleFiles[idx % vec_size(sampleFiles)];
+            DIE_IF(0, fwrite(samples, 1, samplesLen, f) != samplesLen);
+            DIE_IF(0, fflush(f) < 0);
+        }
+    }
+
+    vec_destroy(kept);
+    report_result(&jq.jobs[idx], idx, outcome);
+}
+
+static void main_init(int argc, const char **argv, uint64_t remoteSrand)
 {
     atexit(main_destroy);
 
@@ -56,55 +336,281 @@ static void main_init(int argc, const char **argv)
     options = options_init();
     options_parse(argc, argv, &options, &eo);
 
-    jq = job_queue_init(vec_size(eo), options.rounds, options.games, options.gauntlet);
+    // Checkpoints, metrics, and the persistent sample key set are handled by the coordinator only
+    if (remote) {
+        str_clear(&options.checkpoint);
+        str_clear(&options.metrics);
+        str_clear(&options.sampleDedupFile);
+        options.resume = false;
+    }
+
+    // Resuming truncates output files to their size at the checkpoint. Compressed files cannot be
+    // truncated, and sample shards also contain games after the checkpoint (and miss those still
+    // buffered): either would end up with games twice.
+    if (options.resume) {
+        if ((options.pgn.len && seq_writer_compressor(options.pgn.buf))
+                || (options.sample.len && seq_writer_compressor(options.sample.buf)))
+            DIE("-resume cannot be used with compressed output files\n");
+
+        if (options.sample.len && !options.sampleOrdered)
+            DIE("-resume requires ordered samples (-sample ... ordered=y)\n");
+    }
+
+    // Resume from the last checkpoint, if there is one yet
+    Checkpoint cp = {0};
+    const bool resumed = options.resume && checkpoint_load(options.checkpoint.buf, &cp);
+
+    // Random openings must be shuffled the same way by remote workers, and when resuming
+    if (remote)
+        options.srand = remoteSrand;
+    else if (resumed)
+        options.srand = cp.srand;
+    else if ((options.listen.len || options.checkpoint.len) && options.random && !options.srand)
+        options.srand = (uint64_t)system_msec();
+
+    jq = job_queue_init(vec_size(eo), options.rounds, options.games, options.gauntlet,
+        options.repeat);
     openings = openings_init(options.openings.buf, options.random, options.srand, 0);
 
-    if (options.pgn.len)
-        pgnSeqWriter = seq_writer_init(options.pgn.buf, "ae");
+    if (resumed) {
+        if (vec_size(cp.outcomes) != vec_size(jq.jobs))
+            DIE("checkpoint '%s' does not match this tournament (%zu games instead of %zu)\n",
+                options.checkpoint.buf, vec_size(cp.outcomes), vec_size(jq.jobs));
+
+        if (options.pgn.len)
+            truncate_output(options.pgn.buf, cp.pgnSize);
+
+        if (options.sample.len && options.sampleOrdered)
+            truncate_output(options.sample.buf, cp.sampleSize);
+    }
+
+    // Remote workers send PGN and samples to the coordinator, instead of writing them
+    if (options.pgn.len && !remote) {
+        seq_writer_init(&pgnSeqWriter, options.pgn.buf, "ae", options.flushInterval, NULL, 0);
+
+        if (options.checkpoint.len)
+            seq_writer_track(&pgnSeqWriter, cp.written);
+    }
+
+    if (options.sampleDedup && !remote) {
+        sampleKeys = key_set_init((uint64_t)options.sampleDedup);
+
+        if (options.sampleDedupFile.len && key_set_load(&sampleKeys, options.sampleDedupFile.buf)) {
+            sampleKeysLoaded = sampleKeys.count;
+            printf("Loaded %" PRIu64 " sample keys from '%s'\n", sampleKeysLoaded,
+                options.sampleDedupFile.buf);
+        }
+    }
 
-    if (options.sample.len)
-        DIE_IF(0, !(sampleFile = fopen(options.sample.buf, "ae")));
+    if (options.sample.len && !remote) {
+        // Binary format: start a new file with a header
+        const SampleHeader h = sample_header();
+        const size_t headerLen = options.sampleBinary ? sizeof(h) : 0;
+
+        if (options.sampleOrdered) {
+            seq_writer_init(&sampleSeqWriter, options.sample.buf, "ae", options.flushInterval, &h,
+                headerLen);
+
+            if (options.checkpoint.len)
+                seq_writer_track(&sampleSeqWriter, cp.written);
+        } else {
+            sampleFiles = vec_init(FILE *);
+
+            for (int i = 0; i < options.sampleShards; i++) {
+                scope(str_destroy) str_t fileName = str_init();
+                sample_shard_name(options.sample.buf, i, &fileName);
+
+                FILE *f = fopen(fileName.buf, "ae");
+                DIE_IF(0, !f);
+                DIE_IF(0, fseek(f, 0, SEEK_END) < 0);
+
+                if (!ftell(f))
+                    DIE_IF(0, fwrite(&h, 1, headerLen, f) != headerLen);
+
+                vec_push(sampleFiles, f);
+            }
+        }
+    }
+
+    // Complete the jobs of the checkpoint, and retire their pairs again if need be
+    if (resumed) {
+        job_queue_resume(&jq, cp.outcomes);
+
+        for (size_t i = 0; i < vec_size(jq.results); i++)
+            pair_check((int)i, &jq.results[i], NULL);
+
+        printf("Resumed from '%s': %zu games completed\n", options.checkpoint.buf, jq.completed);
+        checkpoint_destroy(&cp);
+    }
+
+    checkpointAt = system_msec();
 
     // Prepare Workers[]
     Workers = vec_init(Worker);
 
-    for (int i = 0; i < options.concurrency; i++) {
-        scope(str_destroy) str_t logName = str_init();
+    for (int i = 0; i < options.concurrency; i++)
+        vec_push(Workers, worker_init(i, options.logMode, (size_t)options.logSize * 1024));
+
+    // Assign CPUs to workers: each needs as many as the largest 'option.Threads' of all engines
+    if (options.affinity) {
+        int threads = 1;
+
+        for (size_t i = 0; i < vec_size(eo); i++)
+            for (size_t j = 0; j < vec_size(eo[i].options); j++) {
+                scope(str_destroy) str_t oname = str_init(), ovalue = str_init();
+                str_tok(str_tok(eo[i].options[j].buf, &oname, "="), &ovalue, "=");
+
+                if (!strcasecmp(oname.buf, "Threads"))
+                    threads = max(threads, atoi(ovalue.buf));
+            }
+
+        affinity_layout(threads, options.noSmt);
+    }
+
+    // Serve jobs to remote workers: send them our command line, without -listen and -secret
+    if (options.listen.len) {
+        const char **args = vec_init(const char *);
+
+        for (int i = 0; i < argc; i++)
+            if (!strcmp(argv[i], "-listen") || !strcmp(argv[i], "-secret"))
+                i++;
+            else
+                vec_push(args, argv[i]);
+
+        remote_listen(options.listen.buf, options.secret.buf, args, vec_size(args), options.srand,
+            &jq, (RemoteHooks){.done = remote_done, .skipped = skip_job});
+        vec_destroy(args);
+    }
+
+    if (options.metrics.len)
+        metrics_start(options.metrics.buf, &jq, &options, options.pgn.len ? &pgnSeqWriter : NULL,
+            options.sample.len && options.sampleOrdered ? &sampleSeqWriter : NULL);
+}
 
-        if (options.log)
-            str_cat_fmt(&logName, "c-chess-cli.%i.log", i + 1);
+// Live engine in a worker's pool
+typedef struct {
+    Engine engine;
+    uint64_t lastUsed;  // number of the last game played by the engine (for LRU eviction)
+    int ei;  // index in eo[]
+    char pad[4];
+} PooledEngine;
+
+static void pool_get(Worker *w, PooledEngine *pool, size_t capacity, const int ei[2],
+    uint64_t now, Engine *engines[2])
+// Sets engines[i] to a live engine for eo[ei[i]]: reuse it if it is in the pool, otherwise start
+// it. If the pool is full, the new engine replaces the least recently used one, except the other
+// engine of the pair. Engines never move in the pool, which is reserved to full capacity. When
+// both engines need to be started, they initialize in parallel.
+{
+    assert(capacity >= 2 && vec_capacity(pool) >= capacity);
+    bool started[2] = {false, false};
+
+    for (int i = 0; i < 2; i++) {
+        size_t slot = SIZE_MAX;
+
+        for (size_t j = 0; j < vec_size(pool); j++)
+            if (pool[j].ei == ei[i])
+                slot = j;
+
+        if (slot == SIZE_MAX) {
+            if (vec_size(pool) == capacity) {
+                for (size_t j = 0; j < vec_size(pool); j++)
+                    if (pool[j].ei != ei[1 - i]
+                            && (slot == SIZE_MAX || pool[j].lastUsed < pool[slot].lastUsed))
+                        slot = j;
+
+                engine_destroy(w, &pool[slot].engine);
+            } else
+                slot = vec_ptr(pool)->size++;
+
+            pool[slot].engine = engine_start(w, eo[ei[i]].cmd.buf, eo[ei[i]].name.buf);
+            metrics_add_start(ei[i]);
+            pool[slot].ei = ei[i];
+            started[i] = true;
+        }
 
-        vec_push(Workers, worker_init(i, logName.buf));
+        pool[slot].lastUsed = now;
+        engines[i] = &pool[slot].engine;
     }
+
+    for (int i = 0; i < 2; i++)
+        if (started[i]) {
+            engine_handshake(w, engines[i], eo[ei[i]].name.buf, eo[ei[i]].options);
+            job_queue_set_name(&jq, ei[i], engines[i]->name.buf);
+
+            if (remote)
+                remote_set_name(remote, ei[i], engines[i]->name.buf);
+        }
+}
+
+static bool pool_pop(const Worker *w, const int *loaded, size_t n, Job *job, size_t *idx,
+    size_t *count)
+// Pop a job from the local queue. Wait while the jobs left are too far ahead of the first unsettled
+// job. Returns false once all jobs are popped.
+{
+    while (!job_queue_pop(&jq, loaded, n, job, idx, count))
+        if (job_queue_done(&jq))
+            return false;
+        else
+            worker_sleep(w, PopInterval);
+
+    return true;
 }
 
 static void *thread_start(void *arg)
 {
     Worker *w = arg;
-    Engine engines[2] = {0};
+
+    // Pool capacity: -pool size, restricted to this worker's share of -pool max (if any)
+    size_t capacity = (size_t)options.poolSize;
+
+    if (options.poolMax) {
+        const int share = options.poolMax / options.concurrency
+            + (w->id - 1 < options.poolMax % options.concurrency);
+        capacity = min(capacity, (size_t)share);
+    }
+
+    PooledEngine *pool = vec_init_reserve(capacity, PooledEngine);
 
     scope(str_destroy) str_t fen = str_init();
     Job job = {0};
-    int ei[2] = {-1, -1};  // eo[ei[0]] plays eo[ei[1]]: initialize with invalid values to start
+    int loaded[capacity];  // indexes in eo[] of the engines in the pool
     size_t idx = 0, count = 0;  // game idx and count (shared across workers)
-
-    while (job_queue_pop(&jq, &job, &idx, &count)) {
-        // Engine stop/start, as needed
-        for (int i = 0; i < 2; i++)
-            if (job.ei[i] != ei[i]) {
-                if (engines[i].pid)
-                    engine_destroy(w, &engines[i]);
-
-                ei[i] = job.ei[i];
-                engines[i] = engine_init(w, eo[ei[i]].cmd.buf, eo[ei[i]].name.buf, eo[ei[i]].options);
-                job_queue_set_name(&jq, ei[i], engines[i].name.buf);
-            }
+    uint64_t played = 0;  // number of games played by this worker
+    char *sampleBuf = vec_init(char);  // samples not yet written to our shard
+
+    // Reused for all games, so that a game in steady state does not allocate memory
+    Game game = game_init(0, 0);
+    scope(str_destroy) str_t pgnText = str_init(), sampleText = str_init();
+    scope(str_destroy) str_t result = str_init(), reason = str_init();
+    char *gameSamples = vec_init(char);  // samples of one game (ordered writer, or coordinator)
+    SampleRecord *records = vec_init(SampleRecord);
+    uint64_t *keys = vec_init(uint64_t);  // of the samples sent to the coordinator (dedup=N)
+
+    while (true) {
+        for (size_t i = 0; i < vec_size(pool); i++)
+            loaded[i] = pool[i].ei;
+
+        // Remote workers build the same job queue as the coordinator, but pop from its own
+        if (remote ? !remote_pop(remote, w, jq.jobs, loaded, vec_size(pool), &idx, &count)
+                : !pool_pop(w, loaded, vec_size(pool), &job, &idx, &count))
+            break;
+
+        if (remote)
+            job = jq.jobs[idx];
+
+        // Get engines from the pool (start them as needed): eo[ei[0]] plays eo[ei[1]]
+        const int *ei = job.ei;
+        Engine *engines[2] = {NULL};
+        pool_get(w, pool, capacity, ei, ++played, engines);
 
         // Choose opening position
-        openings_next(&openings, &fen, options.repeat ? idx / 2 : idx, w->id);
+        openings_next(&openings, &fen, options.repeat ? idx / 2 : idx);
 
-        // Play 1 game
-        Game game = game_init(job.round, job.game);
+        // Play 1 game. Sample selection is seeded by the game index, so it does not depend on which
+        // worker plays the game.
+        game_reset(&game, job.round, job.game);
+        game.seed = options.srand + idx;
         int color = WHITE;
 
         if (!game_load_fen(&game, fen.buf, &color))
@@ -113,86 +619,226 @@ static void *thread_start(void *arg)
         const int whiteIdx = color ^ job.reverse;
 
         printf("[%d] Started game %zu of %zu (%s vs %s)\n", w->id, idx + 1, count,
-            engines[whiteIdx].name.buf, engines[opposite(whiteIdx)].name.buf);
+            engines[whiteIdx]->name.buf, engines[opposite(whiteIdx)]->name.buf);
 
         const EngineOptions *eoPair[2] = {&eo[ei[0]], &eo[ei[1]]};
         const int wld = game_play(w, &game, &options, engines, eoPair, job.reverse);
+        metrics_add_game(&job, &game, wld);
 
-        // Write to PGN file
-        if (options.pgn.len) {
-            scope(str_destroy) str_t pgnText = str_init();
+        if (options.pgn.len)
             game_export_pgn(&game, options.pgnVerbosity, &pgnText);
-            seq_writer_push(&pgnSeqWriter, idx, pgnText);
-        }
 
-        // Write to Sample file
+        // Samples: through the ordered writer (even if empty, to keep the sequence going), or into
+        // this worker's buffer, or to the coordinator
+        char **samples = options.sampleOrdered || remote ? &gameSamples : &sampleBuf;
+
+        if (samples == &gameSamples)
+            vec_clear(gameSamples);
+
+        // Duplicates are dropped here, or by the coordinator: remote workers send all samples,
+        // with their keys
+        KeySet *dedup = options.sampleDedup && !remote ? &sampleKeys : NULL;
+        vec_clear(keys);
+
         if (options.sample.len) {
-            scope(str_destroy) str_t sampleText = str_init();
-            game_export_samples(&game, &sampleText);
-            fputs(sampleText.buf, sampleFile);
+            if (options.sampleBinary) {
+                game_export_samples_bin(&game, dedup, &records);
+                bytes_cat(samples, records, vec_size(records) * sizeof(*records));
+            } else {
+                game_export_samples(&game, dedup, &sampleText);
+                bytes_cat(samples, sampleText.buf, sampleText.len);
+            }
+
+            if (options.sampleDedup && remote)
+                for (size_t i = 0; i < vec_size(game.samples); i++)
+                    vec_push(keys, game.samples[i].pos.key);
         }
 
         // Write to stdout a one line summary of the game
-        scope(str_destroy) str_t result = str_init(), reason = str_init();
         game_decode_state(&game, &result, &reason);
 
         printf("[%d] Finished game %zu (%s vs %s): %s {%s}\n", w->id, idx + 1,
-            engines[whiteIdx].name.buf, engines[opposite(whiteIdx)].name.buf, result.buf, reason.buf);
+            engines[whiteIdx]->name.buf, engines[opposite(whiteIdx)]->name.buf, result.buf, reason.buf);
 
-        // Pair update
-        int wldCount[3] = {0};
-        job_queue_add_result(&jq, job.pair, wld, wldCount);
-        const int n = wldCount[RESULT_WIN] + wldCount[RESULT_LOSS] + wldCount[RESULT_DRAW];
-        printf("Score of %s vs %s: %d - %d - %d  [%.3f] %d\n", engines[0].name.buf,
-            engines[1].name.buf, wldCount[RESULT_WIN], wldCount[RESULT_LOSS], wldCount[RESULT_DRAW],
-            (wldCount[RESULT_WIN] + 0.5 * wldCount[RESULT_DRAW]) / n, n);
+        if (remote)
+            remote_push_result(remote, idx, wld, pgnText.buf, pgnText.len, *samples,
+                vec_size(*samples), keys, vec_size(keys));
+        else {
+            if (options.pgn.len)
+                seq_writer_push(&pgnSeqWriter, idx, pgnText.buf, pgnText.len);
 
-        // SPRT update
-        if (options.sprt && sprt_done(wldCount, &options.sprtParam))
-            job_queue_stop(&jq);
+            if (options.sample.len && options.sampleOrdered)
+                seq_writer_push(&sampleSeqWriter, idx, gameSamples, vec_size(gameSamples));
+            else if (vec_size(sampleBuf) >= SAMPLE_CHUNK)
+                sample_flush(w, &sampleBuf);
 
-        // Tournament update
-        if (vec_size(eo) > 2)
-            job_queue_print_results(&jq, (size_t)options.games);
-
-        game_destroy(&game);
+            report_result(&job, idx, wld);
+        }
     }
 
-    for (int i = 0; i < 2; i++)
-        engine_destroy(w, &engines[i]);
+    game_destroy(&game);
+    vec_destroy(gameSamples);
+    vec_destroy(records);
+    vec_destroy(keys);
+
+    if (vec_size(sampleBuf))
+        sample_flush(w, &sampleBuf);
+
+    vec_destroy(sampleBuf);
+
+    for (size_t i = 0; i < vec_size(pool); i++)
+        engine_destroy(w, &pool[i].engine);
+
+    vec_destroy(pool);
 
+    workers_busy_add(-1);
     return NULL;
 }
 
+static void *reactor_start(void *arg)
+// Run a slice of Workers[] as coroutines on this thread (-reactor)
+{
+    const size_t i = (size_t)(intptr_t)arg, n = vec_size(Workers), threads = (size_t)threadCount;
+    const size_t first = i * n / threads, last = (i + 1) * n / threads;
+    reactor_run(&Workers[first], last - first, thread_start);
+    return NULL;
+}
+
+static void main_report_latency(void)
+// Print latency histograms (aggregated over all workers) to stdout, or write them to a JSON file
+// (aggregated and per worker)
+{
+    Histogram total[NB_STAGE] = {0};
+
+    for (size_t i = 0; i < vec_size(Workers); i++)
+        for (int s = 0; s < NB_STAGE; s++)
+            histogram_merge(&total[s], &Workers[i].latency[s]);
+
+    scope(str_destroy) str_t out = str_init(), json = str_init();
+
+    if (options.timingFile.len) {
+        // CPU time of c-chess-cli itself (all threads, but not the engines)
+        struct rusage ru = {0};
+        DIE_IF(0, getrusage(RUSAGE_SELF, &ru) < 0);
+        const int64_t cpu = (int64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000
+            + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+
+        latency_json(total, &json);
+        str_cat_fmt(&out, "{\"cpu\": %I, \"total\": %S, \"workers\": [", cpu, json);
+
+        for (size_t i = 0; i < vec_size(Workers); i++) {
+            latency_json(Workers[i].latency, &json);
+            str_cat_fmt(&out, "%s%S", i ? ", " : "", json);
+        }
+
+        str_cat_c(&out, "]}\n");
+
+        FILE *f = fopen(options.timingFile.buf, "we");
+        DIE_IF(0, !f);
+        DIE_IF(0, fputs(out.buf, f) < 0);
+        DIE_IF(0, fclose(f) < 0);
+    } else {
+        latency_print(total, &out);
+        fputs(out.buf, stdout);
+    }
+}
+
+static void main_report_dedup(void)
+// Print sample deduplication stats, and save the key set to its file (if any)
+{
+    const uint64_t dropped = sampleKeys.dropped, unchecked = sampleKeys.unchecked;
+    const uint64_t total = sampleKeys.count - sampleKeysLoaded + dropped + unchecked;
+    char rate[32] = "";
+    snprintf(rate, sizeof(rate), "%.2f", total ? 100.0 * (double)dropped / (double)total : 0.0);
+
+    printf("Samples: %" PRIu64 " duplicates dropped (%s%%)", dropped, rate);
+
+    if (unchecked)
+        printf(", %" PRIu64 " not checked (dedup=%" PRId64 " is full)", unchecked,
+            options.sampleDedup);
+
+    puts("");
+
+    if (options.sampleDedupFile.len)
+        key_set_save(&sampleKeys, options.sampleDedupFile.buf);
+}
+
 int main(int argc, const char **argv)
 {
-    main_init(argc, argv);
+    // Decode a binary log (-log async), and stop there
+    if (argc == 3 && !strcmp(argv[1], "-decode")) {
+        log_decode(argv[2], stdout);
+        return 0;
+    }
 
-    // Start threads[]
-    pthread_t threads[options.concurrency];
+    // A write to a dead compressor or engine fails with EPIPE, which is reported, instead of killing
+    // us with SIGPIPE. Engines are spawned with the default disposition (see engine_spawn()).
+    signal(SIGPIPE, SIG_IGN);
 
-    for (int i = 0; i < options.concurrency; i++)
-        pthread_create(&threads[i], NULL, thread_start, &Workers[i]);
-
-    // Main thread loop: check deadline overdue at regular intervals
-    do {
-        system_sleep(100);
-
-        // We want some tolerance on small delays here. Given a choice, it's best to wait for the
-        // worker thread to notice an overdue deadline, which it will handled nicely by counting the
-        // game as lost for the offending engine, and continue. Enforcing deadlines from the master
-        // thread is the last resort solution, because it is an unrecovrable error. At this point we
-        // are likely to face a completely unresponsive engine, where any attempt at I/O will block
-        // the master thread, on top of the already blocked worker. Hence, we must DIE().
-        for (int i = 0; i < options.concurrency; i++)
-            if (deadline_overdue(&Workers[i]) > 1000)
-                DIE("[%d] engine %s is unresponsive\n", Workers[i].id,
-                    Workers[i].deadline.engineName.buf);
-    } while (!job_queue_done(&jq));
+    // Remote worker: run the coordinator's command line, followed by our own options (eg.
+    // -concurrency, or -secret, needed to connect)
+    if (argc >= 3 && !strcmp(argv[1], "-connect")) {
+        static str_t *args;  // argv[] of main_init(), kept until exit
+        static const char **remoteArgv;
+        uint64_t srand = 0;
+        const char *secretFile = "";
+
+        for (int i = 3; i + 1 < argc; i++)
+            if (!strcmp(argv[i], "-secret"))
+                secretFile = argv[i + 1];
+
+        remote = remote_connect(argv[2], secretFile, &args, &srand);
+
+        remoteArgv = vec_init(const char *);
+
+        for (size_t i = 0; i < vec_size(args); i++)
+            vec_push(remoteArgv, args[i].buf);
+
+        for (int i = 3; i < argc; i++)
+            vec_push(remoteArgv, argv[i]);
+
+        main_init((int)vec_size(remoteArgv), remoteArgv, srand);
+        remote->batch = options.concurrency;  // one round trip per -concurrency jobs
+    } else
+        main_init(argc, argv, 0);
+
+    // Start threads[]: one per worker, or -reactor threads sharing the workers
+    threadCount = options.reactor ? min(options.reactor, options.concurrency) : options.concurrency;
+    pthread_t *threads = vec_init_reserve((size_t)threadCount, pthread_t);  // none for -concurrency 0
+    workers_busy_add(options.concurrency);
+
+    for (int i = 0; i < threadCount; i++) {
+        pthread_t thread;
+
+        if (options.reactor)
+            pthread_create(&thread, NULL, reactor_start, (void *)(intptr_t)i);
+        else
+            pthread_create(&thread, NULL, thread_start, &Workers[i]);
+
+        vec_push(threads, thread);
+    }
+
+    // Main thread: enforce deadlines, until all workers are done
+    deadline_watch();
 
     // Join threads[]
-    for (int i = 0; i < options.concurrency; i++)
+    for (size_t i = 0; i < vec_size(threads); i++)
         pthread_join(threads[i], NULL);
 
+    vec_destroy(threads);
+
+    if (options.timing)
+        main_report_latency();
+
+    if ((options.sprt || options.precision) && !remote)
+        job_queue_print_summary(&jq);
+
+    if (options.checkpoint.len)
+        checkpoint_write(true);
+
+    if (options.sampleDedup && !remote)
+        main_report_dedup();
+
+    finished = true;
     return 0;
 }
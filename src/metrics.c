@@ -0,0 +1,416 @@
+/*
+ * c-chess-cli, a command line interface for UCI chess engines. Copyright 2020 lucasart.
+ *
+ * c-chess-cli is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * c-chess-cli is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program. If
+ * not, see <http://www.gnu.org/licenses/>.
+*/
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "metrics.h"
+#include "sprt.h"
+#include "util.h"
+#include "vec.h"
+#include "workers.h"
+
+// Time between two polls of the listening socket, and maximum wait for a request (in msec)
+static const int PollInterval = 100;
+static const int RequestTimeout = 1000;
+
+static struct {
+    EngineMetrics *engines;  // one per engine (NULL until metrics_start())
+    JobQueue *jq;
+    const Options *o;
+    SeqWriter *writers[2];  // pgn, sample (NULL if none)
+    str_t path;  // Unix socket path (removed on stop), or empty for TCP
+    pthread_t thread;
+    int64_t start;  // system_msec() at metrics_start()
+    size_t completed;  // jobs already completed at metrics_start() (eg. resumed from a checkpoint)
+    _Atomic bool stop;
+    char pad[3];
+    int fd;
+} Metrics;
+
+static const char *WriterNames[2] = {"pgn", "sample"};
+
+static void cat_escaped(str_t *out, const char *s)
+// Quoted string, valid in JSON and as a Prometheus label value
+{
+    str_push(out, '"');
+
+    for (; *s; s++)
+        if (*s == '"' || *s == '\\')
+            str_push(str_push(out, '\\'), *s);
+        else if (*s == '\n')
+            str_cat_c(out, "\\n");
+        else if ((unsigned char)*s >= ' ')
+            str_push(out, *s);
+
+    str_push(out, '"');
+}
+
+static void cat_double(str_t *out, double x)
+{
+    char buf[32] = "";
+    snprintf(buf, sizeof(buf), "%.10g", x);
+    str_cat_c(out, buf);
+}
+
+// Snapshot of an engine's counters, and averages per move
+typedef struct {
+    const char *name;
+    double depth, nps, moveTime;
+    int64_t moves, timeLosses, illegalMoves, starts;
+} EngineStats;
+
+static EngineStats engine_stats(const str_t *names, size_t ei)
+{
+    const EngineMetrics *em = &Metrics.engines[ei];
+    EngineStats es = {.name = names[ei].buf, .moves = em->moves,
+        .timeLosses = em->timeLosses, .illegalMoves = em->illegalMoves, .starts = em->starts};
+    const int64_t time = em->time;
+
+    if (es.moves) {
+        es.depth = (double)em->depth / (double)es.moves;
+        es.moveTime = (double)time / (double)es.moves;
+    }
+
+    if (time)
+        es.nps = (double)em->nodes * 1000 / (double)time;
+
+    return es;
+}
+
+static double games_per_hour(size_t completed)
+{
+    const int64_t elapsed = system_msec() - Metrics.start;
+    return elapsed ? (double)(completed - Metrics.completed) * 3600000 / (double)elapsed : 0;
+}
+
+static void render_prometheus(str_t *out)
+{
+    size_t completed = 0;
+    Result *results = job_queue_results(Metrics.jq, &completed);
+    str_t *names = job_queue_names(Metrics.jq);
+
+    str_cpy_fmt(out, "# TYPE cccli_games_completed_total counter\ncccli_games_completed_total %U\n"
+        "# TYPE cccli_games gauge\ncccli_games %U\n"
+        "# TYPE cccli_workers_busy gauge\ncccli_workers_busy %i\n"
+        "# TYPE cccli_games_per_hour gauge\ncccli_games_per_hour ", (uintmax_t)completed,
+        (uintmax_t)vec_size(Metrics.jq->jobs), workers_busy_count());
+    cat_double(out, games_per_hour(completed));
+
+    str_cat_c(out, "\n# TYPE cccli_writer_pending gauge\n");
+
+    for (int i = 0; i < 2; i++)
+        if (Metrics.writers[i])
+            str_cat_fmt(out, "cccli_writer_pending{file=\"%s\"} %U\n", WriterNames[i],
+                (uintmax_t)Metrics.writers[i]->pending);
+
+    // Per engine: one metric at a time, for all engines (as Prometheus expects)
+    static const char *Names[] = {"moves_total", "depth_avg", "nps_avg", "move_time_avg_ms",
+        "time_losses_total", "illegal_moves_total", "starts_total"};
+    const size_t n = vec_size(names);
+    EngineStats stats[n];
+
+    for (size_t ei = 0; ei < n; ei++)
+        stats[ei] = engine_stats(names, ei);
+
+    for (size_t m = 0; m < sizeof(Names) / sizeof(*Names); m++) {
+        str_cat_fmt(out, "# TYPE cccli_engine_%s %s\n", Names[m],
+            strstr(Names[m], "_total") ? "counter" : "gauge");
+
+        for (size_t ei = 0; ei < n; ei++) {
+            const EngineStats *es = &stats[ei];
+            const double values[] = {(double)es->moves, es->depth, es->nps, es->moveTime,
+                (double)es->timeLosses, (double)es->illegalMoves, (double)es->starts};
+
+            str_cat_fmt(out, "cccli_engine_%s{engine=", Names[m]);
+            cat_escaped(out, es->name);
+            str_cat_c(out, "} ");
+            cat_double(out, values[m]);
+
+            str_push(out, '\n');
+        }
+    }
+
+    // Per pair: games played, and SPRT log likelihood ratio
+    for (int m = 0; m < 1 + Metrics.o->sprt; m++) {
+        str_cat_fmt(out, "# TYPE cccli_pair_%s gauge\n", m ? "sprt_llr" : "games");
+
+        for (size_t i = 0; i < vec_size(results); i++) {
+            const Result *r = &results[i];
+            scope(str_destroy) str_t pair = str_init();
+            str_cpy_fmt(&pair, "%S vs %S", names[r->ei[0]], names[r->ei[1]]);
+
+            str_cat_fmt(out, "cccli_pair_%s{pair=", m ? "sprt_llr" : "games");
+            cat_escaped(out, pair.buf);
+            str_cat_c(out, "} ");
+
+            if (m)
+                cat_double(out, sprt_llr(r, Metrics.o->repeat, &Metrics.o->sprtParam));
+            else
+                str_cat_fmt(out, "%i", r->count[RESULT_WIN] + r->count[RESULT_LOSS]
+                    + r->count[RESULT_DRAW]);
+
+            str_push(out, '\n');
+        }
+    }
+
+    vec_destroy(results);
+    vec_destroy_rec(names, str_destroy);
+}
+
+static void render_json(str_t *out)
+{
+    size_t completed = 0;
+    Result *results = job_queue_results(Metrics.jq, &completed);
+    str_t *names = job_queue_names(Metrics.jq);
+
+    str_cpy_fmt(out, "{\"games\": {\"completed\": %U, \"total\": %U, \"perHour\": ",
+        (uintmax_t)completed, (uintmax_t)vec_size(Metrics.jq->jobs));
+    cat_double(out, games_per_hour(completed));
+    str_cat_fmt(out, "}, \"workersBusy\": %i, \"writersPending\": {", workers_busy_count());
+
+    for (int i = 0, comma = 0; i < 2; i++)
+        if (Metrics.writers[i])
+            str_cat_fmt(out, "%s\"%s\": %U", comma++ ? ", " : "", WriterNames[i],
+                (uintmax_t)Metrics.writers[i]->pending);
+
+    str_cat_c(out, "}, \"engines\": [");
+
+    for (size_t ei = 0; ei < vec_size(names); ei++) {
+        const EngineStats es = engine_stats(names, ei);
+        str_cat_c(out, ei ? ", {\"name\": " : "{\"name\": ");
+        cat_escaped(out, es.name);
+        str_cat_fmt(out, ", \"moves\": %I, \"depth\": ", (intmax_t)es.moves);
+        cat_double(out, es.depth);
+        str_cat_c(out, ", \"nps\": ");
+        cat_double(out, es.nps);
+        str_cat_c(out, ", \"moveTime\": ");
+        cat_double(out, es.moveTime);
+        str_cat_fmt(out, ", \"timeLosses\": %I, \"illegalMoves\": %I, \"starts\": %I}",
+            (intmax_t)es.timeLosses, (intmax_t)es.illegalMoves, (intmax_t)es.starts);
+    }
+
+    str_cat_c(out, "], \"pairs\": [");
+
+    for (size_t i = 0; i < vec_size(results); i++) {
+        const Result *r = &results[i];
+        str_cat_c(out, i ? ", {\"engines\": [" : "{\"engines\": [");
+        cat_escaped(out, names[r->ei[0]].buf);
+        str_cat_c(out, ", ");
+        cat_escaped(out, names[r->ei[1]].buf);
+        str_cat_fmt(out, "], \"wld\": [%i, %i, %i]", r->count[RESULT_WIN], r->count[RESULT_LOSS],
+            r->count[RESULT_DRAW]);
+
+        if (Metrics.o->sprt) {
+            str_cat_c(out, ", \"llr\": ");
+            cat_double(out, sprt_llr(r, Metrics.o->repeat, &Metrics.o->sprtParam));
+        }
+
+        str_push(out, '}');
+    }
+
+    str_cat_c(out, "]}\n");
+    vec_destroy(results);
+    vec_destroy_rec(names, str_destroy);
+}
+
+static void serve(int fd)
+// Answer one HTTP request, and close the connection
+{
+    char req[1024];
+    size_t len = 0;
+
+    // Read the request line, giving up on slow or silent clients
+    while (len < sizeof(req) - 1 && !memchr(req, '\n', len)) {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+
+        if (poll(&pfd, 1, RequestTimeout) <= 0)
+            return;
+
+        const ssize_t n = read(fd, &req[len], sizeof(req) - 1 - len);
+
+        if (n <= 0)
+            return;
+
+        len += (size_t)n;
+    }
+
+    req[len] = '\0';
+
+    scope(str_destroy) str_t method = str_init(), path = str_init(), body = str_init(),
+        out = str_init();
+    str_tok(str_tok(req, &method, " "), &path, " ");
+    const char *type = "text/plain; version=0.0.4";
+    const char *status = "200 OK";
+
+    if (strcmp(method.buf, "GET")) {
+        status = "405 Method Not Allowed";
+        str_cpy_c(&body, "GET only\n");
+    } else if (!strcmp(path.buf, "/metrics") || !strcmp(path.buf, "/"))
+        render_prometheus(&body);
+    else if (!strcmp(path.buf, "/metrics.json")) {
+        render_json(&body);
+        type = "application/json";
+    } else {
+        status = "404 Not Found";
+        str_cpy_c(&body, "try /metrics or /metrics.json\n");
+    }
+
+    str_cpy_fmt(&out, "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %U\r\n"
+        "Connection: close\r\n\r\n%S", status, type, (uintmax_t)body.len, body);
+    socket_send(fd, out.buf, out.len);
+}
+
+static void *metrics_thread(void *arg)
+{
+    (void)arg;
+
+    while (!Metrics.stop) {
+        struct pollfd pfd = {.fd = Metrics.fd, .events = POLLIN};
+
+        if (poll(&pfd, 1, PollInterval) <= 0)
+            continue;
+
+        const int fd = accept(Metrics.fd, NULL, NULL);
+
+        if (fd < 0)
+            continue;
+
+#ifdef SO_NOSIGPIPE
+        const int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+        serve(fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+void metrics_start(const char *address, JobQueue *jq, const Options *o, SeqWriter *pgnWriter,
+    SeqWriter *sampleWriter)
+{
+    Metrics.jq = jq;
+    Metrics.o = o;
+    Metrics.writers[0] = pgnWriter;
+    Metrics.writers[1] = sampleWriter;
+    Metrics.start = system_msec();
+
+    Result *results = job_queue_results(jq, &Metrics.completed);
+    vec_destroy(results);
+    Metrics.path = str_init();
+
+    // TCP if address is PORT (loopback only) or IPV4:PORT, otherwise Unix socket path
+    const char *colon = strrchr(address, ':');
+    const char *port = colon ? colon + 1 : address;
+    const char *c = port;
+    while (*c >= '0' && *c <= '9')
+        c++;
+
+    if (*port && !*c) {
+        const int on = 1;
+        struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons((uint16_t)atoi(port)),
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+
+        if (colon) {
+            scope(str_destroy) str_t host = str_init();
+            str_ncpy(&host, str_ref(address), (size_t)(colon - address));
+
+            if (inet_pton(AF_INET, host.buf, &addr.sin_addr) != 1)
+                DIE("-metrics: invalid IPv4 address '%s'\n", host.buf);
+        }
+
+        DIE_IF(0, (Metrics.fd = socket(AF_INET, SOCK_STREAM, 0)) < 0);
+        DIE_IF(0, setsockopt(Metrics.fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0);
+        DIE_IF(0, bind(Metrics.fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0);
+    } else {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+        if (strlen(address) >= sizeof(addr.sun_path))
+            DIE("-metrics: socket path too long '%s'\n", address);
+
+        strcpy(addr.sun_path, address);
+        str_cpy_c(&Metrics.path, address);
+        unlink(address);  // left over by a previous run
+
+        DIE_IF(0, (Metrics.fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0);
+        DIE_IF(0, bind(Metrics.fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0);
+    }
+
+    DIE_IF(0, listen(Metrics.fd, 16) < 0);
+
+    Metrics.engines = calloc(vec_size(jq->names), sizeof(EngineMetrics));
+    pthread_create(&Metrics.thread, NULL, metrics_thread, NULL);
+}
+
+void metrics_stop(void)
+{
+    if (!Metrics.engines)
+        return;
+
+    Metrics.stop = true;
+    pthread_join(Metrics.thread, NULL);
+    close(Metrics.fd);
+
+    if (Metrics.path.len)
+        unlink(Metrics.path.buf);
+
+    str_destroy(&Metrics.path);
+    free(Metrics.engines);
+    Metrics.engines = NULL;
+}
+
+void metrics_add_game(const Job *job, const Game *g, int wld)
+{
+    if (!Metrics.engines)
+        return;
+
+    // Plies alternate between engines, ei[reverse] playing the first one (see game_play())
+    int64_t moves[2] = {0}, depth[2] = {0}, nodes[2] = {0}, time[2] = {0};
+
+    for (size_t ply = 0; ply < vec_size(g->info); ply++) {
+        const int i = job->reverse ^ (ply & 1);
+        moves[i]++;
+        depth[i] += g->info[ply].depth;
+        nodes[i] += g->info[ply].nodes;
+        time[i] += g->info[ply].time;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        EngineMetrics *em = &Metrics.engines[job->ei[i]];
+        em->moves += moves[i];
+        em->depth += depth[i];
+        em->nodes += nodes[i];
+        em->time += time[i];
+    }
+
+    // The engine on the move lost
+    EngineMetrics *loser = &Metrics.engines[job->ei[wld == RESULT_LOSS ? 0 : 1]];
+
+    if (g->state == STATE_TIME_LOSS)
+        loser->timeLosses++;
+    else if (g->state == STATE_ILLEGAL_MOVE)
+        loser->illegalMoves++;
+}
+
+void metrics_add_start(int ei)
+{
+    if (Metrics.engines)
+        Metrics.engines[ei].starts++;
+}
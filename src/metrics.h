@@ -0,0 +1,36 @@
+/*
+ * c-chess-cli, a command line interface for UCI chess engines. Copyright 2020 lucasart.
+ *
+ * c-chess-cli is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * c-chess-cli is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program. If
+ * not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include "game.h"
+#include "jobs.h"
+#include "options.h"
+#include "seqwriter.h"
+
+// Counters of an engine (index in eo[]), updated once per game by workers
+typedef struct {
+    _Atomic int64_t moves, depth, nodes, time;  // sums over all moves (time in msec)
+    _Atomic int64_t timeLosses, illegalMoves, starts;
+} EngineMetrics;
+
+// -metrics ADDRESS: serve metrics over HTTP, on a TCP port (if ADDRESS is a number) or a Unix
+// socket path, from a background thread. GET /metrics returns Prometheus text format, and GET
+// /metrics.json returns JSON. Writers may be NULL (no such output file).
+void metrics_start(const char *address, JobQueue *jq, const Options *o, SeqWriter *pgnWriter,
+    SeqWriter *sampleWriter);
+void metrics_stop(void);
+
+// No-op unless metrics_start() was called
+void metrics_add_game(const Job *job, const Game *g, int wld);
+void metrics_add_start(int ei);
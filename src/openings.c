@@ -13,27 +13,179 @@
  * not, see <http://www.gnu.org/licenses/>.
 */
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "openings.h"
 #include "util.h"
 #include "vec.h"
 
+// Index file (FILE.idx), written next to the opening file: an IndexHeader, followed by count file
+// offsets (uint64_t, native byte order). It is only used if the opening file has the same inode,
+// size and mtime (to the nanosecond), and all offsets are within the file.
+typedef struct {
+    char magic[8];  // "CCCLIIX2"
+    uint64_t size;  // size of the opening file
+    int64_t mtime;  // modification time of the opening file (in nanoseconds since the epoch)
+    uint64_t ino;  // inode of the opening file
+    uint64_t count;  // number of lines
+} IndexHeader;
+
+static const char IndexMagic[8] = "CCCLIIX2";
+
+// Files larger than that are indexed in parallel, using one thread per chunk
+enum {INDEX_CHUNK = 16 << 20, INDEX_THREADS = 64};
+
+typedef struct {
+    const char *data;
+    size_t begin, end;  // chunk to scan: data[begin..end-1]
+    uint64_t *offsets;  // offsets following each '\n' found in the chunk
+} IndexChunk;
+
+static void *index_chunk(void *arg)
+{
+    IndexChunk *c = arg;
+    const char *end = c->data + c->end;
+
+    for (const char *s = c->data + c->begin; (s = memchr(s, '\n', (size_t)(end - s))); s++)
+        vec_push(c->offsets, (uint64_t)(s + 1 - c->data));
+
+    return NULL;
+}
+
+static void index_build(Openings *o)
+{
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    const size_t maxThreads = cpus > 0 ? min((size_t)cpus, (size_t)INDEX_THREADS) : 1;
+    const size_t n = min(o->size / INDEX_CHUNK + 1, maxThreads);
+    IndexChunk chunks[n];
+    pthread_t threads[n];
+
+    for (size_t i = 0; i < n; i++) {
+        chunks[i] = (IndexChunk){
+            .data = o->data,
+            .begin = o->size * i / n,
+            .end = o->size * (i + 1) / n,
+            .offsets = vec_init(uint64_t)
+        };
+
+        if (i)
+            pthread_create(&threads[i], NULL, index_chunk, &chunks[i]);
+    }
+
+    index_chunk(&chunks[0]);
+
+    // The first line starts at offset 0, then each line starts after a '\n'
+    vec_push(o->index, 0);
+
+    for (size_t i = 0; i < n; i++) {
+        if (i)
+            pthread_join(threads[i], NULL);
+
+        const size_t count = vec_size(chunks[i].offsets);
+        o->index = vec_do_grow(o->index, sizeof(uint64_t), count);
+        memcpy(&o->index[vec_size(o->index)], chunks[i].offsets, count * sizeof(uint64_t));
+        vec_ptr(o->index)->size += count;
+        vec_destroy(chunks[i].offsets);
+    }
+
+    // A '\n' at the end of the file does not start a new line
+    if (o->index[vec_size(o->index) - 1] == o->size)
+        vec_pop(o->index);
+}
+
+static int64_t mtime_nsec(const struct stat *st)
+{
+#ifdef __APPLE__
+    return (int64_t)st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#else
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+static bool index_load(Openings *o, const char *indexName, const struct stat *st)
+// A stale or corrupt index is rejected, so that openings_next() never reads out of the mapping
+{
+    FILE *in = fopen(indexName, "re");
+
+    if (!in)
+        return false;
+
+    IndexHeader h = {0};
+    bool ok = fread(&h, sizeof(h), 1, in) == 1 && !memcmp(h.magic, IndexMagic, sizeof(h.magic))
+        && h.size == o->size && h.mtime == mtime_nsec(st) && h.ino == (uint64_t)st->st_ino
+        && h.count && h.count <= o->size;
+
+    if (ok) {
+        o->index = vec_do_grow(o->index, sizeof(uint64_t), h.count);
+
+        if ((ok = fread(o->index, sizeof(uint64_t), h.count, in) == h.count))
+            vec_ptr(o->index)->size = h.count;
+
+        for (size_t i = 0; ok && i < h.count; i++)
+            ok = o->index[i] < o->size;
+    }
+
+    fclose(in);
+    return ok;
+}
+
+static void index_save(const Openings *o, const char *indexName, const struct stat *st)
+// Failure to write the index is not fatal (eg. read only directory). Write to a temporary file
+// first, so that concurrent runs never see a partially written index.
+{
+    scope(str_destroy) str_t tmpName = str_init();
+    str_cpy_fmt(&tmpName, "%s.%i", indexName, (int)getpid());
+
+    FILE *out = fopen(tmpName.buf, "we");
+
+    if (!out)
+        return;
+
+    IndexHeader h = {.size = o->size, .mtime = mtime_nsec(st), .ino = (uint64_t)st->st_ino,
+        .count = vec_size(o->index)};
+    memcpy(h.magic, IndexMagic, sizeof(h.magic));
+
+    const bool ok = fwrite(&h, sizeof(h), 1, out) == 1
+        && fwrite(o->index, sizeof(uint64_t), h.count, out) == h.count;
+
+    if (fclose(out) < 0 || !ok || rename(tmpName.buf, indexName) < 0)
+        unlink(tmpName.buf);
+}
+
 Openings openings_init(const char *fileName, bool random, uint64_t srand, int threadId)
 {
     Openings o = {0};
-    o.index = vec_init(size_t);
+    o.index = vec_init(uint64_t);
+
+    if (*fileName) {
+        const int fd = open(fileName, O_RDONLY | O_CLOEXEC);
+        DIE_IF(threadId, fd < 0);
 
-    if (*fileName)
-        DIE_IF(threadId, !(o.file = fopen(fileName, "re")));
+        struct stat st = {0};
+        DIE_IF(threadId, fstat(fd, &st) < 0);
 
-    if (o.file) {
-        // Fill o.index[] to record file offsets for each lines
-        scope(str_destroy) str_t line = str_init();
+        if (!(o.size = (size_t)st.st_size))
+            DIE("[%d] opening file '%s' is empty\n", threadId, fileName);
 
-        do {
-            vec_push(o.index, ftell(o.file));
-        } while (str_getline(&line, o.file));
+        void *data = mmap(NULL, o.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        DIE_IF(threadId, data == MAP_FAILED);
+        DIE_IF(threadId, close(fd) < 0);
+        o.data = data;
 
-        vec_pop(o.index);  // EOF offset must be removed
+        // Fill o.index[] to record file offsets for each line: use the index file if it is up to
+        // date, otherwise scan the file (and update the index file)
+        scope(str_destroy) str_t indexName = str_init();
+        str_cpy_fmt(&indexName, "%s.idx", fileName);
+
+        if (!index_load(&o, indexName.buf, &st)) {
+            vec_clear(o.index);
+            index_build(&o);
+            index_save(&o, indexName.buf, &st);
+        }
 
         if (random) {
             // Shuffle o.index[], which will be read sequentially from the beginning. This allows
@@ -49,33 +201,44 @@ Openings openings_init(const char *fileName, bool random, uint64_t srand, int th
         }
     }
 
-    pthread_mutex_init(&o.mtx, NULL);
     return o;
 }
 
 void openings_destroy(Openings *o, int threadId)
 {
-    if (o->file)
-        DIE_IF(threadId, fclose(o->file) < 0);
+    if (o->data)
+        DIE_IF(threadId, munmap((void *)o->data, o->size) < 0);
 
-    pthread_mutex_destroy(&o->mtx);
     vec_destroy(o->index);
 }
 
-void openings_next(Openings *o, str_t *fen, size_t idx, int threadId)
+void openings_next(const Openings *o, str_t *fen, size_t idx)
+// Lock-free: the mapping and the index are read only
 {
-    if (!o->file) {
+    if (!o->data) {
         str_cpy_c(fen, "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
         return;
     }
 
-    // Read 'fen' from file
-    scope(str_destroy) str_t line = str_init();
+    // Slice of the line in the mapping
+    const char *begin = o->data + o->index[idx % vec_size(o->index)];
+    const char *end = memchr(begin, '\n', (size_t)(o->data + o->size - begin));
+
+    if (!end)
+        end = o->data + o->size;
+
+    // 'fen' is the first ';' delimited token of the line (ignoring '\r')
+    while (begin < end && *begin == ';')
+        begin++;
+
+    const char *semicolon = memchr(begin, ';', (size_t)(end - begin));
+
+    if (semicolon)
+        end = semicolon;
 
-    pthread_mutex_lock(&o->mtx);
-    DIE_IF(threadId, fseek(o->file, o->index[idx % vec_size(o->index)], SEEK_SET) < 0);
-    DIE_IF(threadId, !str_getline(&line, o->file));
-    pthread_mutex_unlock(&o->mtx);
+    while (end > begin && end[-1] == '\r')
+        end--;
 
-    str_tok(line.buf, fen, ";");
+    str_clear(fen);
+    str_ncat(fen, (str_t){.buf = (char *)begin, .len = (size_t)(end - begin)}, (size_t)(end - begin));
 }
@@ -14,18 +14,19 @@
 */
 #pragma once
 #include <inttypes.h>
-#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include "str.h"
 
+// Opening file, mapped in memory. After openings_init(), it is read only, and can be accessed
+// concurrently without locking.
 typedef struct {
-    pthread_mutex_t mtx;
-    FILE *file;
-    long *index;  // vector of file offsets
+    const char *data;  // memory mapping of the file (NULL if none)
+    size_t size;  // file size
+    uint64_t *index;  // vector of file offsets (start of each line)
 } Openings;
 
 Openings openings_init(const char *fileName, bool random, uint64_t srand, int threadId);
 void openings_destroy(Openings *openings, int threadId);
 
-void openings_next(Openings *o, str_t *fen, size_t idx, int threadId);
+void openings_next(const Openings *o, str_t *fen, size_t idx);
@@ -20,27 +20,75 @@
 #include "util.h"
 #include "vec.h"
 
-static void options_parse_sample(const char *s, Options *o)
+static void options_parse_sample_legacy(const char *s, Options *o)
+// Legacy syntax 'freq[,resolvePv[,file]]'
 {
     scope(str_destroy) str_t token = str_init();
     const char *tail = str_tok(s, &token, ",");
     assert(tail);
 
-    // Parse sample frequency (and check range)
     o->sampleFrequency = atof(token.buf);
 
-    if (o->sampleFrequency > 1.0 || o->sampleFrequency < 0.0)
-        DIE("Sample frequency '%f' must be between 0 and 1\n", o->sampleFrequency);
-
     // Parse resolve flag
     if ((tail = str_tok(tail, &token, ",")))
         o->sampleResolvePv = !strcmp(token.buf, "y");
 
-    // Parse filename (default sample.csv if omitted)
+    // Parse filename
     if ((tail = str_tok(tail, &token, ",")))
         str_cpy(&o->sample, token);
+}
+
+static int options_parse_sample(int argc, const char **argv, int i, Options *o)
+{
+    if (i >= argc)
+        DIE("Missing parameter(s) for '-sample'\n");
+
+    if (!strchr(argv[i], '='))
+        options_parse_sample_legacy(argv[i++], o);
     else
-        str_cpy_c(&o->sample, "sample.csv");
+        while (i < argc && argv[i][0] != '-') {
+            const char *tail = NULL;
+
+            if ((tail = str_prefix(argv[i], "freq=")))
+                o->sampleFrequency = atof(tail);
+            else if ((tail = str_prefix(argv[i], "resolve=")))
+                o->sampleResolvePv = !strcmp(tail, "y");
+            else if ((tail = str_prefix(argv[i], "file=")))
+                str_cpy_c(&o->sample, tail);
+            else if ((tail = str_prefix(argv[i], "format="))) {
+                if (!strcmp(tail, "bin"))
+                    o->sampleBinary = true;
+                else if (strcmp(tail, "csv"))
+                    DIE("Invalid format for -sample: '%s'\n", tail);
+            } else if ((tail = str_prefix(argv[i], "shards=")))
+                o->sampleShards = atoi(tail);
+            else if ((tail = str_prefix(argv[i], "ordered=")))
+                o->sampleOrdered = !strcmp(tail, "y");
+            else if ((tail = str_prefix(argv[i], "dedup=")))
+                o->sampleDedup = atoll(tail);
+            else if ((tail = str_prefix(argv[i], "dedupfile=")))
+                str_cpy_c(&o->sampleDedupFile, tail);
+            else
+                DIE("Illegal token in -sample: '%s'\n", argv[i]);
+
+            i++;
+        }
+
+    // Check sample frequency range
+    if (o->sampleFrequency > 1.0 || o->sampleFrequency < 0.0)
+        DIE("Sample frequency '%f' must be between 0 and 1\n", o->sampleFrequency);
+
+    if (o->sampleShards < 1 || (o->sampleOrdered && o->sampleShards > 1))
+        DIE("-sample: shards must be at least 1, and ordered=y requires a single shard\n");
+
+    if (o->sampleDedup < 0 || (o->sampleDedupFile.len && !o->sampleDedup))
+        DIE("-sample: dedup must be positive, and dedupfile requires dedup\n");
+
+    // Default filename, if omitted
+    if (!o->sample.len)
+        str_cpy_c(&o->sample, o->sampleBinary ? "sample.bin" : "sample.csv");
+
+    return i - 1;
 }
 
 // Parse time control. Expects 'mtg/time+inc' or 'time+inc'. Note that time and inc are provided by
@@ -88,6 +136,8 @@ static int options_parse_eo(int argc, const char **argv, int i, EngineOptions *e
             eo->movetime = (int64_t)(atof(tail) * 1000);
         else if ((tail = str_prefix(argv[i], "tc=")))
             options_parse_tc(tail, eo);
+        else if ((tail = str_prefix(argv[i], "pipeline=")))
+            eo->pipeline = !strcmp(tail, "y");
         else
             DIE("Illegal syntax '%s'\n", argv[i]);
 
@@ -146,7 +196,14 @@ static int options_parse_sprt(int argc, const char **argv, int i, Options *o)
             o->sprtParam.alpha = atof(tail);
         else if ((tail = str_prefix(argv[i], "beta=")))
             o->sprtParam.beta = atof(tail);
-        else
+        else if ((tail = str_prefix(argv[i], "model="))) {
+            if (!strcmp(tail, "normalized"))
+                o->sprtParam.model = SPRT_NORMALIZED;
+            else if (!strcmp(tail, "logistic"))
+                o->sprtParam.model = SPRT_LOGISTIC;
+            else
+                DIE("Illegal model in -sprt: '%s'\n", tail);
+        } else
             DIE("Illegal token in -sprt: '%s'\n", argv[i]);
 
         i++;
@@ -179,12 +236,23 @@ Options options_init(void)
     o.openings = str_init();
     o.pgn = str_init();
     o.sample = str_init();
+    o.sampleDedupFile = str_init();
+    o.timingFile = str_init();
+    o.checkpoint = str_init();
+    o.metrics = str_init();
+    o.listen = str_init();
+    o.secret = str_init();
 
     // non-zero default values
     o.concurrency = 1;
     o.games = o.rounds = 1;
     o.sprtParam.alpha = o.sprtParam.beta = 0.05;
     o.pgnVerbosity = 3;
+    o.flushInterval = 1000;
+    o.checkpointInterval = 60000;
+    o.sampleShards = 1;
+    o.logSize = 1024;
+    o.poolSize = 2;
 
     return o;
 }
@@ -199,11 +267,50 @@ void options_parse(int argc, const char **argv, Options *o, EngineOptions **eo)
             o->repeat = true;
         else if (!strcmp(argv[i], "-gauntlet"))
             o->gauntlet = true;
-        else if (!strcmp(argv[i], "-log"))
-            o->log = true;
-        else if (!strcmp(argv[i], "-concurrency"))
+        else if (!strcmp(argv[i], "-tb"))
+            o->tbAdjudicate = true;
+        else if (!strcmp(argv[i], "-history"))
+            o->history = true;
+        else if (!strcmp(argv[i], "-affinity")) {
+            o->affinity = true;
+
+            if (i + 1 < argc && !strcmp(argv[i + 1], "nosmt")) {
+                o->noSmt = true;
+                i++;
+            }
+        } else if (!strcmp(argv[i], "-log")) {
+            o->logMode = LOG_MODE_TEXT;
+
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                const char *tail = NULL;
+
+                if (!strcmp(argv[++i], "async"))
+                    o->logMode = LOG_MODE_ASYNC;
+                else if ((tail = str_prefix(argv[i], "flight=")) && atoi(tail) > 0) {
+                    o->logMode = LOG_MODE_FLIGHT;
+                    o->logSize = atoi(tail);
+                } else
+                    DIE("Invalid mode for -log: '%s'\n", argv[i]);
+            }
+        } else if (!strcmp(argv[i], "-timing")) {
+            o->timing = true;
+
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+                str_cpy_c(&o->timingFile, argv[++i]);
+        } else if (!strcmp(argv[i], "-concurrency"))
             o->concurrency = atoi(argv[++i]);
-        else if (!strcmp(argv[i], "-each")) {
+        else if (!strcmp(argv[i], "-reactor"))
+            o->reactor = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-listen"))
+            str_cpy_c(&o->listen, argv[++i]);
+        else if (!strcmp(argv[i], "-secret"))
+            str_cpy_c(&o->secret, argv[++i]);
+        else if (!strcmp(argv[i], "-pool")) {
+            o->poolSize = atoi(argv[++i]);
+
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+                o->poolMax = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-each")) {
             i = options_parse_eo(argc, argv, i + 1, &each);
             eachSet = true;
         } else if (!strcmp(argv[i], "-engine")) {
@@ -221,14 +328,27 @@ void options_parse(int argc, const char **argv, Options *o, EngineOptions **eo)
 
             if (i + 1 < argc && argv[i + 1][0] != '-')
                 o->pgnVerbosity = atoi(argv[++i]);
-        } else if (!strcmp(argv[i], "-resign"))
+        } else if (!strcmp(argv[i], "-checkpoint")) {
+            str_cpy_c(&o->checkpoint, argv[++i]);
+
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+                o->checkpointInterval = (int64_t)(atof(argv[++i]) * 1000);
+        } else if (!strcmp(argv[i], "-resume"))
+            o->resume = true;
+        else if (!strcmp(argv[i], "-metrics"))
+            str_cpy_c(&o->metrics, argv[++i]);
+        else if (!strcmp(argv[i], "-flush"))
+            o->flushInterval = (int64_t)(atof(argv[++i]) * 1000);
+        else if (!strcmp(argv[i], "-resign"))
             i = options_parse_adjudication(argc, argv, i + 1, &o->resignCount, &o->resignScore);
         else if (!strcmp(argv[i], "-draw"))
             i = options_parse_adjudication(argc, argv, i + 1, &o->drawCount, &o->drawScore);
         else if (!strcmp(argv[i], "-sprt"))
             i = options_parse_sprt(argc, argv, i + 1, o);
+        else if (!strcmp(argv[i], "-precision"))
+            o->precision = atof(argv[++i]);
         else if (!strcmp(argv[i], "-sample"))
-            options_parse_sample(argv[++i], o);
+            i = options_parse_sample(argc, argv, i + 1, o);
         else
             DIE("Unknown option '%s'\n", argv[i]);
     }
@@ -261,17 +381,41 @@ void options_parse(int argc, const char **argv, Options *o, EngineOptions **eo)
 
             if (each.movestogo)
                 (*eo)[i].movestogo = each.movestogo;
+
+            if (each.pipeline)
+                (*eo)[i].pipeline = each.pipeline;
         }
     }
 
     if (vec_size(*eo) < 2)
         DIE("at least 2 engines are needed\n");
 
-    if (vec_size(*eo) > 2 && o->sprt)
-        DIE("only 2 engines for SPRT\n");
+    if (o->concurrency < (o->listen.len ? 0 : 1))
+        DIE("-concurrency must be at least 1 (or 0 with -listen)\n");
+
+    if (o->reactor < 0)
+        DIE("-reactor must be at least 0 (0 = off)\n");
+
+#ifndef __linux__
+    if (o->reactor)
+        DIE("-reactor is only supported on Linux\n");
+#endif
+
+    if (o->poolSize < 2)
+        DIE("-pool must allow at least 2 engines per worker\n");
+
+    if (o->poolMax && o->poolMax < 2 * o->concurrency)
+        DIE("-pool maximum must allow at least 2 engines per worker (ie. 2 * concurrency)\n");
+
+    if (o->resume && !o->checkpoint.len)
+        DIE("-resume requires -checkpoint\n");
+
+    if (o->precision < 0)
+        DIE("-precision must be positive\n");
 }
 
 void options_destroy(Options *o)
 {
-    str_destroy_n(&o->openings, &o->pgn, &o->sample);
+    str_destroy_n(&o->openings, &o->pgn, &o->sample, &o->sampleDedupFile, &o->timingFile,
+        &o->checkpoint, &o->metrics, &o->listen, &o->secret);
 }
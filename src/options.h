@@ -19,22 +19,33 @@
 #include "str.h"
 
 typedef struct {
-    str_t openings, pgn, sample;
+    str_t openings, pgn, sample, sampleDedupFile, timingFile, checkpoint, metrics;
+    str_t listen, secret;  // [ADDR:]PORT serving jobs to remote workers, and file of the secret
     SPRTParam sprtParam;
     uint64_t srand;
+    int64_t flushInterval, checkpointInterval;  // msec
+    int64_t sampleDedup;  // drop duplicate samples, remembering up to that many positions (0 = off)
     double sampleFrequency;
+    double precision;  // retire a pair when its Elo is known within +/- precision (0 = never)
     int concurrency, games, rounds;
+    int reactor;  // threads running the games as coroutines (0 = one thread per game)
     int resignCount, resignScore;
     int drawCount, drawScore;
     int pgnVerbosity;
-    bool log, random, repeat, sprt, gauntlet, sampleResolvePv;
-    char pad[2];
+    int poolSize, poolMax;  // live engines per worker, and in total (0 = no limit)
+    int sampleShards;
+    int logMode, logSize;  // logSize in KB (ring buffer of -log async|flight=KB)
+    bool random, repeat, sprt, gauntlet, sampleResolvePv, sampleBinary, timing;
+    bool history, affinity, noSmt, sampleOrdered, resume, tbAdjudicate;
+    char pad[3];
 } Options;
 
 typedef struct {
     str_t cmd, name, *options;
     int64_t time, increment, movetime, nodes;
     int depth, movestogo;
+    bool pipeline;  // send position and go in one write, without isready (see game_play())
+    char pad[7];
 } EngineOptions;
 
 EngineOptions engine_options_init(void);
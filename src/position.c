@@ -21,26 +21,9 @@
 static const char *PieceLabel[NB_COLOR] = {"NBRQKP.", "nbrqkp."};
 static const char *FileLabel[NB_COLOR] = {"ABCDEFGH", "abcdefgh"};
 
-static uint64_t ZobristKey[NB_COLOR][NB_PIECE][NB_SQUARE];
-static uint64_t ZobristCastling[NB_SQUARE], ZobristEnPassant[NB_SQUARE + 1], ZobristTurn;
-
-static __attribute__((constructor)) void zobrist_init(void)
-{
-    uint64_t seed = 0;
-
-    for (int color = 0; color < NB_COLOR; color++)
-        for (int piece = 0; piece < NB_PIECE; piece++)
-            for (int square = 0; square < NB_SQUARE; square++)
-                ZobristKey[color][piece][square] = prng(&seed);
-
-    for (int square = 0; square < NB_COLOR; square++) {
-        ZobristCastling[square] = prng(&seed);
-        ZobristEnPassant[square] = prng(&seed);
-    }
-
-    ZobristEnPassant[NB_SQUARE] = prng(&seed);
-    ZobristTurn = prng(&seed);
-}
+// Generated at build time by tablegen.c (see make.py)
+extern const uint64_t ZobristKey[NB_COLOR][NB_PIECE][NB_SQUARE];
+extern const uint64_t ZobristCastling[NB_SQUARE], ZobristEnPassant[NB_SQUARE + 1], ZobristTurn;
 
 static uint64_t zobrist_castling(bitboard_t castleRooks)
 {
@@ -168,16 +151,39 @@ static bool pos_move_is_capture(const Position *pos, move_t m)
     return bb_test(pos->byColor[opposite(pos->turn)], move_to(m));
 }
 
+static const char *fen_tok(const char *s, str_t *token)
+// Same as str_tok(s, token, " "), but into the fixed size buffer of token (without allocating, as
+// pos_set() is called for every game). A token that does not fit is replaced by "???", which is
+// invalid in every FEN field.
+{
+    if (!s)
+        return NULL;
+
+    s += strspn(s, " ");
+    size_t n = strcspn(s, " ");
+    const char *tail = s + n;
+
+    if (n >= token->alloc) {
+        s = "???";
+        n = 3;
+    }
+
+    memcpy(token->buf, s, n);
+    token->buf[token->len = n] = '\0';
+    return n ? tail : NULL;
+}
+
 bool pos_set(Position *pos, const char *fen, bool force960, bool *sfen)
 // Set position from FEN string.
 // force960: if true, set pos.chess60=true, else auto-detect.
 // sfen: if != NULL, auto-detect S-FEN.
 {
     *pos = (Position){0};
-    scope(str_destroy) str_t token = str_init();
+    char tokenBuf[128];  // longer than any valid FEN field
+    str_t token = {.buf = tokenBuf, .alloc = sizeof(tokenBuf)};
 
     // Piece placement
-    fen = str_tok(fen, &token, " ");
+    fen = fen_tok(fen, &token);
     int rank = RANK_8, file = FILE_A;
 
     for (const char *c = token.buf; *c; c++) {
@@ -203,7 +209,7 @@ bool pos_set(Position *pos, const char *fen, bool force960, bool *sfen)
         return false;
 
     // Turn of play
-    fen = str_tok(fen, &token, " ");
+    fen = fen_tok(fen, &token);
 
     if (token.len != 1)
         return false;
@@ -221,7 +227,7 @@ bool pos_set(Position *pos, const char *fen, bool force960, bool *sfen)
     // Castling rights: optional, default '-'
     bool _sfen = false;
 
-    if ((fen = str_tok(fen, &token, " "))) {
+    if ((fen = fen_tok(fen, &token))) {
         if (token.len > 4)
             return false;
 
@@ -260,8 +266,8 @@ bool pos_set(Position *pos, const char *fen, bool force960, bool *sfen)
     }
 
     // En passant square: optional, default '-'
-    if (!(fen = str_tok(fen, &token, " ")))
-        str_cpy_c(&token, "-");
+    if (!(fen = fen_tok(fen, &token)))
+        fen_tok("-", &token);
 
     if (token.len > 2)
         return false;
@@ -270,13 +276,13 @@ bool pos_set(Position *pos, const char *fen, bool force960, bool *sfen)
     pos->key ^= ZobristEnPassant[pos->epSquare];
 
     // 50 move counter (in plies, starts at 0): optional, default 0
-    pos->rule50 = (fen = str_tok(fen, &token, " ")) ? (uint8_t)atoi(token.buf) : 0;
+    pos->rule50 = (fen = fen_tok(fen, &token)) ? (uint8_t)atoi(token.buf) : 0;
 
     if (pos->rule50 >= 100)
         return false;
 
     // Full move counter (in moves, starts at 1): optional, default 1
-    pos->fullMove = str_tok(fen, &token, " ") ? (uint16_t)atoi(token.buf) : 1;
+    pos->fullMove = fen_tok(fen, &token) ? (uint16_t)atoi(token.buf) : 1;
 
     // Verify piece counts
     for (int color = WHITE; color <= BLACK; color++)
@@ -474,6 +480,19 @@ void pos_move(Position *pos, const Position *before, move_t m)
     finish(pos);
 }
 
+void pos_pack(const Position *pos, PackedPos *pp)
+{
+    *pp = (PackedPos){.occ = pos_pieces(pos)};
+    bitboard_t occ = pp->occ;
+
+    for (int i = 0; occ; i++) {
+        const int square = bb_pop_lsb(&occ);
+        const int piece = bb_test(pos->castleRooks, square) ? NB_PIECE : pos_piece_on(pos, square);
+        const int nibble = pos_color_on(pos, square) * 8 + piece;
+        pp->pieces[i / 2] |= (uint8_t)(nibble << (4 * (i % 2)));
+    }
+}
+
 // All pieces
 bitboard_t pos_pieces(const Position *pos)
 {
@@ -536,6 +555,89 @@ bool pos_move_is_castling(const Position *pos, move_t m)
     return bb_test(pos->byColor[pos->turn], move_to(m));
 }
 
+bool pos_move_is_legal(const Position *pos, move_t m)
+// Same result as looking for m in gen_all_moves(), but using pins, checkers and attacked directly
+{
+    const int us = pos->turn, them = opposite(us);
+    const int from = move_from(m), to = move_to(m);
+    const unsigned prom = m >> 12;  // not move_prom(): m can be anything
+    const int king = pos_king_square(pos, us);
+
+    if (!bb_test(pos->byColor[us], from) || (prom > QUEEN && prom != NB_PIECE))
+        return false;
+
+    const int piece = pos_piece_on(pos, from);
+
+    // Castling, encoded as king takes own rook
+    if (bb_test(pos->byColor[us], to)) {
+        if (piece != KING || prom != NB_PIECE || pos->checkers || !bb_test(pos->castleRooks, to))
+            return false;
+
+        const int kto = square_from(rank_of(to), to > king ? FILE_G : FILE_C);
+        const int rto = square_from(rank_of(to), to > king ? FILE_F : FILE_D);
+
+        return bb_count((Segment[king][kto] | Segment[to][rto]) & pos_pieces(pos)) == 2
+            && !(pos->attacked & Segment[king][kto]) && !bb_test(pos->pins, to);
+    }
+
+    // Pawns must promote on the last rank, and only them
+    if ((prom != NB_PIECE) != (piece == PAWN && rank_of(to) == relative_rank(us, RANK_8)))
+        return false;
+
+    if (piece == KING)
+        return bb_test(KingAttacks[from] & ~pos->attacked, to);
+
+    if (bb_several(pos->checkers))
+        return false;
+
+    // En passant: test directly for discovered checks (including through the captured pawn)
+    if (piece == PAWN && to == pos->epSquare) {
+        if (!bb_test(PawnAttacks[us][from], to))
+            return false;
+
+        bitboard_t occ = pos_pieces(pos);
+        bb_clear(&occ, from);
+        bb_set(&occ, to);
+        bb_clear(&occ, to + push_inc(them));
+
+        return !(bb_rook_attacks(king, occ) & pos_pieces_cpp(pos, them, ROOK, QUEEN))
+            && !(bb_bishop_attacks(king, occ) & pos_pieces_cpp(pos, them, BISHOP, QUEEN));
+    }
+
+    bitboard_t targets;
+
+    if (piece == PAWN) {
+        const int push = push_inc(us);
+        targets = PawnAttacks[us][from] & pos->byColor[them];
+
+        if (!bb_test(pos_pieces(pos), from + push)) {
+            bb_set(&targets, from + push);
+
+            if (rank_of(from) == relative_rank(us, RANK_2)
+                    && !bb_test(pos_pieces(pos), from + 2 * push))
+                bb_set(&targets, from + 2 * push);
+        }
+    } else if (piece == KNIGHT)
+        targets = KnightAttacks[from];
+    else
+        targets = (piece != BISHOP ? bb_rook_attacks(from, pos_pieces(pos)) : 0)
+            | (piece != ROOK ? bb_bishop_attacks(from, pos_pieces(pos)) : 0);
+
+    if (!bb_test(targets, to) || (bb_test(pos->pins, from) && !bb_test(Ray[king][from], to)))
+        return false;
+
+    if (!pos->checkers)
+        return true;
+
+    // Single check: cover the checking segment (sliders), or capture the checker
+    const int checker = bb_lsb(pos->checkers);
+    const int checkerPiece = pos_piece_on(pos, checker);
+
+    return BISHOP <= checkerPiece && checkerPiece <= QUEEN
+        ? bb_test(Segment[king][checker], to)
+        : to == checker;
+}
+
 void pos_move_to_lan(const Position *pos, move_t m, str_t *lan)
 {
     const int from = move_from(m), prom = move_prom(m);
@@ -578,6 +680,34 @@ move_t pos_lan_to_move(const Position *pos, const char *lan)
     return move_build(from, to, prom);
 }
 
+const char *pos_resolve_pv(const Position *pos, const char *pv, str_t *token, Position *resolved)
+// Plays the (space separated, LAN) moves of pv from pos, and sets *resolved to the last position
+// not in check. We can't guarantee that it won't be in check, but a valid one must be returned, so
+// it starts with pos. Stops at the first illegal move, left in token, and returns the rest of pv
+// after it. Returns NULL if all moves are legal.
+{
+    *resolved = *pos;
+
+    Position p[2];
+    p[0] = *pos;
+    int idx = 0;
+
+    while ((pv = str_tok(pv, token, " "))) {
+        const move_t m = pos_lan_to_move(&p[idx], token->buf);
+
+        if (!pos_move_is_legal(&p[idx], m))
+            return pv;
+
+        pos_move(&p[(idx + 1) % 2], &p[idx], m);
+        idx = (idx + 1) % 2;
+
+        if (!p[idx].checkers)
+            *resolved = p[idx];
+    }
+
+    return NULL;
+}
+
 void pos_move_to_san(const Position *pos, move_t m, str_t *san)
 // Converts a move to Standard Algebraic Notation. Note that the '+' (check) or '#' (checkmate)
 // suffixes are not generated here.
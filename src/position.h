@@ -32,9 +32,18 @@ typedef struct {
     bool chess960;  // for move<->string conversions ("e1h1" if chess960 else "e1g1")
 } Position;
 
+// Compact encoding of the board: occupied squares, and a nibble for each of them (in LSB order of
+// 'occ', low nibble first). Nibble = color * 8 + piece, where piece = NB_PIECE means a rook with
+// castling rights.
+typedef struct {
+    bitboard_t occ;
+    uint8_t pieces[16];
+} PackedPos;
+
 bool pos_set(Position *pos, const char *fen, bool force960, bool *sfen);
 void pos_get(const Position *pos, str_t *fen, bool sfen);
 void pos_move(Position *pos, const Position *before, move_t m);
+void pos_pack(const Position *pos, PackedPos *pp);
 
 bitboard_t pos_pieces(const Position* pos);
 bitboard_t pos_pieces_cp(const Position *pos, int color, int piece);
@@ -46,8 +55,10 @@ int pos_color_on(const Position *pos, int square);
 int pos_piece_on(const Position *pos, int square);
 
 bool pos_move_is_castling(const Position *pos, move_t m);
+bool pos_move_is_legal(const Position *pos, move_t m);
 void pos_move_to_lan(const Position *pos, move_t m, str_t *lan);
 void pos_move_to_san(const Position *pos, move_t m, str_t *san);
 move_t pos_lan_to_move(const Position *pos, const char *lan);
+const char *pos_resolve_pv(const Position *pos, const char *pv, str_t *token, Position *resolved);
 
 void pos_print(const Position *pos);
@@ -0,0 +1,191 @@
+/*
+ * c-chess-cli, a command line interface for UCI chess engines. Copyright 2020 lucasart.
+ *
+ * c-chess-cli is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * c-chess-cli is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program. If
+ * not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef __linux__
+    #include <errno.h>
+    #include <limits.h>
+    #include <sys/epoll.h>
+    #include <sys/mman.h>
+    #include <ucontext.h>
+    #include <unistd.h>
+#endif
+
+#include "reactor.h"
+#include "util.h"
+#include "vec.h"
+
+#ifdef __linux__
+
+// Stack of each coroutine (only the pages it touches are backed by memory), below a guard page
+enum {STACK_SIZE = 256 * 1024};
+
+typedef struct Reactor Reactor;
+
+struct Fiber {
+    ucontext_t ctx;
+    Reactor *reactor;
+    Worker *w;
+    char *stack;  // mmap()'d
+    int64_t timeLimit;  // of the current wait
+    int fd;  // of the current wait (-1 if none)
+    bool waiting;  // in reactor_wait()
+    bool ready;  // fd became readable during the current wait
+    bool done;  // fn() returned
+    char pad[1];
+};
+
+struct Reactor {
+    ucontext_t ctx;  // event loop
+    Fiber *fibers;  // never reallocated: contexts point into it
+    void *(*fn)(void *);
+    int epfd;  // epoll instance
+    char pad[4];
+};
+
+// Coroutine started by the event loop on this thread (makecontext() only passes int arguments)
+static _Thread_local Fiber *Starting;
+
+static void fiber_main(void)
+// Entry point of a coroutine. Returning resumes the event loop (uc_link).
+{
+    Fiber *f = Starting;
+    f->reactor->fn(f->w);
+    f->done = true;
+}
+
+static void fiber_init(Reactor *r, Fiber *f, Worker *w)
+{
+    *f = (Fiber){.reactor = r, .w = w, .fd = -1};
+    w->fiber = f;
+
+    f->stack = mmap(NULL, STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    DIE_IF(0, f->stack == MAP_FAILED);
+    DIE_IF(0, mprotect(f->stack, (size_t)sysconf(_SC_PAGESIZE), PROT_NONE) < 0);
+
+    DIE_IF(0, getcontext(&f->ctx) < 0);
+    f->ctx.uc_stack.ss_sp = f->stack;
+    f->ctx.uc_stack.ss_size = STACK_SIZE;
+    f->ctx.uc_link = &r->ctx;
+    makecontext(&f->ctx, fiber_main, 0);
+}
+
+static void fiber_destroy(Fiber *f)
+{
+    f->w->fiber = NULL;
+    DIE_IF(0, munmap(f->stack, STACK_SIZE) < 0);
+}
+
+static void reactor_poll(Reactor *r, int64_t wakeAt)
+// Wait until the fd of a waiting coroutine is readable, or wakeAt, and mark the ready ones
+{
+    const int64_t timeout = wakeAt == INT64_MAX ? -1 : max(wakeAt - system_msec(), 0);
+    const int msec = (int)min(timeout, (int64_t)INT_MAX);
+
+    // Events carry the index of the coroutine, and the fd it was waiting for when armed. A stale
+    // event (the wait timed out, and the coroutine now waits for something else) is ignored.
+    struct epoll_event events[64];
+    const int n = epoll_wait(r->epfd, events, 64, msec);
+    DIE_IF(0, n < 0 && errno != EINTR);
+
+    for (int i = 0; i < n; i++) {
+        Fiber *f = &r->fibers[events[i].data.u64 >> 32];
+
+        if (f->waiting && f->fd == (int)(uint32_t)events[i].data.u64)
+            f->ready = true;
+    }
+}
+
+void reactor_run(Worker *workers, size_t n, void *(*fn)(void *))
+{
+    Reactor r = {.fibers = vec_init_reserve(n, Fiber), .fn = fn, .epfd = -1};
+
+    DIE_IF(0, (r.epfd = epoll_create1(EPOLL_CLOEXEC)) < 0);
+
+    for (size_t i = 0; i < n; i++)
+        fiber_init(&r, &r.fibers[vec_ptr(r.fibers)->size++], &workers[i]);
+
+    for (size_t live = n; live; ) {
+        // Resume the coroutines that can run: not started yet, readable, or timed out. Then wait
+        // for the earliest time limit of the others.
+        int64_t wakeAt = INT64_MAX;
+
+        for (size_t i = 0; i < n; i++) {
+            Fiber *f = &r.fibers[i];
+
+            if (f->done)
+                continue;
+
+            if (!f->waiting || f->ready || f->timeLimit <= system_msec()) {
+                Starting = f;
+                DIE_IF(0, swapcontext(&r.ctx, &f->ctx) < 0);
+
+                if (f->done) {
+                    fiber_destroy(f);
+                    live--;
+                    continue;
+                }
+            }
+
+            wakeAt = min(wakeAt, f->timeLimit);
+        }
+
+        if (live)
+            reactor_poll(&r, wakeAt);
+    }
+
+    DIE_IF(0, close(r.epfd) < 0);
+
+    vec_destroy(r.fibers);
+}
+
+bool reactor_wait(Fiber *f, int fd, int64_t timeLimit)
+{
+    f->fd = fd;
+    f->timeLimit = timeLimit;
+    f->ready = false;
+    f->waiting = true;
+
+    // One shot: the fd stays registered (until it is closed), and is rearmed for each wait
+    if (fd >= 0) {
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLONESHOT,
+            .data.u64 = (uint64_t)(f - f->reactor->fibers) << 32 | (uint32_t)fd};
+
+        if (epoll_ctl(f->reactor->epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+            DIE_IF(f->w->id, errno != ENOENT);
+            DIE_IF(f->w->id, epoll_ctl(f->reactor->epfd, EPOLL_CTL_ADD, fd, &ev) < 0);
+        }
+    }
+
+    DIE_IF(f->w->id, swapcontext(&f->ctx, &f->reactor->ctx) < 0);
+
+    f->waiting = false;
+    f->fd = -1;
+    return f->ready;
+}
+
+#else
+
+void reactor_run(Worker *workers, size_t n, void *(*fn)(void *))
+{
+    (void)workers, (void)n, (void)fn;
+    DIE("-reactor is only supported on Linux\n");
+}
+
+bool reactor_wait(Fiber *f, int fd, int64_t timeLimit)
+{
+    (void)f, (void)fd, (void)timeLimit;
+    DIE("-reactor is only supported on Linux\n");
+}
+
+#endif
@@ -0,0 +1,28 @@
+/*
+ * c-chess-cli, a command line interface for UCI chess engines. Copyright 2020 lucasart.
+ *
+ * c-chess-cli is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * c-chess-cli is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program. If
+ * not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <inttypes.h>
+#include <stdbool.h>
+#include "workers.h"
+
+// Run fn(&workers[i]) for each of the n workers, as coroutines multiplexed on the calling thread,
+// until they all return. A coroutine runs until it waits in reactor_wait(), which resumes another
+// one: game_play() becomes a state machine driven by engine output (and time outs), without being
+// rewritten as one.
+void reactor_run(Worker *workers, size_t n, void *(*fn)(void *));
+
+// Suspend the calling coroutine until fd is readable (fd < 0 to only wait for time), or timeLimit
+// is reached (INT64_MAX means forever). Returns false on time out.
+bool reactor_wait(Fiber *f, int fd, int64_t timeLimit);
@@ -0,0 +1,551 @@
+/*
+ * c-chess-cli, a command line interface for UCI chess engines. Copyright 2020 lucasart.
+ *
+ * c-chess-cli is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * c-chess-cli is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program. If
+ * not, see <http://www.gnu.org/licenses/>.
+*/
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "remote.h"
+#include "util.h"
+#include "vec.h"
+#include "workers.h"
+
+// Protocol (text lines, except the raw bytes of a result):
+//   worker -> coordinator: "hello [SECRET]", on connection (SECRET: first line of the -secret file)
+//   coordinator -> worker: "args N SRAND", followed by N lines (command line), if SECRET matches
+//   worker -> coordinator: "pop N E1 E2 ..." (up to N jobs, engines loaded) -> "jobs COUNT IDX1
+//     IDX2 ...", "wait" or "done"
+//   worker -> coordinator: "name EI NAME" (engine name, from the UCI handshake)
+//   worker -> coordinator: "result IDX OUTCOME PGNLEN SAMPLESLEN KEYS", followed by the bytes of
+//     the PGN and samples, and KEYS sample keys (uint64_t[], native byte order)
+
+// Time between two polls of the listening socket (in msec), and between two "pop" when told to wait
+static const int ListenInterval = 100;
+static const int64_t WaitInterval = 1000;
+
+// Limits on what a worker can make the coordinator allocate: line length (buffer size), PGN and
+// samples of one game, and jobs per "pop"
+static const size_t MaxLine = 1 << 20, MaxPayload = 64 << 20, MaxBatch = 256;
+
+// Connection to a remote worker, served by its own thread
+typedef struct {
+    pthread_t thread;
+    int fd;
+    char pad[4];
+} Connection;
+
+static struct {
+    Connection *connections;  // only accessed by the listener thread
+    JobQueue *jq;
+    RemoteHooks hooks;
+    str_t msg;  // "args N SRAND" message, sent to each worker on connection
+    str_t secret;  // expected in "hello" (empty: any)
+    pthread_t thread;
+    _Atomic size_t outstanding;  // jobs popped by remote workers, and not yet completed
+    int fd;
+    char pad[4];
+} Coordinator;
+
+static void secret_load(const char *option, const char *fileName, str_t *secret)
+// First line of fileName, or "" if fileName is empty
+{
+    str_clear(secret);
+
+    if (!*fileName)
+        return;
+
+    FILE *in = fopen(fileName, "r");
+    DIE_IF(0, !in);
+    char buf[256] = "";
+
+    if (!fgets(buf, sizeof(buf), in) || !(buf[strcspn(buf, "\r\n")] = '\0', *buf))
+        DIE("%s: no secret in '%s'\n", option, fileName);
+
+    DIE_IF(0, fclose(in) < 0);
+    str_cpy_c(secret, buf);
+}
+
+static bool secret_eq(str_t s1, const char *s2)
+// Compare in constant time (for a given length), not to leak a prefix of the secret
+{
+    const size_t len = strlen(s2);
+    unsigned char diff = s1.len != len;
+
+    for (size_t i = 0; i < len && i < s1.len; i++)
+        diff |= (unsigned char)(s1.buf[i] ^ s2[i]);
+
+    return !diff;
+}
+
+static void socket_options(int fd)
+// Detect dead peers (eg. a machine crash) within minutes, rather than the default 2 hours
+{
+    const int on = 1;
+    DIE_IF(0, setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) < 0);
+    DIE_IF(0, setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0);
+
+#ifdef SO_NOSIGPIPE
+    DIE_IF(0, setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on)) < 0);
+#endif
+
+#if defined(TCP_KEEPIDLE)
+    const int idle = 60;
+    DIE_IF(0, setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) < 0);
+#elif defined(TCP_KEEPALIVE)
+    const int idle = 60;
+    DIE_IF(0, setsockopt(fd, IPPROTO_TCP, TCP_KEEPALIVE, &idle, sizeof(idle)) < 0);
+#endif
+
+#if defined(TCP_KEEPINTVL) && defined(TCP_KEEPCNT)
+    const int interval = 10, count = 6;
+    DIE_IF(0, setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) < 0);
+    DIE_IF(0, setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count)) < 0);
+#endif
+}
+
+static bool parse_sizes(const char *s, size_t *values, size_t n)
+// Parse exactly n unsigned integers, each preceded by an optional space
+{
+    for (size_t i = 0; i < n; i++) {
+        s += *s == ' ';
+
+        if (*s < '0' || *s > '9')
+            return false;
+
+        char *end = NULL;
+        values[i] = (size_t)strtoull(s, &end, 10);
+        s = end;
+    }
+
+    return !*s;
+}
+
+static void *connection_thread(void *arg)
+{
+    const int fd = (int)(intptr_t)arg;
+    JobQueue *jq = Coordinator.jq;
+
+    // Any read error means the worker is lost (eg. its machine crashed: reset, or timed out)
+    LineReader in = line_reader_init_socket(fd, MaxLine);
+    size_t *popped = vec_init(size_t);  // jobs popped by this worker, and not yet completed
+    int *loaded = vec_init(int);
+    char *pgn = vec_init(char), *samples = vec_init(char);
+    uint64_t *keys = vec_init(uint64_t);
+    scope(str_destroy) str_t reply = str_init(), token = str_init();
+    str_t line;  // view into in.buf
+
+    // Authenticate, before sending anything
+    const char *hello = line_reader_getline(&in, &line) ? str_prefix(line.buf, "hello") : NULL;
+    bool ok = hello && (!*hello || *hello == ' ')
+        && (!Coordinator.secret.len || secret_eq(Coordinator.secret, hello + (*hello == ' ')));
+
+    if (!ok)
+        printf("Remote worker rejected: wrong secret\n");
+    else
+        ok = socket_send(fd, Coordinator.msg.buf, Coordinator.msg.len);
+
+    while (ok && line_reader_getline(&in, &line)) {
+        const char *tail = str_tok(line.buf, &token, " ");
+
+        if (!tail)
+            continue;
+
+        if (!strcmp(token.buf, "pop")) {
+            size_t batch = 0;
+
+            if (!(tail = str_tok(tail, &token, " ")) || !parse_sizes(token.buf, &batch, 1)
+                    || !batch)
+                break;
+
+            vec_clear(loaded);
+
+            while ((tail = str_tok(tail, &token, " ")))
+                vec_push(loaded, atoi(token.buf));
+
+            // Count each job as outstanding before popping it, so the listener never sees an empty
+            // queue with no outstanding jobs, while a job is in transit
+            Job job;
+            size_t idx = 0, count = 0, n = 0;
+            str_cpy_c(&reply, "jobs");
+
+            for (Coordinator.outstanding++; n < min(batch, MaxBatch)
+                    && job_queue_pop(jq, loaded, vec_size(loaded), &job, &idx, &count);
+                    n++, Coordinator.outstanding++) {
+                vec_push(popped, idx);
+
+                if (!n)
+                    str_cat_fmt(&reply, " %U", (uintmax_t)count);
+
+                str_cat_fmt(&reply, " %U", (uintmax_t)idx);
+            }
+
+            Coordinator.outstanding--;
+
+            if (n)
+                str_push(&reply, '\n');
+            else
+                // Jobs left are too far ahead (see job_queue_pop()), or other workers' jobs can
+                // still be re-issued (if they are lost): wait for them
+                str_cpy_c(&reply, !job_queue_done(jq) || Coordinator.outstanding ? "wait\n"
+                    : "done\n");
+
+            ok = socket_send(fd, reply.buf, reply.len);
+        } else if (!strcmp(token.buf, "name")) {
+            size_t ei = 0;
+
+            if (!(tail = str_tok(tail, &token, " ")) || !parse_sizes(token.buf, &ei, 1)
+                    || ei >= vec_size(jq->names) || !*tail)
+                break;
+
+            job_queue_set_name(jq, (int)ei, tail + 1);
+        } else if (!strcmp(token.buf, "result")) {
+            // idx, outcome, pgnLen, samplesLen, keyCount
+            size_t v[5];
+            size_t *slot = NULL;
+
+            if (!parse_sizes(tail, v, 5) || v[1] >= NB_RESULT || v[2] > MaxPayload
+                    || v[3] > MaxPayload || v[4] > MaxPayload / sizeof(uint64_t))
+                break;
+
+            for (size_t i = 0; i < vec_size(popped); i++)
+                if (popped[i] == v[0])
+                    slot = &popped[i];
+
+            if (!slot)
+                break;
+
+            // Binary payloads follow. Note that reading them invalidates 'line'.
+            pgn = vec_do_grow(pgn, 1, v[2] + 1);
+            samples = vec_do_grow(samples, 1, v[3] + 1);
+            keys = vec_do_grow(keys, sizeof(uint64_t), v[4] + 1);
+
+            if (!line_reader_read(&in, pgn, v[2]) || !line_reader_read(&in, samples, v[3])
+                    || !line_reader_read(&in, keys, v[4] * sizeof(uint64_t)))
+                break;
+
+            // Only decrement outstanding once the result is recorded, so the listener does not
+            // stop before that
+            *slot = popped[vec_size(popped) - 1];
+            vec_pop(popped);
+            Coordinator.hooks.done(v[0], (int)v[1], pgn, v[2], samples, v[3], keys, v[4]);
+            Coordinator.outstanding--;
+        } else
+            break;
+    }
+
+    // Lost worker (or finished, with no jobs left): re-issue its outstanding jobs
+    if (vec_size(popped))
+        printf("Remote worker lost: %zu games re-issued\n", vec_size(popped));
+
+    for (size_t i = 0; i < vec_size(popped); i++) {
+        if (!job_queue_reissue(jq, popped[i]))
+            Coordinator.hooks.skipped(popped[i]);
+
+        Coordinator.outstanding--;
+    }
+
+    // Tell the worker, if it's still there (rejected, or protocol error). The listener closes fd.
+    shutdown(fd, SHUT_RDWR);
+
+    vec_destroy(keys);
+    vec_destroy(samples);
+    vec_destroy(pgn);
+    vec_destroy(loaded);
+    vec_destroy(popped);
+    line_reader_destroy(&in);
+    return NULL;
+}
+
+static void *listen_thread(void *arg)
+{
+    (void)arg;
+    Coordinator.connections = vec_init(Connection);
+
+    // Until all jobs are completed (or skipped)
+    while (!job_queue_done(Coordinator.jq) || Coordinator.outstanding) {
+        struct pollfd pfd = {.fd = Coordinator.fd, .events = POLLIN};
+
+        if (poll(&pfd, 1, ListenInterval) <= 0)
+            continue;
+
+        Connection c = {.fd = accept(Coordinator.fd, NULL, NULL)};
+
+        if (c.fd < 0)
+            continue;
+
+        socket_options(c.fd);
+        pthread_create(&c.thread, NULL, connection_thread, (void *)(intptr_t)c.fd);
+        vec_push(Coordinator.connections, c);
+    }
+
+    // Remaining workers have nothing left to do: closing the connection tells them so. Join
+    // connection threads before returning, as they use the job queue.
+    for (size_t i = 0; i < vec_size(Coordinator.connections); i++)
+        shutdown(Coordinator.connections[i].fd, SHUT_RDWR);
+
+    for (size_t i = 0; i < vec_size(Coordinator.connections); i++) {
+        pthread_join(Coordinator.connections[i].thread, NULL);
+        close(Coordinator.connections[i].fd);
+    }
+
+    vec_destroy(Coordinator.connections);
+    close(Coordinator.fd);
+    str_destroy_n(&Coordinator.msg, &Coordinator.secret);
+    workers_busy_add(-1);
+    return NULL;
+}
+
+static struct addrinfo *resolve(const char *option, const char *address, bool passive)
+// Resolve "HOST:PORT", or "[HOST:]PORT" if passive (all interfaces by default). IPv6 addresses can
+// be written in brackets, eg. "[::1]:5000".
+{
+    const char *colon = strrchr(address, ':');
+    scope(str_destroy) str_t host = str_init();
+
+    if (colon) {
+        const size_t len = (size_t)(colon - address);
+        const bool brackets = len >= 2 && address[0] == '[' && address[len - 1] == ']';
+        str_ncpy(&host, str_ref(address + brackets), len - 2 * brackets);
+    } else if (!passive)
+        DIE("%s: expected HOST:PORT, got '%s'\n", option, address);
+
+    struct addrinfo *list = NULL;
+    const struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM,
+        .ai_flags = passive ? AI_PASSIVE : 0};
+    const int error = getaddrinfo(host.len ? host.buf : NULL, colon ? colon + 1 : address, &hints,
+        &list);
+
+    if (error)
+        DIE("%s: %s: %s\n", option, address, gai_strerror(error));
+
+    return list;
+}
+
+void remote_listen(const char *address, const char *secretFile, const char **args, size_t n,
+    uint64_t srand, JobQueue *jq, RemoteHooks hooks)
+{
+    Coordinator.jq = jq;
+    Coordinator.hooks = hooks;
+    Coordinator.msg = str_init();
+    Coordinator.secret = str_init();
+    secret_load("-listen", secretFile, &Coordinator.secret);
+    str_cpy_fmt(&Coordinator.msg, "args %U %U\n", (uintmax_t)n, (uintmax_t)srand);
+
+    for (size_t i = 0; i < n; i++) {
+        if (strchr(args[i], '\n'))
+            DIE("-listen: arguments cannot contain line breaks\n");
+
+        str_cat_fmt(&Coordinator.msg, "%s\n", args[i]);
+    }
+
+    const int on = 1;
+    struct addrinfo *list = resolve("-listen", address, true);
+    Coordinator.fd = -1;
+
+    for (const struct addrinfo *ai = list; ai && Coordinator.fd < 0; ai = ai->ai_next)
+        if ((Coordinator.fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) >= 0
+                && (setsockopt(Coordinator.fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0
+                || bind(Coordinator.fd, ai->ai_addr, ai->ai_addrlen) < 0
+                || listen(Coordinator.fd, 64) < 0)) {
+            close(Coordinator.fd);
+            Coordinator.fd = -1;
+        }
+
+    freeaddrinfo(list);
+
+    if (Coordinator.fd < 0)
+        DIE("-listen: cannot listen on %s: %s\n", address, strerror(errno));
+
+    workers_busy_add(1);
+    pthread_create(&Coordinator.thread, NULL, listen_thread, NULL);
+    pthread_detach(Coordinator.thread);
+}
+
+Remote *remote_connect(const char *address, const char *secretFile, str_t **args, uint64_t *srand)
+{
+    struct addrinfo *list = resolve("-connect", address, false);
+    int fd = -1;
+
+    for (const struct addrinfo *ai = list; ai && fd < 0; ai = ai->ai_next)
+        if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) >= 0
+                && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+
+    freeaddrinfo(list);
+
+    if (fd < 0)
+        DIE("-connect: cannot connect to %s: %s\n", address, strerror(errno));
+
+    socket_options(fd);
+
+    Remote *r = calloc(1, sizeof(Remote));
+    pthread_mutex_init(&r->mtx, NULL);
+    r->fd = fd;
+    r->in = line_reader_init_socket(fd, MaxLine);
+    r->jobs = vec_init(size_t);
+    r->batch = 1;
+
+    // Authenticate, and receive the coordinator's command line
+    scope(str_destroy) str_t secret = str_init(), msg = str_init();
+    secret_load("-connect", secretFile, &secret);
+    str_cpy_fmt(&msg, secret.len ? "hello %S\n" : "hello\n", secret);
+    str_t line;
+    size_t v[2];
+
+    if (!socket_send(fd, msg.buf, msg.len) || !line_reader_getline(&r->in, &line))
+        DIE("-connect: %s: connection closed by the coordinator (wrong -secret?)\n", address);
+
+    if (!str_prefix(line.buf, "args ") || !parse_sizes(line.buf + 5, v, 2))
+        DIE("-connect: %s: unexpected reply from the coordinator\n", address);
+
+    *srand = v[1];
+
+    *args = vec_init(str_t);
+
+    for (size_t i = 0; i < v[0]; i++) {
+        if (!line_reader_getline(&r->in, &line))
+            DIE("-connect: %s: connection lost\n", address);
+
+        vec_push(*args, str_init_from(line));
+    }
+
+    return r;
+}
+
+void remote_destroy(Remote *r)
+{
+    vec_destroy(r->jobs);
+    line_reader_destroy(&r->in);
+    close(r->fd);
+    pthread_mutex_destroy(&r->mtx);
+    free(r);
+}
+
+static bool remote_pop_batch(Remote *r, const int *loaded, size_t n, size_t count, bool *wait)
+// Ask the coordinator for up to r->batch jobs, appended to r->jobs (under the lock), out of count
+// (our own job queue, that must be the coordinator's). Returns false when the coordinator is done,
+// or closed the connection.
+{
+    scope(str_destroy) str_t msg = str_init();
+    str_cpy_fmt(&msg, "pop %i", r->batch);
+
+    for (size_t i = 0; i < n; i++)
+        str_cat_fmt(&msg, " %i", loaded[i]);
+
+    str_push(&msg, '\n');
+    str_t line;  // view into r->in.buf
+
+    if (!socket_send(r->fd, msg.buf, msg.len) || !line_reader_getline(&r->in, &line))
+        return false;
+
+    const char *tail = str_prefix(line.buf, "jobs ");
+    scope(str_destroy) str_t token = str_init();
+    size_t value = 0;
+
+    if (tail) {
+        // Total number of jobs, then their indexes
+        for (int i = 0; (tail = str_tok(tail, &token, " ")); i++) {
+            if (!parse_sizes(token.buf, &value, 1) || (i ? value >= count : value != count))
+                break;
+
+            if (i)
+                vec_push(r->jobs, value);
+        }
+
+        if (!tail && vec_size(r->jobs))
+            return true;
+    } else if (!strcmp(line.buf, "wait"))
+        return (*wait = true);
+    else if (!strcmp(line.buf, "done"))
+        return false;
+
+    DIE("unexpected reply from the coordinator: '%s'\n", line.buf);
+}
+
+bool remote_pop(Remote *r, const Worker *w, const Job *jobs, const int *loaded, size_t n,
+    size_t *idx, size_t *count)
+{
+    while (true) {
+        pthread_mutex_lock(&r->mtx);
+        bool wait = false, ok = vec_size(r->jobs)
+            || remote_pop_batch(r, loaded, n, vec_size(jobs), &wait);
+
+        // Among the jobs popped, take the one sharing the most engines with those loaded
+        if (ok && !wait) {
+            size_t best = 0;
+            int bestShared = -1;
+
+            for (size_t i = 0; i < vec_size(r->jobs); i++) {
+                const int *ei = jobs[r->jobs[i]].ei;
+                int shared = 0;
+
+                for (size_t j = 0; j < n; j++)
+                    shared += loaded[j] == ei[0] || loaded[j] == ei[1];
+
+                if (shared > bestShared) {
+                    best = i;
+                    bestShared = shared;
+                }
+            }
+
+            *idx = r->jobs[best];
+            *count = vec_size(jobs);
+            r->jobs[best] = vec_pop(r->jobs);
+        }
+
+        pthread_mutex_unlock(&r->mtx);
+
+        if (!wait)
+            return ok;
+
+        worker_sleep(w, WaitInterval);
+    }
+}
+
+void remote_set_name(Remote *r, int ei, const char *name)
+{
+    scope(str_destroy) str_t msg = str_init();
+    str_cpy_fmt(&msg, "name %i %s\n", ei, name);
+
+    pthread_mutex_lock(&r->mtx);
+    const bool ok = socket_send(r->fd, msg.buf, msg.len);
+    pthread_mutex_unlock(&r->mtx);
+
+    if (!ok)
+        DIE("connection to the coordinator lost\n");
+}
+
+void remote_push_result(Remote *r, size_t idx, int outcome, const char *pgn, size_t pgnLen,
+    const char *samples, size_t samplesLen, const uint64_t *keys, size_t keyCount)
+{
+    scope(str_destroy) str_t msg = str_init();
+    str_cpy_fmt(&msg, "result %U %i %U %U %U\n", (uintmax_t)idx, outcome, (uintmax_t)pgnLen,
+        (uintmax_t)samplesLen, (uintmax_t)keyCount);
+
+    pthread_mutex_lock(&r->mtx);
+    const bool ok = socket_send(r->fd, msg.buf, msg.len) && socket_send(r->fd, pgn, pgnLen)
+        && socket_send(r->fd, samples, samplesLen)
+        && socket_send(r->fd, keys, keyCount * sizeof(*keys));
+    pthread_mutex_unlock(&r->mtx);
+
+    if (!ok)
+        DIE("connection to the coordinator lost\n");
+}
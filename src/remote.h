@@ -0,0 +1,62 @@
+/*
+ * c-chess-cli, a command line interface for UCI chess engines. Copyright 2020 lucasart.
+ *
+ * c-chess-cli is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * c-chess-cli is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program. If
+ * not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <pthread.h>
+#include "jobs.h"
+#include "str.h"
+#include "workers.h"
+
+// Coordinator side, called from connection threads: game idx was completed by a remote worker, or
+// will never be played (re-issued after a worker was lost, but its pair was retired meanwhile).
+// With -sample dedup=N, keys[i] is the position key of the i-th sample (otherwise keyCount is 0).
+typedef struct {
+    void (*done)(size_t idx, int outcome, const char *pgn, size_t pgnLen, const char *samples,
+        size_t samplesLen, const uint64_t *keys, size_t keyCount);
+    void (*skipped)(size_t idx);
+} RemoteHooks;
+
+// Coordinator: serve the jobs of jq to remote workers on address "[HOST:]PORT" (all interfaces if
+// HOST is omitted), in a background thread. If secretFile is not empty, workers must send the
+// secret it contains (first line) to be served. Workers receive args[] (the coordinator's command
+// line), and run it with their own options appended, and srand (so random openings are shuffled
+// the same way). Counts as one busy worker (see workers_busy_add()), until all jobs are completed
+// or skipped.
+void remote_listen(const char *address, const char *secretFile, const char **args, size_t n,
+    uint64_t srand, JobQueue *jq, RemoteHooks hooks);
+
+// Remote worker: connection to the coordinator, shared by all worker threads
+typedef struct {
+    pthread_mutex_t mtx;
+    LineReader in;
+    size_t *jobs;  // popped from the coordinator, and not yet taken by a worker thread
+    int fd;
+    int batch;  // jobs asked for per "pop" (1 by default)
+} Remote;
+
+// Connect to "host:port" (sending the secret of secretFile, if not empty), and receive the
+// coordinator's command line (vector of str_t) and srand
+Remote *remote_connect(const char *address, const char *secretFile, str_t **args, uint64_t *srand);
+void remote_destroy(Remote *r);
+
+// Same as job_queue_pop(), but from jobs popped from the coordinator, up to r->batch at a time (so
+// there's one round trip per batch), of jobs[] (our copy of its job queue). Waits while jobs are
+// still outstanding on other workers (they may be re-issued), and returns false once all jobs are
+// done.
+bool remote_pop(Remote *r, const Worker *w, const Job *jobs, const int *loaded, size_t n,
+    size_t *idx, size_t *count);
+
+void remote_set_name(Remote *r, int ei, const char *name);
+void remote_push_result(Remote *r, size_t idx, int outcome, const char *pgn, size_t pgnLen,
+    const char *samples, size_t samplesLen, const uint64_t *keys, size_t keyCount);
@@ -12,79 +12,252 @@
  * You should have received a copy of the GNU General Public License along with this program. If
  * not, see <http://www.gnu.org/licenses/>.
 */
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 #include "seqwriter.h"
+#include "str.h"
+#include "util.h"
 #include "vec.h"
 
-static SeqStr seq_str_init(size_t idx, str_t str)
+static void heap_push(SeqNode ***heap, SeqNode *node)
 {
-    return (SeqStr){
-        .idx = idx,
-        .str = str_init_from(str)
-    };
+    size_t i = vec_size(*heap);
+    vec_push(*heap, node);
+
+    // Sift up
+    for (SeqNode **h = *heap; i && h[(i - 1) / 2]->idx > h[i]->idx; i = (i - 1) / 2)
+        swap(h[i], h[(i - 1) / 2]);
 }
 
-static void seq_str_destroy(SeqStr *ss)
+static SeqNode *heap_pop(SeqNode **heap)
 {
-    str_destroy(&ss->str);
+    SeqNode *top = heap[0];
+    heap[0] = vec_pop(heap);
+    const size_t n = vec_size(heap);
+
+    // Sift down
+    for (size_t i = 0; ; ) {
+        size_t smallest = i;
+
+        for (size_t child = 2 * i + 1; child <= 2 * i + 2 && child < n; child++)
+            if (heap[child]->idx < heap[smallest]->idx)
+                smallest = child;
+
+        if (smallest == i)
+            break;
+
+        swap(heap[i], heap[smallest]);
+        i = smallest;
+    }
+
+    return top;
 }
 
-SeqWriter seq_writer_init(const char *fileName, const char *mode)
+static void *seq_writer_thread(void *arg)
 {
-    SeqWriter sw = {0};
-    sw.out = fopen(fileName, mode);
-    sw.buf = vec_init(SeqStr);
-    pthread_mutex_init(&sw.mtx, NULL);
-    return sw;
+    SeqWriter *sw = arg;
+    bool stop = false;
+
+    do {
+        // Sleep for flushInterval, unless woken up by seq_writer_destroy()
+        pthread_mutex_lock(&sw->mtx);
+
+        if (!sw->stop) {
+            struct timespec ts = {0};
+            clock_gettime(CLOCK_REALTIME, &ts);
+            const int64_t nsec = ts.tv_nsec + sw->flushInterval * 1000000;
+            ts.tv_sec += nsec / 1000000000;
+            ts.tv_nsec = nsec % 1000000000;
+            pthread_cond_timedwait(&sw->cond, &sw->mtx, &ts);
+        }
+
+        stop = sw->stop;
+        pthread_mutex_unlock(&sw->mtx);
+
+        // Take the whole queue at once, and move it into the heap
+        for (SeqNode *node = atomic_exchange(&sw->queue, NULL), *next; node; node = next) {
+            next = node->next;
+            heap_push(&sw->heap, node);
+        }
+
+        // Write the longest sequential chunk. When stopping, write everything that is left (there
+        // can be gaps if the job queue was stopped early). Chunks before idxNext were already
+        // written, before a resume: discard them.
+        bool written = false;
+        int error = 0;  // errno of the first failed write (reported once the lock is released)
+        pthread_mutex_lock(&sw->mtx);
+
+        while (vec_size(sw->heap) && (sw->heap[0]->idx <= sw->idxNext || stop)) {
+            SeqNode *node = heap_pop(sw->heap);
+
+            if (node->idx >= sw->idxNext) {
+                if (fwrite(node->buf, 1, node->len, sw->out) != node->len && !error)
+                    error = errno;
+
+                written = true;
+
+                // File offset after each idx (gaps included, when stopping)
+                if (sw->offsets) {
+                    const int64_t end = sw->offsets[vec_size(sw->offsets) - 1] + (int64_t)node->len;
+
+                    while (sw->idxFirst + vec_size(sw->offsets) <= node->idx + 1)
+                        vec_push(sw->offsets, end);
+                }
+
+                sw->idxNext = node->idx + 1;
+            }
+
+            free(node);
+            sw->pending--;
+        }
+
+        if (written && fflush(sw->out) < 0 && !error)
+            error = errno;
+
+        pthread_mutex_unlock(&sw->mtx);
+
+        // Full disk, or failed compressor: do not lose games silently
+        if (error) {
+            errno = error;
+            DIE_IF(0, true);
+        }
+    } while (!stop);
+
+    return NULL;
 }
 
-void seq_writer_destroy(SeqWriter *sw)
+const char *seq_writer_compressor(const char *fileName)
 {
-    pthread_mutex_destroy(&sw->mtx);
-    vec_destroy_rec(sw->buf, seq_str_destroy);
-    fclose(sw->out);
+    const char *ext = strrchr(fileName, '.');
+
+    return !ext ? NULL
+        : !strcmp(ext, ".gz") ? "gzip -c"
+        : !strcmp(ext, ".zst") ? "zstd -q -c"
+        : NULL;
+}
+
+void seq_writer_init(SeqWriter *sw, const char *fileName, const char *mode, int64_t flushInterval,
+    const void *header, size_t headerLen)
+// Initialized in place, because the writer thread keeps a pointer to sw. File names ending with
+// '.gz' or '.zst' are compressed on the fly, by piping into gzip or zstd (compressed streams can be
+// concatenated, so appending works too). header[0..headerLen-1] is written first, if the file is
+// new (or empty).
+{
+    *sw = (SeqWriter){.flushInterval = flushInterval};
+    struct stat st = {0};
+    const bool isNew = *mode == 'w' || stat(fileName, &st) < 0 || !st.st_size;
+    const char *compressor = seq_writer_compressor(fileName);
+
+    if (compressor) {
+        // Quote fileName for the shell: 'foo'\''bar' for foo'bar
+        scope(str_destroy) str_t cmd = str_init();
+        str_cpy_fmt(&cmd, "%s %s '", compressor, *mode == 'a' ? ">>" : ">");
+
+        for (const char *c = fileName; *c; c++)
+            if (*c == '\'')
+                str_cat_c(&cmd, "'\\''");
+            else
+                str_push(&cmd, *c);
+
+        str_push(&cmd, '\'');
+        DIE_IF(0, !(sw->out = popen(cmd.buf, "w")));
+
+        // Engines spawned later must not inherit the pipe, or the compressor never sees EOF (popen()
+        // does not accept "e" on all systems)
+        DIE_IF(0, fcntl(fileno(sw->out), F_SETFD, FD_CLOEXEC) < 0);
+        sw->compressed = true;
+    } else
+        DIE_IF(0, !(sw->out = fopen(fileName, mode)));
+
+    // Large buffer: flushed explicitly after each batch
+    setvbuf(sw->out, NULL, _IOFBF, 1 << 20);
+
+    if (isNew && headerLen)
+        DIE_IF(0, fwrite(header, 1, headerLen, sw->out) != headerLen);
+
+    sw->heap = vec_init(SeqNode *);
+    atomic_init(&sw->queue, NULL);
+    atomic_init(&sw->pending, 0);
+    pthread_mutex_init(&sw->mtx, NULL);
+    pthread_cond_init(&sw->cond, NULL);
+    pthread_create(&sw->thread, NULL, seq_writer_thread, sw);
 }
 
-void seq_writer_push(SeqWriter *sw, size_t idx, str_t str)
+void seq_writer_destroy(SeqWriter *sw)
 {
     pthread_mutex_lock(&sw->mtx);
+    sw->stop = true;
+    pthread_cond_signal(&sw->cond);
+    pthread_mutex_unlock(&sw->mtx);
 
-    // Append to sw->buf[n]
-    const size_t n = vec_size(sw->buf);
-    vec_push(sw->buf, seq_str_init(idx, str));
+    // Unless the writer thread itself is exiting (write error)
+    if (!pthread_equal(pthread_self(), sw->thread))
+        pthread_join(sw->thread, NULL);
 
-    // insert in correct position
-    for (size_t i = 0; i < n; i++)
-        if (sw->buf[i].idx > idx) {
-            SeqStr tmp = sw->buf[n];
-            memmove(&sw->buf[i + 1], &sw->buf[i], (n - i) * sizeof(SeqStr));
-            sw->buf[i] = tmp;
-            break;
-        }
+    pthread_cond_destroy(&sw->cond);
+    pthread_mutex_destroy(&sw->mtx);
+    vec_destroy(sw->heap);
+    vec_destroy(sw->offsets);
 
-    // Calculate i such that buf[0..i-1] is the longest sequential chunk
-    size_t i = 0;
-    for (; i < vec_size(sw->buf); i++)
-        if (sw->buf[i].idx != sw->idxNext + i) {
-            assert(sw->buf[i].idx > sw->idxNext + i);
-            break;
-        }
+    if (sw->compressed) {
+        const int status = pclose(sw->out);
+        DIE_IF(0, status < 0);
 
-    if (i) {
-        // Write buf[0..i-1] to file, and destroy elements
-        for (size_t j = 0; j < i; j++) {
-            fputs(sw->buf[j].str.buf, sw->out);
-            seq_str_destroy(&sw->buf[j]);
-        }
-        fflush(sw->out);
+        if (!WIFEXITED(status) || WEXITSTATUS(status))
+            DIE("[0] compressor failed (status %d)\n", status);
+    } else
+        DIE_IF(0, fclose(sw->out) < 0);
+}
 
-        // Delete buf[0..i-1]
-        memmove(&sw->buf[0], &sw->buf[i], (vec_size(sw->buf) - i) * sizeof(SeqStr));
-        vec_ptr(sw->buf)->size -= i;
+void seq_writer_push(SeqWriter *sw, size_t idx, const void *buf, size_t len)
+// Lock-free: push a copy of buf[0..len-1] onto sw->queue (CAS loop)
+{
+    SeqNode *node = malloc(sizeof(SeqNode) + len);
+    node->idx = idx;
+    node->len = len;
+    memcpy(node->buf, buf, len);
+    sw->pending++;
+    node->next = atomic_load_explicit(&sw->queue, memory_order_relaxed);
+
+    while (!atomic_compare_exchange_weak_explicit(&sw->queue, &node->next, node,
+        memory_order_release, memory_order_relaxed));
+}
+
+void seq_writer_track(SeqWriter *sw, size_t idx)
+{
+    pthread_mutex_lock(&sw->mtx);
+    sw->idxFirst = sw->idxNext = idx;
 
-        // Updated next expected index
-        sw->idxNext += i;
+    // offsets[i] is the file offset before chunk idxFirst + i (appending: start at the end)
+    if (!sw->compressed) {
+        DIE_IF(0, fseeko(sw->out, 0, SEEK_END) < 0);
+        sw->offsets = vec_init(int64_t);
+        vec_push(sw->offsets, (int64_t)ftello(sw->out));
     }
 
     pthread_mutex_unlock(&sw->mtx);
 }
+
+size_t seq_writer_written(SeqWriter *sw)
+{
+    pthread_mutex_lock(&sw->mtx);
+    const size_t idx = sw->idxNext;
+    pthread_mutex_unlock(&sw->mtx);
+    return idx;
+}
+
+int64_t seq_writer_sync(SeqWriter *sw, size_t idx)
+{
+    pthread_mutex_lock(&sw->mtx);
+    assert(idx >= sw->idxFirst && idx <= sw->idxNext);
+    const int64_t offset = sw->offsets ? sw->offsets[idx - sw->idxFirst] : -1;
+    DIE_IF(0, fsync(fileno(sw->out)) < 0 && errno != EINVAL);
+    pthread_mutex_unlock(&sw->mtx);
+    return offset;
+}
@@ -13,23 +13,54 @@
  * not, see <http://www.gnu.org/licenses/>.
 */
 #pragma once
+#include <inttypes.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
-#include "str.h"
 
-typedef struct {
-    size_t idx;
-    str_t str;
-} SeqStr;
+// Element of the queue: a chunk of data to write, at position idx in the sequence
+typedef struct SeqNode {
+    struct SeqNode *next;
+    size_t idx, len;
+    char buf[];
+} SeqNode;
 
+// Writes chunks of data in sequence (idx = 0, 1, 2, ...), while they are pushed in any order, by
+// any number of threads. Pushing is lock-free: the writer thread takes the whole queue at once,
+// reorders it with a min-heap (on idx), and writes in batches (every flushInterval msec).
 typedef struct {
-    pthread_mutex_t mtx;
-    SeqStr *buf;
+    pthread_t thread;
+    pthread_mutex_t mtx;  // protects stop, idxNext and offsets (and used with cond)
+    pthread_cond_t cond;
+    _Atomic(SeqNode *) queue;  // pushed by workers, in reverse order
+    _Atomic size_t pending;  // number of chunks pushed, and not yet written
+    SeqNode **heap;  // min-heap on idx (writer thread only)
     FILE *out;
-    size_t idxNext;
+    int64_t *offsets;  // see seq_writer_track() (NULL if not tracked)
+    size_t idxFirst, idxNext;  // first idx tracked, and next idx to write
+    int64_t flushInterval;
+    bool compressed;  // out is a pipe to a compressor (see seq_writer_init())
+    bool stop;
+    char pad[6];
 } SeqWriter;
 
-SeqWriter seq_writer_init(const char *fileName, const char *mode);
+// Command compressing fileName (by extension: '.gz' or '.zst'), or NULL if it is not compressed
+const char *seq_writer_compressor(const char *fileName);
+
+void seq_writer_init(SeqWriter *sw, const char *fileName, const char *mode, int64_t flushInterval,
+    const void *header, size_t headerLen);
 void seq_writer_destroy(SeqWriter *sw);
 
-void seq_writer_push(SeqWriter *sw, size_t idx, str_t str);
+void seq_writer_push(SeqWriter *sw, size_t idx, const void *buf, size_t len);
+
+// For checkpoints: start the sequence at idx (discarding chunks pushed before that), and track the
+// file offset of each chunk. Must be called before pushing anything.
+void seq_writer_track(SeqWriter *sw, size_t idx);
+
+// Number of chunks written so far (idxNext)
+size_t seq_writer_written(SeqWriter *sw);
+
+// Make what is written durable (fsync), and return the file size before chunk idx was written (-1
+// if unknown, when compressing). idx must be tracked and written (or idxNext).
+int64_t seq_writer_sync(SeqWriter *sw, size_t idx);
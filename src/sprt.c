@@ -13,6 +13,7 @@
  * not, see <http://www.gnu.org/licenses/>.
 */
 #include <math.h>
+#include <stdio.h>
 #include "sprt.h"
 
 static double elo_to_score(double elo)
@@ -20,18 +21,62 @@ static double elo_to_score(double elo)
     return 1 / (1 + exp(-elo * log(10) / 400));
 }
 
-// Uses asymptotic LLR approximation in the trinomial GSPRT model. See:
+static double score_to_elo(double score)
+{
+    return 400 * log10(score / (1 - score));
+}
+
+static bool stats(const Result *r, bool pentanomial, int *n, double *s, double *var)
+// Number of games (or game pairs), mean and variance of their score. Outcomes are scored as
+// i / (k - 1): L, D, W (trinomial), or LL, LD, DD|WL, WD, WW (pentanomial, with -repeat).
+{
+    const int *count = pentanomial ? r->ptnml : r->count;
+    const int k = pentanomial ? 5 : NB_RESULT;
+    int nonZero = 0;
+    *n = 0;
+
+    for (int i = 0; i < k; i++) {
+        *n += count[i];
+        nonZero += count[i] > 0;
+    }
+
+    if (nonZero < 2)  // at least 2 outcomes must be non zero
+        return false;
+
+    *s = *var = 0;
+
+    for (int i = 0; i < k; i++) {
+        const double x = (double)i / (k - 1), p = (double)count[i] / *n;
+        *s += p * x;
+        *var += p * x * x;
+    }
+
+    *var -= *s * *s;
+    return true;
+}
+
+// Uses asymptotic LLR approximation in the GSPRT model, which applies to any multinomial: game
+// outcomes (trinomial), or game pair outcomes (pentanomial). See:
 // http://hardy.uhasselt.be/Toga/GSPRT_approximation.pdf
-static double sprt_llr(int wldCount[NB_RESULT], double elo0, double elo1)
+double sprt_llr(const Result *r, bool pentanomial, const SPRTParam *sp)
 {
-    if (!!wldCount[0] + !!wldCount[1] + !!wldCount[2] < 2)  // at least 2 among 3 must be non zero
+    int n = 0;
+    double s = 0, var = 0;
+
+    if (!stats(r, pentanomial, &n, &s, &var))
         return 0;
 
-    const int n = wldCount[RESULT_WIN] + wldCount[RESULT_LOSS] + wldCount[RESULT_DRAW];
-    const double w = (double)wldCount[RESULT_WIN] / n, l = (double)wldCount[RESULT_LOSS] / n,
-        d = 1 - w - l;
-    const double s = w + d / 2, var = (w + d / 4) - s * s;
-    const double s0 = elo_to_score(elo0), s1 = elo_to_score(elo1);
+    double s0, s1;
+
+    if (sp->model == SPRT_NORMALIZED) {
+        // The variance of a game pair is half that of a game (if games were independent)
+        const double sigma = sqrt(pentanomial ? 2 * var : var);
+        s0 = 0.5 + sp->elo0 * sigma * log(10) / 800;
+        s1 = 0.5 + sp->elo1 * sigma * log(10) / 800;
+    } else {
+        s0 = elo_to_score(sp->elo0);
+        s1 = elo_to_score(sp->elo1);
+    }
 
     return (s1 - s0) * (2 * s - s0 - s1) / (2 * var / n);
 }
@@ -43,20 +88,35 @@ bool sprt_validate(const SPRTParam *sp)
         && sp->elo0 < sp->elo1;
 }
 
-bool sprt_done(int wldCount[NB_RESULT], const SPRTParam *sp)
+bool sprt_done(const Result *r, bool pentanomial, const SPRTParam *sp, char status[64])
 {
     const double lbound = log(sp->beta / (1 - sp->alpha));
     const double ubound = log((1 - sp->beta) / sp->alpha);
-    const double llr = sprt_llr(wldCount, sp->elo0, sp->elo1);
-
-    if (llr > ubound) {
-        printf("SPRT: LLR = %.3f [%.3f,%.3f]. H1 accepted.\n", llr, lbound, ubound);
-        return true;
-    } else if (llr < lbound) {
-        printf("SPRT: LLR = %.3f [%.3f,%.3f]. H0 accepted.\n", llr, lbound, ubound);
-        return true;
-    } else
-        printf("SPRT: LLR = %.3f [%.3f,%.3f]\n", llr, lbound, ubound);
-
-    return false;
+    const double llr = sprt_llr(r, pentanomial, sp);
+    const bool done = llr > ubound || llr < lbound;
+
+    snprintf(status, 64, "LLR = %.3f [%.3f,%.3f]%s", llr, lbound, ubound,
+        llr > ubound ? ". H1 accepted." : llr < lbound ? ". H0 accepted." : "");
+
+    return done;
+}
+
+bool elo_estimate(const Result *r, bool pentanomial, double *elo, double *error)
+{
+    int n = 0;
+    double s = 0, var = 0;
+
+    // The normal approximation needs a few games (or game pairs)
+    if (!stats(r, pentanomial, &n, &s, &var) || n < 20)
+        return false;
+
+    // Error bound on the score (95% confidence), translated into Elo. Infinite if the interval
+    // reaches 0 or 1.
+    const double ds = 1.959964 * sqrt(var / n);
+    *elo = score_to_elo(s);
+    *error = s - ds > 0 && s + ds < 1
+        ? (score_to_elo(s + ds) - score_to_elo(s - ds)) / 2
+        : INFINITY;
+
+    return true;
 }
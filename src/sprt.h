@@ -13,11 +13,26 @@
  * not, see <http://www.gnu.org/licenses/>.
 */
 #pragma once
+#include "jobs.h"
 #include "workers.h"
 
+// Elo model of elo0 and elo1
+enum {
+    SPRT_LOGISTIC,  // usual Elo: score = 1 / (1 + 10^(-elo/400))
+    SPRT_NORMALIZED  // normalized Elo: (score - 0.5) / sigma * 800 / ln(10), sigma per game
+};
+
 typedef struct {
     double elo0, elo1, alpha, beta;
+    int model;
+    char pad[4];
 } SPRTParam;
 
 bool sprt_validate(const SPRTParam *sp);
-bool sprt_done(int wldCount[NB_RESULT], const SPRTParam *sp);
+double sprt_llr(const Result *r, bool pentanomial, const SPRTParam *sp);
+
+// Status line of the test in status[], eg. "LLR = 1.234 [-2.944,2.944]"
+bool sprt_done(const Result *r, bool pentanomial, const SPRTParam *sp, char status[64]);
+
+// Elo estimate, and half width of its 95% confidence interval (false if not enough data yet)
+bool elo_estimate(const Result *r, bool pentanomial, double *elo, double *error);
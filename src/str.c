@@ -13,10 +13,12 @@
  * not, see <http://www.gnu.org/licenses/>.
 */
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "str.h"
 #include "util.h"
 
@@ -305,29 +307,102 @@ const char *str_prefix(const char *s, const char *prefix)
     return strncmp(s, prefix, len) ? NULL : s + len;
 }
 
-size_t str_getline(str_t *out, FILE *in)
+LineReader line_reader_init(int fd)
 {
-    assert(str_ok(*out) && in);
-    str_resize(out, 0);
-    int c;
+    LineReader lr = {.fd = fd, .size = 64 * 1024};
+    lr.buf = malloc(lr.size);
+    return lr;
+}
 
-    flockfile(in);
+LineReader line_reader_init_socket(int fd, size_t maxSize)
+{
+    LineReader lr = line_reader_init(fd);
+    lr.maxSize = maxSize;
+    lr.socket = true;
+    return lr;
+}
 
-    while (true) {
-        c = getc_unlocked(in);
+void line_reader_destroy(LineReader *lr)
+{
+    free(lr->buf);
+    *lr = (LineReader){0};
+}
 
-        if (c == '\r')
-            continue;
-        if (c != '\n' && c != EOF)
-            str_push(out, (char)c);
-        else
-            break;
+bool line_reader_fill(LineReader *lr)
+{
+    // Move unread data to the beginning of the buffer, and grow it if it's full. Always keep one
+    // spare byte, to terminate an unterminated last line with '\0'.
+    if (lr->head) {
+        memmove(lr->buf, &lr->buf[lr->head], lr->tail - lr->head);
+        lr->tail -= lr->head;
+        lr->head = 0;
+    }
+
+    if (lr->tail + 1 >= lr->size) {
+        // Line too long: discard it, rather than returning its start as a last line
+        if (lr->maxSize && lr->size >= lr->maxSize) {
+            lr->tail = 0;
+            lr->eof = true;
+            return false;
+        }
+
+        lr->buf = realloc(lr->buf, (lr->size *= 2));
     }
 
-    funlockfile(in);
+    ssize_t n = 0;
 
-    const size_t n = out->len + (c == '\n');
+    do {
+        n = read(lr->fd, &lr->buf[lr->tail], lr->size - lr->tail - 1);
+    } while (n < 0 && errno == EINTR);
+
+    DIE_IF(0, n < 0 && !lr->socket);
+    lr->tail += (size_t)max(n, 0);
+    lr->eof = n <= 0;
+    return !lr->eof;
+}
+
+bool line_reader_next(LineReader *lr, str_t *line)
+{
+    char *start = &lr->buf[lr->head], *eol = memchr(start, '\n', lr->tail - lr->head);
+
+    if (eol)
+        lr->head = (size_t)(eol - lr->buf) + 1;
+    else if (lr->eof && lr->head < lr->tail) {
+        eol = &lr->buf[lr->tail];
+        lr->head = lr->tail;
+    } else
+        return false;
+
+    // Discard '\r' on lines terminated by "\r\n"
+    if (eol > start && eol[-1] == '\r')
+        eol--;
+
+    *eol = '\0';
+    *line = (str_t){.buf = start, .len = (size_t)(eol - start), .alloc = (size_t)(eol - start) + 1};
+    return true;
+}
+
+bool line_reader_getline(LineReader *lr, str_t *line)
+{
+    while (!line_reader_next(lr, line))
+        if (!line_reader_fill(lr))
+            return line_reader_next(lr, line);
+
+    return true;
+}
+
+bool line_reader_read(LineReader *lr, void *dest, size_t n)
+{
+    for (char *d = dest; n; ) {
+        if (lr->head == lr->tail && !line_reader_fill(lr))
+            return false;
+
+        const size_t chunk = min(n, lr->tail - lr->head);
+        memcpy(d, &lr->buf[lr->head], chunk);
+        lr->head += chunk;
+        d += chunk;
+        n -= chunk;
+    }
 
-    assert(str_ok(*out));
-    return n;
+    return true;
 }
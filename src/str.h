@@ -80,6 +80,33 @@ const char *str_tok_esc(const char *s, str_t *token, char delim, char esc);
 //If s starts with prefix, return the tail (from s = prefix + tail), otherwise return NULL.
 const char *str_prefix(const char *s, const char *prefix);
 
-// reads a line from file 'in', into valid string 'out', and return the number of characters read
-// (including the '\n' if any). The '\n' is discarded from the output, but still counted.
-size_t str_getline(str_t *out, FILE *in);
+// Buffered line reader on a file descriptor (typically a pipe): reads in large chunks, and returns
+// lines as views into its buffer, without copying. A view is a valid C-string (the '\n' or "\r\n"
+// is overwritten by '\0'), until the next call to line_reader_fill(), and must not be destroyed.
+typedef struct {
+    char *buf;  // unread data is buf[head..tail-1]
+    size_t size, head, tail;
+    size_t maxSize;  // buffer size limit (0 = none): a longer line ends the input, like end of file
+    int fd;
+    bool eof;
+    bool socket;  // read errors end the input (lost peer, eg. reset or timed out), instead of DIE()
+    char pad[2];
+} LineReader;
+
+LineReader line_reader_init(int fd);
+LineReader line_reader_init_socket(int fd, size_t maxSize);
+void line_reader_destroy(LineReader *lr);
+
+// read one chunk from the file descriptor (blocking). returns false on end of file.
+bool line_reader_fill(LineReader *lr);
+
+// if a complete line is buffered (or a last unterminated line, after end of file), point 'line' to
+// it and return true. otherwise, return false (call line_reader_fill() first).
+bool line_reader_next(LineReader *lr, str_t *line);
+
+// blocking version, combining both. returns false on end of file.
+bool line_reader_getline(LineReader *lr, str_t *line);
+
+// read exactly n raw bytes into dest (blocking), for binary data following a line. returns false
+// on end of file.
+bool line_reader_read(LineReader *lr, void *dest, size_t n);
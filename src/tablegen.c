@@ -0,0 +1,390 @@
+/*
+ * c-chess-cli, a command line interface for UCI chess engines. Copyright 2020 lucasart.
+ *
+ * c-chess-cli is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * c-chess-cli is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program. If
+ * not, see <http://www.gnu.org/licenses/>.
+*/
+// Build time program, run by make.py: prints src/tables.c, which defines the bitboard and zobrist
+// tables, and the KPvK bitbase, as static data (declared in bitboard.h, position.c, and tb.c).
+// Slider attacks are printed twice, indexed by magics and by PEXT (see bitboard.h).
+#include <stdio.h>
+#include "bitboard.h"
+#include "tb.h"
+#include "util.h"
+
+static const bitboard_t RookMagics[NB_SQUARE] = {
+    0x808000645080c000, 0x208020001480c000, 0x4180100160008048, 0x8180100018001680,
+    0x4200082010040201, 0x8300220400010008, 0x3100120000890004, 0x4080004500012180,
+    0x1548000a1804008, 0x4881004005208900, 0x480802000801008, 0x2e8808010008800,
+    0x8cd804800240080, 0x8a058002008c0080, 0x514000c480a1001, 0x101000282004d00,
+    0x2048848000204000, 0x3020088020804000, 0x4806020020841240, 0x6080420008102202,
+    0x10050011000800, 0xac00808004000200, 0x10100020004, 0x1500020004004581,
+    0x4c00180052080, 0x220028480254000, 0x2101200580100080, 0x407201200084200,
+    0x18004900100500, 0x100200020008e410, 0x81020400100811, 0x12200024494,
+    0x8006c002808006a5, 0x4201000404000, 0x5402202001180, 0x81001002100,
+    0x100801000500, 0x4000020080800400, 0x4005050214001008, 0x810100118b000042,
+    0xd01020040820020, 0x140a010014000, 0x420001500210040, 0x54210010030009,
+    0x4000408008080, 0x2000400090100, 0x840200010100, 0x233442820004,
+    0x800a42002b008200, 0x240200040009080, 0x242001020408200, 0x4000801000480480,
+    0x2288008044000880, 0xa800400020180, 0x30011002880c00, 0x41110880440200,
+    0x2001100442082, 0x1a0104002208101, 0x80882014010200a, 0x100100600409,
+    0x2011048204402, 0x12000168041002, 0x80100008a000421, 0x240022044031182
+};
+
+static const bitboard_t BishopMagics[NB_SQUARE] = {
+    0x88b030028800d040, 0x18242044c008010, 0x10008200440000, 0x4311040888800a00,
+    0x1910400000410a, 0x2444240440000000, 0xcd2080108090008, 0x2048242410041004,
+    0x8884441064080180, 0x42131420a0240, 0x28882800408400, 0x204384040b820200,
+    0x402040420800020, 0x20910282304, 0x96004b10082200, 0x4000a44218410802,
+    0x808034002081241, 0x101805210e1408, 0x9020400208010220, 0x820050c010044,
+    0x24005480a00000, 0x200200900890, 0x808040049c100808, 0x9020202200820802,
+    0x410282124200400, 0x90106008010110, 0x8001100501004201, 0x104080004030c10,
+    0x80840040802008, 0x2008008102406000, 0x2000888004040460, 0xd0421242410410,
+    0x8410100401280800, 0x801012000108428, 0x402080300b04, 0xc20020080480080,
+    0x40100e0201502008, 0x4014208200448800, 0x4050020607084501, 0x1002820180020288,
+    0x800610040540a0c0, 0x301009014081004, 0x2200610040502800, 0x300442011002800,
+    0x1022009002208, 0x110011000202100, 0x1464082204080240, 0x21310205800200,
+    0x814020210040109, 0xc102008208c200a0, 0xc100702128080000, 0x1044205040000,
+    0x1041002020000, 0x4200040408021000, 0x4004040c494000, 0x2010108900408080,
+    0x820801040284, 0x800004118111000, 0x203040201108800, 0x2504040804208803,
+    0x228000908030400, 0x10402082020200, 0xa0402208010100, 0x30c0214202044104
+};
+
+static bitboard_t Ranks[NB_RANK], Files[NB_FILE];
+static bitboard_t Pawn[NB_COLOR][NB_SQUARE], Knight[NB_SQUARE], King[NB_SQUARE];
+static bitboard_t Segments[NB_SQUARE][NB_SQUARE], Rays[NB_SQUARE][NB_SQUARE];
+
+static bitboard_t RookDBGen[0x19000], BishopDBGen[0x1480];
+static bitboard_t RookPextDBGen[0x19000], BishopPextDBGen[0x1480];
+static bitboard_t BishopMasks[NB_SQUARE], RookMasks[NB_SQUARE];
+static uint64_t BishopShifts[NB_SQUARE], RookShifts[NB_SQUARE];
+static uint64_t BishopOffsets[NB_SQUARE], RookOffsets[NB_SQUARE];
+
+static uint64_t Key[NB_COLOR][NB_PIECE][NB_SQUARE];
+static uint64_t Castling[NB_SQUARE], EnPassant[NB_SQUARE + 1], Turn;
+
+static uint8_t KPKResult[KPK_SIZE];
+static uint64_t KPKWinGen[KPK_SIZE / 64];
+
+static void safe_set_bit(bitboard_t *b, int rank, int file)
+{
+    if (0 <= rank && rank < NB_RANK && 0 <= file && file < NB_FILE)
+        bb_set(b, square_from(rank, file));
+}
+
+// Compute (from scratch) the squares attacked by a sliding piece, moving in directions dir, given
+// board occupancy occ.
+static bitboard_t slider_attacks(int square, bitboard_t occ, const int dir[4][2])
+{
+    bitboard_t result = 0;
+
+    for (int i = 0; i < 4; i++) {
+        const int dr = dir[i][0], df = dir[i][1];
+        int rank = rank_of(square) + dr, file = file_of(square) + df;
+
+        while (0 <= rank && rank < NB_RANK && 0 <= file && file < NB_FILE) {
+            const int sq = square_from(rank, file);
+            bb_set(&result, sq);
+
+            if (bb_test(occ, sq))
+                break;
+
+            rank += dr, file += df;
+        }
+    }
+
+    return result;
+}
+
+static unsigned soft_pext(bitboard_t occ, bitboard_t mask)
+// Portable PEXT: gather the bits of occ selected by mask, into the low bits of the result
+{
+    unsigned result = 0;
+
+    for (unsigned bit = 1; mask; bit <<= 1)
+        if (bb_test(occ, bb_pop_lsb(&mask)))
+            result |= bit;
+
+    return result;
+}
+
+static void init_slider_attacks(int square, bitboard_t mask[NB_SQUARE],
+    const bitboard_t magic[NB_SQUARE], uint64_t shift[NB_SQUARE], uint64_t offset[NB_SQUARE],
+    bitboard_t *db, bitboard_t *pextDb, const int dir[4][2])
+{
+    const bitboard_t edges = ((Ranks[RANK_1] | Ranks[RANK_8]) & ~Ranks[rank_of(square)]) |
+        ((Files[FILE_A] | Files[FILE_H]) & ~Files[file_of(square)]);
+    mask[square] = slider_attacks(square, 0, dir) & ~edges;
+    shift[square] = (uint64_t)(64 - bb_count(mask[square]));
+
+    if (square + 1 < NB_SQUARE)
+        offset[square + 1] = offset[square] + (1ULL << bb_count(mask[square]));
+
+    // Loop over the subsets of mask[square]
+    bitboard_t occ = 0;
+
+    do {
+        const bitboard_t attacks = slider_attacks(square, occ, dir);
+        db[offset[square] + (((occ & mask[square]) * magic[square]) >> shift[square])] = attacks;
+        pextDb[offset[square] + soft_pext(occ, mask[square])] = attacks;
+        occ = (occ - mask[square]) & mask[square];  // Carry-Rippler trick
+    } while (occ);
+}
+
+static void init_tables(void)
+{
+    static const int PawnDir[2][2] = {{1,-1}, {1,1}};
+    static const int KnightDir[8][2] = {{-2,-1}, {-2,1}, {-1,-2}, {-1,2}, {1,-2}, {1,2}, {2,-1}, {2,1}};
+    static const int KingDir[8][2] = {{-1,-1}, {-1,0}, {-1,1}, {0,-1}, {0,1}, {1,-1}, {1,0}, {1,1}};
+    static const int BishopDir[4][2] = {{-1,-1}, {-1,1}, {1,-1}, {1,1}};
+    static const int RookDir[4][2] = {{-1,0}, {0,-1}, {0,1}, {1,0}};
+
+    // Initialise Rank[] and File[]
+    for (int i = 0; i < 8; i++) {
+        Ranks[i] = 0xFFULL << (8 * i);
+        Files[i] = 0x0101010101010101ULL << i;
+    }
+
+    // Initialise Ray[][] and Segment[][]
+    for (int square = 0; square < NB_SQUARE; square++) {
+        for (int d = 0; d < 8; d++) {
+            bitboard_t mask = 0;
+            int r2 = rank_of(square), f2 = file_of(square);
+
+            while (0 <= r2 && r2 < NB_RANK && 0 <= f2 && f2 < NB_FILE) {
+                const int s2 = square_from(r2, f2);
+                bb_set(&mask, s2);
+                Segments[square][s2] = mask;
+                r2 += KingDir[d][0];
+                f2 += KingDir[d][1];
+            }
+
+            bitboard_t sqs = mask;
+
+            while (sqs)
+                Rays[square][bb_pop_lsb(&sqs)] = mask;
+        }
+    }
+
+    // Initialise leaper attacks (N, K, P)
+    for (int square = 0; square < NB_SQUARE; square++) {
+        const int rank = rank_of(square), file = file_of(square);
+
+        for (int d = 0; d < 8; d++) {
+            safe_set_bit(&Knight[square], rank + KnightDir[d][0], file + KnightDir[d][1]);
+            safe_set_bit(&King[square], rank + KingDir[d][0], file + KingDir[d][1]);
+        }
+
+        for (int d = 0; d < 2; d++) {
+            safe_set_bit(&Pawn[WHITE][square], rank + PawnDir[d][0], file + PawnDir[d][1]);
+            safe_set_bit(&Pawn[BLACK][square], rank - PawnDir[d][0], file - PawnDir[d][1]);
+        }
+    }
+
+    // Initialise slider attacks (B, R)
+    for (int square = 0; square < NB_SQUARE; square++) {
+        init_slider_attacks(square, BishopMasks, BishopMagics, BishopShifts, BishopOffsets,
+            BishopDBGen, BishopPextDBGen, BishopDir);
+        init_slider_attacks(square, RookMasks, RookMagics, RookShifts, RookOffsets, RookDBGen,
+            RookPextDBGen, RookDir);
+    }
+
+    // Zobrist keys
+    uint64_t seed = 0;
+
+    for (int color = 0; color < NB_COLOR; color++)
+        for (int piece = 0; piece < NB_PIECE; piece++)
+            for (int square = 0; square < NB_SQUARE; square++)
+                Key[color][piece][square] = prng(&seed);
+
+    for (int square = 0; square < NB_SQUARE; square++) {
+        Castling[square] = prng(&seed);
+        EnPassant[square] = prng(&seed);
+    }
+
+    EnPassant[NB_SQUARE] = prng(&seed);
+    Turn = prng(&seed);
+}
+
+// KPvK bitbase, by retrograde iteration: positions are first classified by static rules (invalid,
+// immediate promotion, stalemate or pawn capture), then from their children's results, until no
+// unknown position can be resolved anymore. Those left unknown are draws.
+enum {KPK_INVALID = 0, KPK_UNKNOWN = 1, KPK_DRAW = 2, KPK_WIN = 4};
+
+static void kpk_decode(unsigned idx, int *stm, int *blackKing, int *whiteKing, int *pawn)
+{
+    *whiteKing = (int)(idx & 63);
+    *blackKing = (int)((idx >> 6) & 63);
+    *stm = (int)((idx >> 12) & 1);
+    *pawn = square_from(RANK_7 - (int)(idx >> 15), (int)((idx >> 13) & 3));
+}
+
+static uint8_t kpk_init(unsigned idx)
+{
+    int stm, bk, wk, pawn;
+    kpk_decode(idx, &stm, &bk, &wk, &pawn);
+
+    if (wk == bk || bb_test(King[wk], bk) || wk == pawn || bk == pawn
+            || (stm == WHITE && bb_test(Pawn[WHITE][pawn], bk)))
+        return KPK_INVALID;
+
+    // White promotes safely
+    if (stm == WHITE && rank_of(pawn) == RANK_7 && wk != pawn + UP && bk != pawn + UP
+            && (!bb_test(King[bk], pawn + UP) || bb_test(King[wk], pawn + UP)))
+        return KPK_WIN;
+
+    // Stalemate, or black captures the undefended pawn
+    if (stm == BLACK && (!(King[bk] & ~(King[wk] | Pawn[WHITE][pawn]))
+            || (bb_test(King[bk], pawn) && !bb_test(King[wk], pawn))))
+        return KPK_DRAW;
+
+    return KPK_UNKNOWN;
+}
+
+static uint8_t kpk_classify(unsigned idx)
+{
+    int stm, bk, wk, pawn;
+    kpk_decode(idx, &stm, &bk, &wk, &pawn);
+
+    const uint8_t good = stm == WHITE ? KPK_WIN : KPK_DRAW, bad = stm == WHITE ? KPK_DRAW : KPK_WIN;
+    uint8_t r = KPK_INVALID;  // union of the children's results
+    bitboard_t kingMoves = King[stm == WHITE ? wk : bk];
+
+    while (kingMoves) {
+        const int to = bb_pop_lsb(&kingMoves);
+        r |= stm == WHITE ? KPKResult[kpk_index(BLACK, bk, to, pawn)]
+            : KPKResult[kpk_index(WHITE, to, wk, pawn)];
+    }
+
+    if (stm == WHITE) {
+        if (rank_of(pawn) < RANK_7)
+            r |= KPKResult[kpk_index(BLACK, bk, wk, pawn + UP)];
+
+        if (rank_of(pawn) == RANK_2 && pawn + UP != wk && pawn + UP != bk)
+            r |= KPKResult[kpk_index(BLACK, bk, wk, pawn + 2 * UP)];
+    }
+
+    return r & good ? good : r & KPK_UNKNOWN ? KPK_UNKNOWN : bad;
+}
+
+static void init_kpk(void)
+{
+    for (unsigned idx = 0; idx < KPK_SIZE; idx++)
+        KPKResult[idx] = kpk_init(idx);
+
+    bool changed = true;
+
+    while (changed) {
+        changed = false;
+
+        for (unsigned idx = 0; idx < KPK_SIZE; idx++)
+            if (KPKResult[idx] == KPK_UNKNOWN && (KPKResult[idx] = kpk_classify(idx)) != KPK_UNKNOWN)
+                changed = true;
+    }
+
+    for (unsigned idx = 0; idx < KPK_SIZE; idx++)
+        if (KPKResult[idx] == KPK_WIN)
+            KPKWinGen[idx / 64] |= 1ULL << (idx % 64);
+}
+
+static void print_values(const uint64_t *v, size_t n, const char *indent)
+{
+    for (size_t i = 0; i < n; i++)
+        printf("%s0x%" PRIx64 "%s", i % 4 ? " " : indent, v[i], i + 1 < n ? (i % 4 == 3 ? ",\n"
+            : ",") : "\n");
+}
+
+static void print_array(const char *decl, const uint64_t *v, size_t n)
+{
+    printf("%s = {\n", decl);
+    print_values(v, n, "    ");
+    puts("};\n");
+}
+
+static void print_array_2d(const char *decl, const uint64_t *v, size_t n, size_t m)
+{
+    printf("%s = {\n", decl);
+
+    for (size_t i = 0; i < n; i++) {
+        puts("    {");
+        print_values(&v[i * m], m, "        ");
+        puts(i + 1 < n ? "    }," : "    }");
+    }
+
+    puts("};\n");
+}
+
+static void print_array_3d(const char *decl, const uint64_t *v, size_t n, size_t m, size_t l)
+{
+    printf("%s = {\n", decl);
+
+    for (size_t i = 0; i < n; i++) {
+        puts("    {");
+
+        for (size_t j = 0; j < m; j++) {
+            puts("        {");
+            print_values(&v[(i * m + j) * l], l, "            ");
+            puts(j + 1 < m ? "        }," : "        }");
+        }
+
+        puts(i + 1 < n ? "    }," : "    }");
+    }
+
+    puts("};\n");
+}
+
+int main(void)
+{
+    init_tables();
+    init_kpk();
+
+    puts("// Generated by src/tablegen.c (see make.py). Do not edit.");
+    puts("#include \"bitboard.h\"\n#include \"tb.h\"\n");
+
+    print_array("const bitboard_t Rank[NB_RANK]", Ranks, NB_RANK);
+    print_array("const bitboard_t File[NB_FILE]", Files, NB_FILE);
+    print_array_2d("const bitboard_t PawnAttacks[NB_COLOR][NB_SQUARE]", &Pawn[0][0], NB_COLOR,
+        NB_SQUARE);
+    print_array("const bitboard_t KnightAttacks[NB_SQUARE]", Knight, NB_SQUARE);
+    print_array("const bitboard_t KingAttacks[NB_SQUARE]", King, NB_SQUARE);
+    print_array_2d("const bitboard_t Segment[NB_SQUARE][NB_SQUARE]", &Segments[0][0], NB_SQUARE,
+        NB_SQUARE);
+    print_array_2d("const bitboard_t Ray[NB_SQUARE][NB_SQUARE]", &Rays[0][0], NB_SQUARE,
+        NB_SQUARE);
+
+    print_array("const bitboard_t BishopMagic[NB_SQUARE]", BishopMagics, NB_SQUARE);
+    print_array("const bitboard_t RookMagic[NB_SQUARE]", RookMagics, NB_SQUARE);
+    print_array("const bitboard_t BishopMask[NB_SQUARE]", BishopMasks, NB_SQUARE);
+    print_array("const bitboard_t RookMask[NB_SQUARE]", RookMasks, NB_SQUARE);
+    print_array("const unsigned BishopShift[NB_SQUARE]", BishopShifts, NB_SQUARE);
+    print_array("const unsigned RookShift[NB_SQUARE]", RookShifts, NB_SQUARE);
+    print_array("const unsigned BishopOffset[NB_SQUARE]", BishopOffsets, NB_SQUARE);
+    print_array("const unsigned RookOffset[NB_SQUARE]", RookOffsets, NB_SQUARE);
+
+    // Only the slider tables that the build can use (see bitboard.h)
+    puts("#if !defined(HAS_PEXT) || !defined(__BMI2__)");
+    print_array("const bitboard_t BishopDB[0x1480]", BishopDBGen, 0x1480);
+    print_array("const bitboard_t RookDB[0x19000]", RookDBGen, 0x19000);
+    puts("#endif\n\n#ifdef HAS_PEXT");
+    print_array("const bitboard_t BishopPextDB[0x1480]", BishopPextDBGen, 0x1480);
+    print_array("const bitboard_t RookPextDB[0x19000]", RookPextDBGen, 0x19000);
+    puts("#endif\n");
+
+    print_array_3d("const uint64_t ZobristKey[NB_COLOR][NB_PIECE][NB_SQUARE]", &Key[0][0][0],
+        NB_COLOR, NB_PIECE, NB_SQUARE);
+    print_array("const uint64_t ZobristCastling[NB_SQUARE]", Castling, NB_SQUARE);
+    print_array("const uint64_t ZobristEnPassant[NB_SQUARE + 1]", EnPassant, NB_SQUARE + 1);
+    printf("const uint64_t ZobristTurn = 0x%" PRIx64 ";\n", Turn);
+
+    print_array("\nconst uint64_t KPKWin[KPK_SIZE / 64]", KPKWinGen, KPK_SIZE / 64);
+
+    return 0;
+}
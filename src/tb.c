@@ -0,0 +1,68 @@
+/*
+ * c-chess-cli, a command line interface for UCI chess engines. Copyright 2020 lucasart.
+ *
+ * c-chess-cli is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * c-chess-cli is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program. If
+ * not, see <http://www.gnu.org/licenses/>.
+*/
+#include "gen.h"
+#include "tb.h"
+
+extern const uint64_t KPKWin[KPK_SIZE / 64];
+
+static int probe_kpk(const Position *pos, int strong)
+{
+    // Normalize: strong side is white, with its pawn on files A-D
+    const int flip = strong == WHITE ? 0 : 070;
+    int pawn = bb_lsb(pos->byPiece[PAWN]) ^ flip;
+    const int mirror = file_of(pawn) <= FILE_D ? 0 : 7;
+    const int whiteKing = pos_king_square(pos, strong) ^ flip ^ mirror;
+    const int blackKing = pos_king_square(pos, opposite(strong)) ^ flip ^ mirror;
+    const int stm = pos->turn == strong ? WHITE : BLACK;
+    pawn ^= mirror;
+
+    const unsigned idx = kpk_index(stm, blackKing, whiteKing, pawn);
+
+    if (!((KPKWin[idx / 64] >> (idx % 64)) & 1))
+        return TB_DRAW;
+
+    return stm == WHITE ? TB_WIN : TB_LOSS;
+}
+
+int tb_probe_wdl(const Position *pos)
+{
+    const bitboard_t pieces = pos_pieces(pos);
+
+    if (bb_count(pieces) > TB_MAX_PIECES)
+        return TB_UNKNOWN;
+
+    if (!gen_has_legal_move(pos))
+        return pos->checkers ? TB_LOSS : TB_DRAW;
+
+    // Besides kings: nothing, or a minor piece
+    const bitboard_t extra = pieces & ~pos->byPiece[KING];
+
+    if (!(extra & (pos->byPiece[ROOK] | pos->byPiece[QUEEN] | pos->byPiece[PAWN])))
+        return TB_DRAW;
+
+    const int square = bb_lsb(extra), strong = pos_color_on(pos, square);
+
+    if (pos->byPiece[PAWN])
+        return probe_kpk(pos, strong);
+
+    // KRvK, KQvK: always won, unless the weak side to move can capture the piece
+    if (pos->turn == strong)
+        return TB_WIN;
+
+    const bool capture = bb_test(KingAttacks[pos_king_square(pos, pos->turn)], square)
+        && !bb_test(KingAttacks[pos_king_square(pos, strong)], square);
+
+    return capture ? TB_DRAW : TB_LOSS;
+}
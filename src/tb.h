@@ -0,0 +1,38 @@
+/*
+ * c-chess-cli, a command line interface for UCI chess engines. Copyright 2020 lucasart.
+ *
+ * c-chess-cli is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * c-chess-cli is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program. If
+ * not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include "position.h"
+
+// Endgame tablebase probing, for adjudication (see -tb). Built in knowledge, covering all positions
+// with up to 3 pieces (kings included): KvK, KNvK, KBvK, KRvK, KQvK, and KPvK using a bitbase
+// generated at build time (src/tablegen.c).
+enum {TB_MAX_PIECES = 3};
+enum {TB_UNKNOWN = -1, TB_LOSS, TB_DRAW, TB_WIN};
+
+// Win/Draw/Loss of pos, from the pov of the side to move (ignoring the 50 move rule). Returns
+// TB_UNKNOWN if pos is not covered (more than TB_MAX_PIECES pieces).
+int tb_probe_wdl(const Position *pos);
+
+// KPvK bitbase: one bit per position (set if white wins), with the white pawn on files A-D (others
+// are mirrored), and the weak side always black (colors are flipped otherwise)
+enum {KPK_SIZE = 2 * 24 * NB_SQUARE * NB_SQUARE};
+
+static inline unsigned kpk_index(int stm, int blackKing, int whiteKing, int pawn)
+{
+    BOUNDS(file_of(pawn), FILE_E);
+    assert(RANK_2 <= rank_of(pawn) && rank_of(pawn) <= RANK_7);
+    return (unsigned)(whiteKing | (blackKing << 6) | (stm << 12) | (file_of(pawn) << 13)
+        | ((RANK_7 - rank_of(pawn)) << 15));
+}
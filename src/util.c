@@ -14,10 +14,13 @@
 */
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
 #include "util.h"
 
 // SplitMix64 PRNG, based on http://xoroshiro.di.unimi.it/splitmix64.c
@@ -42,14 +45,62 @@ int64_t system_msec()
     return t.tv_sec * 1000LL + t.tv_nsec / 1000000;
 }
 
+int64_t system_usec()
+{
+    struct timespec t = {0};
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+}
+
 void system_sleep(int64_t msec)
 {
     const struct timespec t = {.tv_sec = msec / 1000, .tv_nsec = (msec % 1000) * 1000000LL};
     nanosleep(&t, NULL);
 }
 
+#ifdef MSG_NOSIGNAL
+    static const int SendFlags = MSG_NOSIGNAL;
+#else
+    static const int SendFlags = 0;  // SO_NOSIGPIPE instead (macOS)
+#endif
+
+bool socket_send(int fd, const void *buf, size_t len)
+{
+    for (const char *p = buf; len; ) {
+        const ssize_t n = send(fd, p, len, SendFlags);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+            return false;
+
+        p += n;
+        len -= (size_t)n;
+    }
+
+    return true;
+}
+
+_Noreturn void die_exit(void)
+{
+    static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;  // locked by the exiting thread
+    static pthread_t exiting;
+
+    if (pthread_mutex_trylock(&mtx)) {
+        if (pthread_equal(pthread_self(), exiting))
+            _exit(EXIT_FAILURE);
+
+        while (true)
+            pthread_mutex_lock(&mtx);  // never unlocked
+    }
+
+    exiting = pthread_self();
+    exit(EXIT_FAILURE);
+}
+
 _Noreturn void die_errno(const int threadId, const char *fileName, int line)
 {
     fprintf(stderr, "[%d] error in %s: (%d). %s\n", threadId, fileName, line, strerror(errno));
-    exit(EXIT_FAILURE);
+    die_exit();
 }
@@ -14,6 +14,7 @@
 */
 #pragma once
 #include <inttypes.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -37,11 +38,21 @@ uint64_t prng(uint64_t *state);
 double prngf(uint64_t *state);
 
 int64_t system_msec(void);
+int64_t system_usec(void);
 void system_sleep(int64_t msec);
 
+// Send all of buf[0..len-1] on a socket, without SIGPIPE if the peer is gone (needs SO_NOSIGPIPE on
+// systems without MSG_NOSIGNAL). Returns false if the connection is lost.
+bool socket_send(int fd, const void *buf, size_t len);
+
+// Exit with EXIT_FAILURE, once: exit() must not be called again by an atexit() handler, nor by
+// another thread meanwhile (undefined behaviour). A nested call exits immediately, with _exit(),
+// while other threads wait for the first exit() to complete.
+_Noreturn void die_exit(void);
+
 #define DIE(...) do { \
     fprintf(stderr, __VA_ARGS__); \
-    exit(EXIT_FAILURE); \
+    die_exit(); \
 } while (0)
 
 _Noreturn void die_errno(const int threadId, const char *fileName, int line);
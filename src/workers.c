@@ -12,72 +12,175 @@
  * You should have received a copy of the GNU General Public License along with this program. If
  * not, see <http://www.gnu.org/licenses/>.
 */
+#include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "reactor.h"
 #include "workers.h"
 #include "util.h"
 #include "vec.h"
 
 Worker *Workers;
 
+// Tolerance (in msec) before the watchdog enforces an overdue deadline
+static const int64_t Tolerance = 1000;
+
+// Watchdog, run by the main thread. It sleeps until the earliest deadline expires (plus tolerance),
+// or until a worker sets an earlier deadline, or changes the busy count.
+static struct {
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    _Atomic int64_t wakeAt;  // time at which the watchdog will wake up (INT64_MIN while scanning)
+    _Atomic int busy;  // number of busy workers
+    char pad[4];
+} Watchdog = {
+    .mtx = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .wakeAt = INT64_MAX
+};
+
+static struct timespec abs_time(int64_t msec)
+// Convert a system_msec() time into an absolute CLOCK_REALTIME time, for pthread_cond_timedwait()
+{
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_REALTIME, &ts);
+    const int64_t nsec = ts.tv_nsec + max(msec - system_msec(), 0) * 1000000;
+    ts.tv_sec += nsec / 1000000000;
+    ts.tv_nsec = nsec % 1000000000;
+    return ts;
+}
+
+static void watchdog_wake(void)
+{
+    pthread_mutex_lock(&Watchdog.mtx);
+    pthread_cond_signal(&Watchdog.cond);
+    pthread_mutex_unlock(&Watchdog.mtx);
+}
+
 void deadline_set(Worker *w, const char *engineName, int64_t timeLimit)
 {
     assert(timeLimit > 0);
 
-    pthread_mutex_lock(&w->deadline.mtx);
+    // Only the worker writes engineName, so it can read it without locking
+    if (strcmp(w->deadline.engineName.buf, engineName)) {
+        pthread_mutex_lock(&w->deadline.mtx);
+        str_cpy_c(&w->deadline.engineName, engineName);
+        pthread_mutex_unlock(&w->deadline.mtx);
+    }
 
-    w->deadline.set = true;
-    str_cpy_c(&w->deadline.engineName, engineName);
     w->deadline.timeLimit = timeLimit;
 
-    pthread_mutex_unlock(&w->deadline.mtx);
+    // Wake up the watchdog, only if it's sleeping past this deadline. Note the sequential consistency
+    // of both atomics, which guarantees that we see INT64_MIN if the watchdog might have missed our
+    // deadline while scanning.
+    if (timeLimit + Tolerance < Watchdog.wakeAt)
+        watchdog_wake();
 
-    if (w->log)
-        DIE_IF(w->id, fprintf(w->log, "deadline: %s must respond by %" PRId64 "\n", engineName,
-            timeLimit) < 0);
+    worker_note(w, "deadline: %s must respond by %" PRId64, engineName, timeLimit);
 }
 
 void deadline_clear(Worker *w)
 {
-    pthread_mutex_lock(&w->deadline.mtx);
-
-    w->deadline.set = false;
+    worker_note(w, "deadline: %s responded before %" PRId64, w->deadline.engineName.buf,
+        w->deadline.timeLimit);
 
-    if (w->log)
-        DIE_IF(w->id, fprintf(w->log, "deadline: %s responded before %" PRId64 "\n",
-            w->deadline.engineName.buf, w->deadline.timeLimit) < 0);
-
-    pthread_mutex_unlock(&w->deadline.mtx);
+    // The watchdog is not woken up: it will notice at its next scan
+    w->deadline.timeLimit = 0;
 }
 
 int64_t deadline_overdue(Worker *w)
 {
-    pthread_mutex_lock(&w->deadline.mtx);
-
     const int64_t timeLimit = w->deadline.timeLimit;
-    const bool set = w->deadline.set;
-
-    pthread_mutex_unlock(&w->deadline.mtx);
-
     const int64_t time = system_msec();
 
-    if (set && time > timeLimit)
+    if (timeLimit && time > timeLimit)
         return time - timeLimit;
     else
         return 0;
 }
 
-Worker worker_init(int i, const char *logName)
+void deadline_watch(void)
+// Run by the main thread, until there are no more busy workers. We want some tolerance on small
+// delays here. Given a choice, it's best to wait for the worker thread to notice an overdue deadline,
+// which it will handled nicely by counting the game as lost for the offending engine, and continue.
+// Enforcing deadlines from the master thread is the last resort solution, because it is an
+// unrecovrable error. At this point we are likely to face a completely unresponsive engine, where any
+// attempt at I/O will block the master thread, on top of the already blocked worker. Hence, we must
+// DIE().
+{
+    pthread_mutex_lock(&Watchdog.mtx);
+
+    while (Watchdog.busy) {
+        // Scan for overdue deadlines, and the earliest one (wakeAt = INT64_MIN forces workers to
+        // wake us up, if they set a new deadline during the scan)
+        Watchdog.wakeAt = INT64_MIN;
+        int64_t wakeAt = INT64_MAX;
+
+        for (size_t i = 0; i < vec_size(Workers); i++) {
+            Worker *w = &Workers[i];
+            const int64_t timeLimit = w->deadline.timeLimit;
+
+            if (!timeLimit)
+                continue;
+
+            if (deadline_overdue(w) > Tolerance) {
+                pthread_mutex_lock(&w->deadline.mtx);
+                DIE("[%d] engine %s is unresponsive\n", w->id, w->deadline.engineName.buf);
+            }
+
+            wakeAt = min(wakeAt, timeLimit + Tolerance + 1);
+        }
+
+        Watchdog.wakeAt = wakeAt;
+
+        if (wakeAt == INT64_MAX)
+            pthread_cond_wait(&Watchdog.cond, &Watchdog.mtx);
+        else {
+            const struct timespec ts = abs_time(wakeAt);
+            pthread_cond_timedwait(&Watchdog.cond, &Watchdog.mtx, &ts);
+        }
+    }
+
+    Watchdog.wakeAt = INT64_MAX;
+    pthread_mutex_unlock(&Watchdog.mtx);
+}
+
+void workers_busy_add(int n)
+{
+    Watchdog.busy += n;
+    watchdog_wake();
+}
+
+int workers_busy_count(void)
+{
+    return Watchdog.busy;
+}
+
+static void log_name(const Worker *w, const char *ext, str_t *out)
+{
+    str_cpy_fmt(out, "c-chess-cli.%i.%s", w->id, ext);
+}
+
+Worker worker_init(int i, int logMode, size_t logSize)
 {
     Worker w = {0};
-    w.seed = (uint64_t)i;
     w.id = i + 1;
+    w.cpus = vec_init(int);
+    w.node = -1;
     pthread_mutex_init(&w.deadline.mtx, NULL);
     w.deadline.engineName = str_init();
 
-    if (*logName) {
-        w.log = fopen(logName, "we");
-        DIE_IF(0, !w.log);
-    }
+    scope(str_destroy) str_t logName = str_init();
+
+    if (logMode == LOG_MODE_TEXT) {
+        log_name(&w, "log", &logName);
+        DIE_IF(0, !(w.log = fopen(logName.buf, "we")));
+    } else if (logMode == LOG_MODE_ASYNC) {
+        log_name(&w, "bin", &logName);
+        w.ring = log_ring_init(logSize, logName.buf);
+    } else if (logMode == LOG_MODE_FLIGHT)
+        w.ring = log_ring_init(logSize, NULL);
 
     return w;
 }
@@ -86,9 +189,70 @@ void worker_destroy(Worker *w)
 {
     str_destroy(&w->deadline.engineName);
     pthread_mutex_destroy(&w->deadline.mtx);
+    vec_destroy(w->cpus);
 
     if (w->log) {
         DIE_IF(0, fclose(w->log) < 0);
         w->log = NULL;
     }
+
+    if (w->ring) {
+        log_ring_destroy(w->ring);
+        w->ring = NULL;
+    }
+}
+
+void worker_log(const Worker *w, int kind, const char *name, const char *text)
+{
+    if (w->log) {
+        DIE_IF(w->id, !log_print(w->log, kind, name, text));
+
+        if (kind == LOG_WRITE)
+            DIE_IF(w->id, fflush(w->log) < 0);
+    } else if (w->ring)
+        log_ring_push(w->ring, kind, name, text);
+}
+
+void worker_note(const Worker *w, const char *fmt, ...)
+{
+    if (!w->log && !w->ring)
+        return;
+
+    char text[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(text, sizeof(text), fmt, args);
+    va_end(args);
+
+    worker_log(w, LOG_NOTE, NULL, text);
+}
+
+void worker_sleep(const Worker *w, int64_t msec)
+{
+    if (w->fiber)
+        reactor_wait(w->fiber, -1, system_msec() + msec);
+    else
+        system_sleep(msec);
+}
+
+void worker_dump(const Worker *w, const char *reason)
+// Best effort, without DIE_IF(): this is also called by the atexit() handler after DIE(), which
+// must not exit() again, while other workers may still be writing to their ring (the dump then
+// stops at the first record being overwritten). Errors only mean a missing or partial dump.
+{
+    if (!w->ring || w->ring->out)
+        return;
+
+    scope(str_destroy) str_t logName = str_init();
+    log_name(w, "log", &logName);
+
+    FILE *out = fopen(logName.buf, "ae");
+
+    if (!out)
+        return;
+
+    if (fprintf(out, "flight recorder: %s\n", reason) >= 0)
+        log_ring_dump(w->ring, out);
+
+    fclose(out);
 }
@@ -15,8 +15,11 @@
 #pragma once
 #include <pthread.h>
 #include <inttypes.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include "latency.h"
+#include "logring.h"
 #include "str.h"
 
 // Game results
@@ -27,29 +30,45 @@ enum {
     NB_RESULT
 };
 
-// Per thread data
+// Coroutine running a worker, with -reactor (see reactor.h)
+typedef struct Fiber Fiber;
+
+// Per thread data (or per coroutine, with -reactor)
 typedef struct {
     struct {
-        pthread_mutex_t mtx;
-        int64_t timeLimit;
+        pthread_mutex_t mtx;  // protects engineName (only written when it changes)
         str_t engineName;
-        bool set;
-        char pad[7];
+        _Atomic int64_t timeLimit;  // 0 if not set
     } deadline;
-    FILE *log;
-    uint64_t seed;  // seed for prng()
+    Histogram latency[NB_STAGE];  // per move latency of each stage of game_play()
+    int *cpus;  // CPUs assigned to engines, with -affinity (empty otherwise)
+    FILE *log;  // -log (text mode)
+    LogRing *ring;  // -log async, or -log flight=KB
+    Fiber *fiber;  // with -reactor (NULL if the worker runs on its own thread)
     int id;  // starts at 1 (0 is for main thread)
-    char pad[4];
+    int node;  // NUMA node of cpus[] (-1 if none)
 } Worker;
 
 extern Worker *Workers;
 
-Worker worker_init(int id, const char *logName);
+Worker worker_init(int id, int logMode, size_t logSize);
 void worker_destroy(Worker *w);
 
+// Logging, according to -log mode (no-op without -log). Engine I/O lines are recorded with
+// worker_log(), and other messages with worker_note(), which formats only if logging is enabled.
+void worker_log(const Worker *w, int kind, const char *name, const char *text);
+void worker_note(const Worker *w, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Append the content of the flight recorder to c-chess-cli.id.log
+void worker_dump(const Worker *w, const char *reason);
+
+// Sleep for msec (with -reactor, other coroutines of the thread run in the meantime)
+void worker_sleep(const Worker *w, int64_t msec);
+
 void deadline_set(Worker *w, const char *engineName, int64_t timeLimit);
 void deadline_clear(Worker *w);
 int64_t deadline_overdue(Worker *w);
+void deadline_watch(void);
 
 void workers_busy_add(int n);
 int workers_busy_count(void);
@@ -0,0 +1,352 @@
+/*
+ * c-chess-cli, a command line interface for UCI chess engines. Copyright 2020 lucasart.
+ *
+ * c-chess-cli is free software: you can redistribute it and/or modify it under the terms of the GNU
+ * General Public License as published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * c-chess-cli is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without
+ * even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program. If
+ * not, see <http://www.gnu.org/licenses/>.
+*/
+// Stand alone program: perft (checked against known node counts), and micro-benchmarks of the move
+// generator and position code used to validate engine moves. Results are printed as JSON lines:
+// {"bench": NAME, "ops": N, "nsec": T, "nsPerOp": T/N}, plus "nodes" and "nps" for perft.
+// Usage: bench [EPD_FILE [DEPTH]]. Exits with failure if a perft count is wrong.
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "gen.h"
+#include "util.h"
+#include "vec.h"
+
+// Perft reference positions, with node counts from https://www.chessprogramming.org/Perft_Results
+static const struct {
+    const char *fen;
+    int depth, nodes;
+} Reference[] = {
+    {"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", 5, 4865609},
+    {"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1", 4, 4085603},
+    {"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1", 5, 674624},
+    {"r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1", 4, 422333},
+    {"rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8", 4, 2103487},
+    {"bqnb1rkr/pp3ppp/3ppn2/2p5/5P2/P2P4/NPP1P1PP/BQ1BNRKR w HFhf - 2 9", 4, 326672},
+    {"2nnrbkr/p1qppppp/8/1ppb4/6PP/3PP3/PPP2P2/BQNNRBKR w HEhe - 1 9", 4, 667366}
+};
+
+// Positions without legal moves: checkmate, stalemate, and checkmate by a double check
+static const char *const NoMoves[] = {
+    "rnb1kbnr/pppp1ppp/8/4p3/6Pq/5P2/PPPPP2P/RNBQKBNR w KQkq - 1 3",
+    "7k/5Q2/6K1/8/8/8/8/8 b - - 0 1",
+    "r1bqkb1r/pppp1Qpp/2n2n2/4p3/2B1P3/8/PPPP1PPP/RNB1K1NR b KQkq - 0 4",
+    "3qkb2/3p1p2/3N4/8/8/8/8/4R1K1 b - - 0 1"
+};
+
+static int64_t clock_nsec(void)
+{
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void report(const char *bench, uint64_t ops, int64_t nsec)
+{
+    printf("{\"bench\": \"%s\", \"ops\": %" PRIu64 ", \"nsec\": %" PRId64 ", \"nsPerOp\": %.1f}\n",
+        bench, ops, nsec, (double)nsec / (double)max(ops, (uint64_t)1));
+}
+
+static uint64_t perft(const Position *pos, int depth)
+{
+    MoveList list;
+    gen_moves(pos, &list);
+
+    if (depth == 1)
+        return list.size;
+
+    uint64_t nodes = 0;
+    Position after;
+
+    for (size_t i = 0; i < list.size; i++) {
+        pos_move(&after, pos, list.moves[i]);
+        nodes += perft(&after, depth - 1);
+    }
+
+    return nodes;
+}
+
+static uint64_t perft_run(const Position *positions, size_t count, int depth, const char *bench)
+{
+    const int64_t start = clock_nsec();
+    uint64_t nodes = 0;
+
+    for (size_t i = 0; i < count; i++)
+        nodes += perft(&positions[i], depth);
+
+    const int64_t nsec = clock_nsec() - start;
+
+    printf("{\"bench\": \"%s\", \"depth\": %d, \"nodes\": %" PRIu64 ", \"nsec\": %" PRId64
+        ", \"nps\": %.0f}\n", bench, depth, nodes, nsec, (double)nodes * 1e9 / (double)max(nsec, 1));
+
+    return nodes;
+}
+
+static bool check_legal(const Position *pos)
+// pos_move_is_legal() and gen_has_legal_move() must agree with gen_moves(), for every move_t with
+// one of our pieces on the from square
+{
+    MoveList list;
+    gen_moves(pos, &list);
+    bool generated[1 << 16] = {0};
+
+    for (size_t i = 0; i < list.size; i++)
+        generated[list.moves[i]] = true;
+
+    if (gen_has_legal_move(pos) != (list.size > 0))
+        return false;
+
+    for (unsigned m = 0; m < 1 << 16; m++)
+        if (bb_test(pos->byColor[pos->turn], move_from((move_t)m))
+                && pos_move_is_legal(pos, (move_t)m) != generated[m])
+            return false;
+
+    return true;
+}
+
+static bool bench_legal(const Position *positions, size_t count)
+// Check legality tests on all positions, and the children in check. Then time them against
+// generating all legal moves.
+{
+    bool ok = true;
+
+    for (size_t i = 0; i < count; i++) {
+        MoveList list;
+        gen_moves(&positions[i], &list);
+        ok = check_legal(&positions[i]) && ok;
+
+        for (size_t j = 0; j < list.size; j++) {
+            Position after;
+            pos_move(&after, &positions[i], list.moves[j]);
+
+            if (after.checkers)
+                ok = check_legal(&after) && ok;
+        }
+    }
+
+    if (!ok)
+        fprintf(stderr, "pos_move_is_legal() or gen_has_legal_move() disagrees with gen_moves()\n");
+
+    int64_t nsecGen = 0, nsecLegal = 0, nsecHas = 0;
+    uint64_t ops = 0, found = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        MoveList list;
+        int64_t lap = clock_nsec();
+        gen_moves(&positions[i], &list);
+        nsecGen += clock_nsec() - lap;
+        ops += list.size;
+
+        lap = clock_nsec();
+
+        for (size_t j = 0; j < list.size; j++)
+            found += pos_move_is_legal(&positions[i], list.moves[j]);
+
+        nsecLegal += clock_nsec() - lap;
+
+        lap = clock_nsec();
+        found += gen_has_legal_move(&positions[i]);
+        nsecHas += clock_nsec() - lap;
+    }
+
+    report("gen_moves", count, nsecGen);
+    report("pos_move_is_legal", ops, nsecLegal);
+    report("gen_has_legal_move", count, nsecHas);
+
+    return ok && found == ops + count;
+}
+
+static void bench_moves(const Position *positions, size_t count)
+// SAN and LAN conversions, of all legal moves in all positions
+{
+    scope(str_destroy) str_t san = str_init(), lan = str_init();
+    move_t *moves = vec_init_reserve(64, move_t);
+    int64_t nsecSan = 0, nsecLan = 0, nsecParse = 0;
+    uint64_t ops = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        moves = gen_all_moves(&positions[i], moves);
+        ops += vec_size(moves);
+
+        int64_t lap = clock_nsec();
+
+        for (size_t j = 0; j < vec_size(moves); j++)
+            pos_move_to_san(&positions[i], moves[j], &san);
+
+        nsecSan += clock_nsec() - lap;
+        lap = clock_nsec();
+
+        for (size_t j = 0; j < vec_size(moves); j++)
+            pos_move_to_lan(&positions[i], moves[j], &lan);
+
+        nsecLan += clock_nsec() - lap;
+
+        for (size_t j = 0; j < vec_size(moves); j++) {
+            pos_move_to_lan(&positions[i], moves[j], &lan);
+            lap = clock_nsec();
+            const move_t m = pos_lan_to_move(&positions[i], lan.buf);
+            nsecParse += clock_nsec() - lap;
+
+            if (m != moves[j])
+                DIE("pos_lan_to_move() failed on '%s'\n", lan.buf);
+        }
+    }
+
+    report("pos_move_to_san", ops, nsecSan);
+    report("pos_move_to_lan", ops, nsecLan);
+    report("pos_lan_to_move", ops, nsecParse);
+    vec_destroy(moves);
+}
+
+static void bench_fen(const Position *positions, size_t count)
+// pos_get() and pos_set() round trips
+{
+    scope(str_destroy) str_t fen = str_init(), fen2 = str_init();
+    int64_t nsecGet = 0, nsecSet = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        int64_t lap = clock_nsec();
+        pos_get(&positions[i], &fen, false);
+        nsecGet += clock_nsec() - lap;
+
+        Position pos;
+        lap = clock_nsec();
+
+        if (!pos_set(&pos, fen.buf, positions[i].chess960, NULL))
+            DIE("pos_set() failed on '%s'\n", fen.buf);
+
+        nsecSet += clock_nsec() - lap;
+        pos_get(&pos, &fen2, false);
+
+        if (strcmp(fen.buf, fen2.buf))
+            DIE("FEN round trip failed: '%s' != '%s'\n", fen.buf, fen2.buf);
+    }
+
+    report("pos_get", count, nsecGet);
+    report("pos_set", count, nsecSet);
+}
+
+static void bench_resolve_pv(const Position *positions, size_t count, int len)
+// pos_resolve_pv(), as called by game_play() on each engine move: parse a long PV move by move,
+// checking the legality of each move, and keeping track of the last position not in check
+{
+    uint64_t seed = 0, ops = 0;
+    scope(str_destroy) str_t pv = str_init(), token = str_init();
+    move_t *moves = vec_init_reserve(64, move_t);
+    int64_t nsec = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        // Random PV of (at most) len plies
+        str_clear(&pv);
+        Position p[2], resolved;
+        p[0] = positions[i];
+
+        for (int ply = 0; ply < len; ply++) {
+            moves = gen_all_moves(&p[ply % 2], moves);
+
+            if (!vec_size(moves))
+                break;
+
+            const move_t m = moves[prng(&seed) % vec_size(moves)];
+            pos_move_to_lan(&p[ply % 2], m, &token);
+            str_push(str_cat(&pv, token), ' ');
+            pos_move(&p[(ply + 1) % 2], &p[ply % 2], m);
+            ops++;
+        }
+
+        const int64_t start = clock_nsec();
+
+        if (pos_resolve_pv(&positions[i], pv.buf, &token, &resolved))
+            DIE("illegal move '%s' in PV\n", token.buf);
+
+        nsec += clock_nsec() - start;
+    }
+
+    report("resolve_pv", ops, nsec);
+    vec_destroy(moves);
+}
+
+int main(int argc, char **argv)
+{
+    const char *epdFile = argc > 1 ? argv[1] : "test/chess960.epd";
+    const int depth = argc > 2 ? atoi(argv[2]) : 3;
+    bool ok = true;
+
+    // Reference positions: check perft counts
+    Position *positions = vec_init(Position);
+    int64_t nsec = 0;
+    uint64_t nodes = 0;
+
+    for (size_t i = 0; i < sizeof(Reference) / sizeof(*Reference); i++) {
+        Position pos;
+
+        if (!pos_set(&pos, Reference[i].fen, false, NULL))
+            DIE("Illegal FEN '%s'\n", Reference[i].fen);
+
+        vec_push(positions, pos);
+
+        const int64_t start = clock_nsec();
+        const uint64_t n = perft_run(&pos, 1, Reference[i].depth, "perft");
+        nsec += clock_nsec() - start;
+        nodes += n;
+
+        if (n != (uint64_t)Reference[i].nodes) {
+            fprintf(stderr, "perft(%d) = %" PRIu64 " instead of %d for '%s'\n",
+                Reference[i].depth, n, Reference[i].nodes, Reference[i].fen);
+            ok = false;
+        }
+    }
+
+    printf("{\"bench\": \"perft_total\", \"nodes\": %" PRIu64 ", \"nsec\": %" PRId64
+        ", \"nps\": %.0f, \"slider\": \"%s\"}\n", nodes, nsec,
+        (double)nodes * 1e9 / (double)max(nsec, 1), bb_pext() ? "pext" : "magic");
+
+    // EPD file: perft at fixed depth, over all positions
+    FILE *in = fopen(epdFile, "re");
+    DIE_IF(0, !in);
+    char line[256];
+    const size_t skip = vec_size(positions);
+
+    while (fgets(line, sizeof(line), in)) {
+        line[strcspn(line, ";\r\n")] = '\0';
+        Position pos;
+
+        if (*line && pos_set(&pos, line, false, NULL))
+            vec_push(positions, pos);
+    }
+
+    DIE_IF(0, fclose(in) < 0);
+    perft_run(&positions[skip], vec_size(positions) - skip, depth, "perft_epd");
+
+    // Micro-benchmarks, on all positions
+    bench_moves(positions, vec_size(positions));
+    bench_fen(positions, vec_size(positions));
+    ok = bench_legal(positions, vec_size(positions)) && ok;
+
+    for (size_t i = 0; i < sizeof(NoMoves) / sizeof(*NoMoves); i++) {
+        Position pos;
+
+        if (!pos_set(&pos, NoMoves[i], false, NULL))
+            DIE("Illegal FEN '%s'\n", NoMoves[i]);
+
+        if (gen_has_legal_move(&pos) || !check_legal(&pos)) {
+            fprintf(stderr, "gen_has_legal_move() failed on '%s'\n", NoMoves[i]);
+            ok = false;
+        }
+    }
+    bench_resolve_pv(positions, vec_size(positions), 64);
+
+    vec_destroy(positions);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -13,7 +13,13 @@
  * not, see <http://www.gnu.org/licenses/>.
 */
 // Stand alone program: minimal UCI engine (random mover) used for testing and benchmarking
+//
+// Usage: engine [SEED] [KEY=VALUE]...
+// The optional KEY=VALUE parameters turn it into a load generator (see Load). They are all off by
+// default, so that the plain random mover's output does not depend on them.
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include "gen.h"
 #include "util.h"
 #include "vec.h"
@@ -25,6 +31,42 @@ typedef struct {
     int depth;
 } Go;
 
+// Load generator parameters
+typedef struct {
+    double timeouts;  // timeouts=P: probability to ignore 'go' until 'stop' (needs a time limit)
+    double illegal;  // illegal=P: probability to play an illegal move
+    int lines;  // lines=N: extra info lines per depth iteration
+    int size;  // size=N: length of the free text ('info ... string') in these extra lines
+    int pv;  // pv=N: length of the PV (default 0 means same as depth)
+    int latency;  // latency=MSEC: wait before answering 'bestmove'
+} Load;
+
+static Load parse_load(int argc, char **argv)
+{
+    Load load = {0};
+
+    for (int i = 2; i < argc; i++) {
+        const char *tail = NULL;
+
+        if ((tail = str_prefix(argv[i], "timeouts=")))
+            load.timeouts = atof(tail);
+        else if ((tail = str_prefix(argv[i], "illegal=")))
+            load.illegal = atof(tail);
+        else if ((tail = str_prefix(argv[i], "lines=")))
+            load.lines = atoi(tail);
+        else if ((tail = str_prefix(argv[i], "size=")))
+            load.size = atoi(tail);
+        else if ((tail = str_prefix(argv[i], "pv=")))
+            load.pv = atoi(tail);
+        else if ((tail = str_prefix(argv[i], "latency=")))
+            load.latency = atoi(tail);
+        else
+            DIE("Illegal parameter '%s'\n", argv[i]);
+    }
+
+    return load;
+}
+
 static void parse_position(const char *tail, Position *pos, bool uciChess960)
 {
     scope(str_destroy) str_t token = str_init();
@@ -85,12 +127,22 @@ static void random_pv(const Position *pos, uint64_t *seed, int len, str_t *pv)
     vec_destroy(moves);
 }
 
-static void run_go(const Position *pos, const Go *go, uint64_t *seed)
+static void run_go(const Position *pos, const Go *go, const Load *load, uint64_t *seed,
+    uint64_t *loadSeed, str_t *pending)
+// Plays a random move at the end of a fake iterative deepening. The bestmove line is returned in
+// pending instead of being sent, if this go is meant to time out (sent upon 'stop').
 {
-    scope(str_destroy) str_t pv = str_init();
+    scope(str_destroy) str_t pv = str_init(), text = str_init();
+
+    for (int i = 0; i < load->size; i++)
+        str_push(&text, (char)('a' + i % 26));
 
     for (int depth = 1; depth <= go->depth; depth++) {
-        random_pv(pos, seed, depth, &pv);
+        for (int i = 0; i < load->lines; i++)
+            uci_printf("info depth %d seldepth %d nodes %d nps %d hashfull %d string %s\n", depth,
+                depth + i, 1000 * depth + i, 1000000 + i, i % 1000, text.buf);
+
+        random_pv(pos, seed, load->pv ? load->pv : depth, &pv);
         uci_printf("info depth %d score cp %d pv %s\n", depth,
             (int)((prng(seed) & 0xFFFFFFFF) - 0x80000000),
             pv.buf);
@@ -98,7 +150,23 @@ static void run_go(const Position *pos, const Go *go, uint64_t *seed)
 
     scope(str_destroy) str_t token = str_init();
     str_tok(pv.buf, &token, " ");
-    uci_printf("bestmove %s\n", token.buf);
+
+    // Illegal move: same from and to square
+    if (load->illegal && prngf(loadSeed) < load->illegal && token.len >= 4) {
+        token.buf[2] = token.buf[0];
+        token.buf[3] = token.buf[1];
+    }
+
+    if (load->latency)
+        nanosleep(&(struct timespec){.tv_sec = load->latency / 1000,
+            .tv_nsec = (load->latency % 1000) * 1000000L}, NULL);
+
+    str_cpy_fmt(pending, "bestmove %S", token);
+
+    if (!load->timeouts || prngf(loadSeed) >= load->timeouts) {
+        uci_puts(pending->buf);
+        str_clear(pending);
+    }
 }
 
 int main(int argc, char **argv)
@@ -108,10 +176,14 @@ int main(int argc, char **argv)
     bool uciChess960 = false;
     const uint64_t originalSeed = argc > 1 ? (uint64_t)atoll(argv[1]) : 0;
     uint64_t seed = originalSeed;
+    uint64_t loadSeed = ~originalSeed;  // not reset by ucinewgame, for misbehaviour to vary
+    const Load load = parse_load(argc, argv);
+    scope(str_destroy) str_t pending = str_init();  // bestmove held back until 'stop'
 
-    scope(str_destroy) str_t line = str_init();
+    LineReader in = line_reader_init(STDIN_FILENO);
+    str_t line = {0};
 
-    while (str_getline(&line, stdin)) {
+    while (line_reader_getline(&in, &line)) {
         const char *tail = NULL;
 
         if (!strcmp(line.buf, "uci")) {
@@ -131,8 +203,13 @@ int main(int argc, char **argv)
         else if ((tail = str_prefix(line.buf, "go "))) {
             tail = str_prefix(tail, "depth ");
             go.depth = tail ? atoi(tail) : 0;
-            run_go(&pos, &go, &seed);
+            run_go(&pos, &go, &load, &seed, &loadSeed, &pending);
+        } else if (!strcmp(line.buf, "stop") && pending.len) {
+            uci_puts(pending.buf);
+            str_clear(&pending);
         } else if (!strcmp(line.buf, "quit"))
             break;
     }
+
+    line_reader_destroy(&in);
 }